@@ -2,25 +2,133 @@
     @file   eeprom.h
     
     @brief  This file contains header function for eeprom.c
-            It also contains #define for PAGE_SIZE and EEPROM_SIZE
+            It also contains the locking modes and the device handle.
+            PAGE_SIZE and EEPROM_SIZE are defined in eeprom_geometry.h
 
     @author     Frank Lee
 */
 
+#ifndef EEPROM_H
+#define EEPROM_H
+
 #include <stdint.h>
 #include <stdio.h>
+#include "../include/eeprom_geometry.h"
 #include "../include/ll_func.h"
+#include "../include/eeprom_cache.h"
+#include "../include/eeprom_async.h"
+#include "../include/eeprom_stats.h"
+#include "../include/eeprom_wear.h"
+#include "../include/eeprom_txn.h"
+#include "../include/eeprom_stream.h"
+#include "../include/eeprom_prefetch.h"
+#include "../include/eeprom_snapshot.h"
+#include "../include/eeprom_crc.h"
+#include "../include/eeprom_view.h"
+#include "../include/eeprom_kv.h"
+#include "../include/eeprom_server.h"
+#include "../include/eeprom_client.h"
 #include <string.h>
 #include <pthread.h>
+#include <stdlib.h>
+#include <limits.h>
+
+// Number of pages covered by one lock in EEPROM_LOCK_STRIPED mode
+#define EEPROM_STRIPE_PAGES 4
+
+// Tries of a lock-free read in EEPROM_LOCK_SEQ mode before it locks
+#define EEPROM_SEQ_RETRIES 4
+
+enum eeprom_lock_mode {
+    EEPROM_LOCK_GLOBAL,     // One mutex, every access is serialized
+    EEPROM_LOCK_RW,         // One reader-writer lock, reads run concurrently
+    EEPROM_LOCK_STRIPED,    // Reader-writer lock per stripe of pages
+    EEPROM_LOCK_SEQ         // Writers take the mutex, reads of cached pages
+                            // take no lock and are checked against seq
+};
 
-#define PAGE_SIZE 32
-#define EEPROM_SIZE 8192
+// Page segments touched by one access, see page_span_init in eeprom.c
+struct page_span {
+    uint32_t head;      // Offset of the partially covered first page
+    int head_off;       // Where the access starts inside the head page
+    int head_len;       // Bytes of the head page accessed, 0 if no head
+    uint32_t body;      // Offset of the first fully covered page
+    int body_pages;     // Number of fully covered pages, 0 if no body
+    uint32_t tail;      // Offset of the partially covered last page
+    int tail_len;       // Bytes of the tail page accessed, 0 if no tail
+};
 
-extern pthread_mutex_t mem_mutex;
+// One segment of a batched eeprom_readv/eeprom_writev
+struct eeprom_iovec {
+    uint32_t offset;    // Offset from the beginning of EEPROM
+    int size;           // Number of bytes
+    char *buf;          // Buffer to read into or write from
+};
 
+// Everything needed to open a device
+struct eeprom_config {
+    struct eeprom_geometry geo;
+    struct ll_config ll;                // size and page_size come from geo
+    enum eeprom_lock_mode lock_mode;
+    enum eeprom_cache_mode cache_mode;
+    struct eeprom_wear_config wear;     // Off unless wear.spares > 0
+    enum eeprom_elide_mode elide_mode;
+    int journal_pages;                  // No transactions unless >= 3
+    int prefetch_depth;                 // Pages read ahead, 0 for none
+    int crc;                            // Per-page checksums unless 0
+};
+
+// An open device. It owns its image, its locks and its geometry, so
+// devices never contend with each other.
+struct eeprom_dev {
+    struct eeprom_geometry geo;
+    struct ll_dev *ll;
+    enum eeprom_lock_mode lock_mode;
+    pthread_mutex_t mutex;              // EEPROM_LOCK_GLOBAL
+    pthread_rwlock_t rwlock;            // EEPROM_LOCK_RW
+    pthread_rwlock_t *stripe_lock;      // EEPROM_LOCK_STRIPED
+    int num_stripes;
+    uint32_t seq;                       // EEPROM_LOCK_SEQ, odd while a writer runs
+    struct eeprom_cache cache;
+    enum eeprom_elide_mode elide_mode;
+    struct eeprom_async *async;         // Started by the first eeprom_aio_submit
+    struct eeprom_wear *wear;           // NULL without wear leveling
+    struct eeprom_journal *journal;     // NULL without transactions
+    struct eeprom_prefetch *prefetch;   // NULL without read-ahead
+    struct eeprom_crc *crc;             // NULL without checksums
+    pthread_mutex_t snapshot_lock;      // One eeprom_dev_snapshot at a time
+    struct eeprom_snapshot *snapshot;   // Snapshot being taken, or NULL
+};
+
+struct eeprom_dev *eeprom_open(const struct eeprom_config *config);
+void eeprom_close(struct eeprom_dev *dev);
+int eeprom_dev_read_bytes(struct eeprom_dev *dev, uint32_t offset, void *buf, size_t len);
+int eeprom_dev_write_bytes(struct eeprom_dev *dev, uint32_t offset, const void *buf, size_t len);
+int eeprom_dev_read(struct eeprom_dev *dev, uint32_t offset, int size, char *buf);
+int eeprom_dev_write(struct eeprom_dev *dev, uint32_t offset, int size, char *buf);
+int eeprom_dev_readv(struct eeprom_dev *dev, const struct eeprom_iovec *iov, int iovcnt);
+int eeprom_dev_writev(struct eeprom_dev *dev, const struct eeprom_iovec *iov, int iovcnt);
+int eeprom_dev_erase(struct eeprom_dev *dev, uint32_t offset, int size);
+int eeprom_dev_reset(struct eeprom_dev *dev);
+int eeprom_dev_param_check(struct eeprom_dev *dev, uint32_t offset, int size);
+void eeprom_dev_set_lock_mode(struct eeprom_dev *dev, enum eeprom_lock_mode mode);
+void eeprom_lock(struct eeprom_dev *dev, uint32_t offset, int size, int write);
+void eeprom_unlock(struct eeprom_dev *dev, uint32_t offset, int size, int write);
+
+// Same as above on the default device, which is opened on first use
+struct eeprom_dev *eeprom_default();
+int eeprom_configure(const struct eeprom_geometry *geo, const struct ll_config *config);
+int eeprom_read_bytes(uint32_t offset, void *buf, size_t len);
+int eeprom_write_bytes(uint32_t offset, const void *buf, size_t len);
 int eeprom_read(uint32_t offset, int size, char *buf);
 int eeprom_write(uint32_t offset, int size, char *buf);
+int eeprom_readv(const struct eeprom_iovec *iov, int iovcnt);
+int eeprom_writev(const struct eeprom_iovec *iov, int iovcnt);
 void eeprom_reset();
+int eeprom_erase(uint32_t offset, int size);
 int eeprom_param_check(uint32_t offset, int size);
 void mutex_lock();
 void mutex_unlock();
+void eeprom_set_lock_mode(enum eeprom_lock_mode mode);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+    @file   eeprom_async.h
+    
+    @brief  This file contains header functions for eeprom_async.c
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_ASYNC_H
+#define EEPROM_ASYNC_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct eeprom_dev;
+
+// Result of a request that has not completed yet
+#define EEPROM_AIO_PENDING 1
+
+// Maximum number of requests the worker takes from the queue at once
+#define EEPROM_AIO_BATCH 64
+
+enum eeprom_aio_op {
+    EEPROM_AIO_READ,
+    EEPROM_AIO_WRITE
+};
+
+struct eeprom_aio;
+typedef void (*eeprom_aio_callback)(struct eeprom_aio *aio);
+
+// One asynchronous request. The caller owns it and its buffer, and must
+// keep both alive until the request completes. The pointer to it is the
+// request token.
+struct eeprom_aio {
+    enum eeprom_aio_op op;
+    uint32_t offset;
+    int size;
+    char *buf;                      // No '\0' is stored after a read
+    eeprom_aio_callback callback;   // Called by the worker, may be NULL
+    void *arg;                      // For the callback
+    int result;                     // EEPROM_AIO_PENDING until completion
+    struct eeprom_aio *next;        // Used by the queue
+};
+
+// Submission queue and worker thread of one device
+struct eeprom_async {
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t work;            // Signalled on submit and stop
+    pthread_cond_t done;            // Broadcast when a batch completes
+    struct eeprom_aio *head;
+    struct eeprom_aio *tail;
+    int stop;
+};
+
+int eeprom_aio_submit(struct eeprom_dev *dev, struct eeprom_aio *aio);
+int eeprom_aio_poll(struct eeprom_aio *aio);
+int eeprom_aio_wait(struct eeprom_dev *dev, struct eeprom_aio *aio);
+void eeprom_async_stop(struct eeprom_dev *dev);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+    @file   eeprom_cache.h
+    
+    @brief  This file contains header functions for eeprom_cache.c
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_CACHE_H
+#define EEPROM_CACHE_H
+
+#include <stdint.h>
+
+struct eeprom_dev;
+
+enum eeprom_cache_mode {
+    EEPROM_CACHE_OFF,           // Every page access goes to the image
+    EEPROM_CACHE_WRITETHROUGH,  // Reads from RAM, writes go to RAM and the image
+    EEPROM_CACHE_WRITEBACK      // Reads and writes in RAM until eeprom_flush
+};
+
+// When page writes that would not change the page are skipped
+enum eeprom_elide_mode {
+    EEPROM_ELIDE_KNOWN,         // When the page contents are known without extra I/O
+    EEPROM_ELIDE_READ,          // Also read uncached pages to compare them
+    EEPROM_ELIDE_OFF            // Always write
+};
+
+// Page cache of one device. The tables are allocated for the device
+// geometry when the cache is turned on and freed when it is turned off.
+struct eeprom_cache {
+    enum eeprom_cache_mode mode;
+    char *image;        // RAM copy of the whole image
+    uint8_t *valid;     // One byte per page, 1 if image holds the page
+    uint32_t *dirty;    // Bitmap of pages not written to the image yet
+    int pages;
+};
+
+void eeprom_dev_set_cache_mode(struct eeprom_dev *dev, enum eeprom_cache_mode mode);
+enum eeprom_cache_mode eeprom_dev_get_cache_mode(struct eeprom_dev *dev);
+int eeprom_dev_flush(struct eeprom_dev *dev);
+int eeprom_dev_sync(struct eeprom_dev *dev);
+int cache_read(struct eeprom_dev *dev, uint32_t offset, char *buf);
+int cache_write(struct eeprom_dev *dev, uint32_t offset, const char *buf);
+int cache_read_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, char *buf);
+int cache_load_pages(struct eeprom_dev *dev, uint32_t offset, int num_page);
+void cache_close(struct eeprom_dev *dev);
+int cache_write_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, const char *buf);
+int cache_write_through_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, const char *buf);
+int cache_erase_pages(struct eeprom_dev *dev, uint32_t offset, int num_page);
+int cache_flush_locked(struct eeprom_dev *dev);
+void eeprom_dev_set_elide_mode(struct eeprom_dev *dev, enum eeprom_elide_mode mode);
+
+// Same as above on the default device
+void eeprom_set_cache_mode(enum eeprom_cache_mode mode);
+enum eeprom_cache_mode eeprom_get_cache_mode();
+int eeprom_flush();
+int eeprom_sync();
+void eeprom_set_elide_mode(enum eeprom_elide_mode mode);
+
+#endif
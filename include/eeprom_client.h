@@ -0,0 +1,48 @@
+/*
+    @file   eeprom_client.h
+
+    @brief  This file contains header functions for eeprom_client.c
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_CLIENT_H
+#define EEPROM_CLIENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Requests a client can have in flight
+#define EEPROM_CLIENT_DEPTH 64
+
+// A request sent and not completed yet
+struct eeprom_client_slot {
+    uint32_t id;
+    void *buf;                  // Where read data goes, NULL for writes
+    int size;
+};
+
+// Connection to an eeprom_server. Requests are buffered and sent in one
+// go when the first of them is completed. A client is used by one thread.
+struct eeprom_client {
+    int fd;
+    uint32_t next_id;
+    char *out;                  // Requests not sent yet
+    size_t out_len, out_cap;
+    struct eeprom_client_slot slot[EEPROM_CLIENT_DEPTH];
+    int head;                   // Oldest request in flight
+    int count;                  // Requests in flight
+    int broken;                 // Out of step with the server, every call fails
+};
+
+struct eeprom_client *eeprom_client_open(const char *path);
+void eeprom_client_close(struct eeprom_client *c);
+int eeprom_client_send_read(struct eeprom_client *c, uint32_t offset, int size, void *buf);
+int eeprom_client_send_write(struct eeprom_client *c, uint32_t offset, int size, const void *buf);
+int eeprom_client_complete(struct eeprom_client *c);
+int eeprom_client_read_bytes(struct eeprom_client *c, uint32_t offset, void *buf, size_t len);
+int eeprom_client_write_bytes(struct eeprom_client *c, uint32_t offset, const void *buf, size_t len);
+int eeprom_client_read(struct eeprom_client *c, uint32_t offset, int size, char *buf);
+int eeprom_client_write(struct eeprom_client *c, uint32_t offset, int size, char *buf);
+
+#endif
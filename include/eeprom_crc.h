@@ -0,0 +1,59 @@
+/*
+    @file   eeprom_crc.h
+
+    @brief  This file contains header functions for eeprom_crc.c
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_CRC_H
+#define EEPROM_CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "../include/eeprom_geometry.h"
+
+struct eeprom_dev;
+
+#define EEPROM_CRC_MAGIC 0x43524333u        // "CRC3"
+
+// Table pages that may be dirty before a write writes them back
+#define EEPROM_CRC_DIRTY_MAX 8
+
+// First page of the checksum region, written on open and on close
+struct crc_header {
+    uint32_t magic;
+    uint32_t pages;             // Logical pages covered
+    uint32_t clean;             // 1 if the table was written back on close
+    uint32_t check;             // CRC-32 of the three fields above
+};
+
+// Checksums of one device, after the journal (or the data pages) of its
+// image: a header page followed by one CRC-32 per logical page.
+struct eeprom_crc {
+    uint32_t start;             // Offset of the header page in the image
+    int table_pages;
+    uint32_t *table;            // RAM copy of the table, always current
+    uint32_t *dirty;            // Bitmap of table pages not written back
+    int num_dirty;
+    int stale;                  // Entries rebuilt on open after a power loss
+    uint32_t erased;            // CRC-32 of an erased page
+    pthread_mutex_t lock;       // Serializes table updates and write back
+};
+
+uint32_t eeprom_crc32(uint32_t crc, const void *buf, size_t len);
+uint32_t crc_region_size(const struct eeprom_geometry *geo);
+int crc_open(struct eeprom_dev *dev, uint32_t start);
+void crc_close(struct eeprom_dev *dev);
+int crc_flush(struct eeprom_dev *dev);
+int crc_check_pages(struct eeprom_dev *dev, int first, int num_page, const char *buf);
+int crc_read_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, char *buf);
+int crc_write_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, const char *buf);
+int crc_erase_pages(struct eeprom_dev *dev, uint32_t offset, int num_page);
+int eeprom_dev_verify(struct eeprom_dev *dev, uint32_t *bad, int max);
+
+// Same as above on the default device
+int eeprom_verify(uint32_t *bad, int max);
+
+#endif
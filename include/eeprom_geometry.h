@@ -0,0 +1,62 @@
+/*
+    @file   eeprom_geometry.h
+    
+    @brief  This file contains the build-time default geometry and the
+            geometries a device can be configured with
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_GEOMETRY_H
+#define EEPROM_GEOMETRY_H
+
+#include <stdint.h>
+
+// Default geometry, can be changed at build time with for example
+// -DEEPROM_PAGE_SHIFT=6 -DEEPROM_SIZE=65536. Pages are always a power of
+// two, so page math is done with shifts and masks.
+#ifndef EEPROM_PAGE_SHIFT
+#define EEPROM_PAGE_SHIFT 5
+#endif
+#ifndef EEPROM_SIZE
+#define EEPROM_SIZE 8192
+#endif
+#define PAGE_SIZE (1 << EEPROM_PAGE_SHIFT)
+
+// Supported geometries: 32 to 256 byte pages, 8 KB to 512 KB
+#define EEPROM_MIN_PAGE_SHIFT 5
+#define EEPROM_MAX_PAGE_SHIFT 8
+#define EEPROM_MAX_PAGE_SIZE (1 << EEPROM_MAX_PAGE_SHIFT)
+#define EEPROM_MIN_SIZE (8*1024)
+#define EEPROM_MAX_SIZE (512*1024)
+
+_Static_assert(EEPROM_PAGE_SHIFT >= EEPROM_MIN_PAGE_SHIFT && EEPROM_PAGE_SHIFT <= EEPROM_MAX_PAGE_SHIFT,
+               "EEPROM_PAGE_SHIFT out of range");
+_Static_assert(EEPROM_SIZE >= EEPROM_MIN_SIZE && EEPROM_SIZE <= EEPROM_MAX_SIZE &&
+               (EEPROM_SIZE & (EEPROM_SIZE-1)) == 0, "EEPROM_SIZE must be a power of two in range");
+
+struct eeprom_geometry {
+    int page_shift;     // Pages are 1 << page_shift bytes
+    uint32_t size;      // Capacity in bytes
+};
+
+/*
+    This function checks that a geometry is one of the supported ones.
+    
+    @return: 1 if supported, 0 otherwise
+*/
+static inline int geometry_supported(const struct eeprom_geometry *geo) {
+    return geo->page_shift >= EEPROM_MIN_PAGE_SHIFT && geo->page_shift <= EEPROM_MAX_PAGE_SHIFT &&
+           geo->size >= EEPROM_MIN_SIZE && geo->size <= EEPROM_MAX_SIZE &&
+           (geo->size & (geo->size - 1)) == 0;
+}
+
+static inline uint32_t geometry_page_size(const struct eeprom_geometry *geo) {
+    return 1u << geo->page_shift;
+}
+
+static inline uint32_t geometry_num_pages(const struct eeprom_geometry *geo) {
+    return geo->size >> geo->page_shift;
+}
+
+#endif
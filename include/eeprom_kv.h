@@ -0,0 +1,87 @@
+/*
+    @file   eeprom_kv.h
+
+    @brief  This file contains header functions for eeprom_kv.c
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_KV_H
+#define EEPROM_KV_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+struct eeprom_dev;
+
+#define EEPROM_KV_MAGIC 0x4b564c47u         // "KVLG", first page of a half
+#define EEPROM_KV_REC_MAGIC 0x4b565245u     // "KVRE", start of a record
+
+#define EEPROM_KV_KEY_MAX 32
+#define EEPROM_KV_VALUE_MAX 1024
+#define EEPROM_KV_BUCKETS 64
+
+// Fill level of the log, in percent, at which a put starts compacting
+// on a helper thread
+#define EEPROM_KV_COMPACT_PCT 75
+
+// val_len of a record that deletes its key
+#define EEPROM_KV_DELETED 0xffff
+
+// First page of the active half
+struct kv_half_header {
+    uint32_t magic;
+    uint32_t gen;               // Bumped by every compaction
+    uint32_t check;             // CRC-32 of the two fields above
+};
+
+// Every record starts on a page and is followed by its key and value.
+// check is the CRC-32 of the lengths, the key and the value, so a record
+// torn by a power loss ends the log.
+struct kv_rec_header {
+    uint32_t magic;
+    uint32_t check;
+    uint16_t key_len;
+    uint16_t val_len;
+};
+
+// Where the latest record of a key is, relative to the active half
+struct kv_entry {
+    struct kv_entry *next;
+    uint32_t pos;
+    uint16_t val_len;
+    char key[EEPROM_KV_KEY_MAX + 1];
+};
+
+// Log-structured store in a page aligned region of a device. The region
+// is split into two halves, only one of them is active and records are
+// appended to it, and compaction copies the live records into the other
+// half.
+struct eeprom_kv {
+    struct eeprom_dev *dev;
+    uint32_t offset;            // Start of the region
+    uint32_t half;              // Size of a half, whole pages
+    int active;                 // 0 or 1
+    uint32_t gen;
+    uint32_t tail;              // Where the next record goes in the active half
+    uint32_t live;              // Bytes of the active half held by live records
+    int count;                  // Live keys
+    struct kv_entry *bucket[EEPROM_KV_BUCKETS];
+    pthread_mutex_t lock;       // Held for index updates, not for copying
+    pthread_cond_t compacted;   // Signaled when the helper thread is done
+    pthread_t compactor;
+    int compacting;             // The helper thread has not finished yet
+    int joinable;               // The helper thread was started and not joined
+    int compact_failed;         // The helper thread could not access the
+                                // device, the next put compacts again
+};
+
+struct eeprom_kv *eeprom_kv_open(struct eeprom_dev *dev, uint32_t offset, uint32_t size);
+void eeprom_kv_close(struct eeprom_kv *kv);
+int eeprom_kv_get(struct eeprom_kv *kv, const char *key, void *buf, size_t len);
+int eeprom_kv_put(struct eeprom_kv *kv, const char *key, const void *val, size_t len);
+int eeprom_kv_delete(struct eeprom_kv *kv, const char *key);
+int eeprom_kv_compact(struct eeprom_kv *kv);
+
+#endif
@@ -9,14 +9,61 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "../include/eeprom.h"
 #include "../include/ll_func.h"
 
+// Device the tests start from: 32-byte pages, 8192 bytes and an image
+// accessed with pread. A test names its image and the fields it changes.
+#define TEST_CONFIG(image, ...) ((struct eeprom_config){ .geo = { 5, 8192 }, \
+        .ll = { .path = (image), .mode = LL_MODE_PREAD }, __VA_ARGS__ })
+
 int main();
 
 void eeprom_read_test();
+void reset_test();
 void eeprom_write_test();
+void cache_test();
+void vector_test();
+void bytes_test();
+void async_test();
+void stats_test();
+struct eeprom_dev *test_open(const struct eeprom_config *cfg);
+void test_close(struct eeprom_dev *dev);
+void wear_test();
+void elide_test();
+int txn_test_commit(struct eeprom_dev *dev, char c);
+void *txn_test_thread(void *vargp);
+void txn_test();
+void stream_test();
+int prefetch_test_scan(struct eeprom_dev *dev, char *model, uint32_t offset, int size, int stride);
+void prefetch_test();
+void *snapshot_test_writer(void *vargp);
+void snapshot_test();
+int erase_test_blank(const char *buf, int len);
+void erase_test();
+void crc_test_rot(const char *path, long pos);
+void crc_test();
+void *view_test_writer(void *vargp);
+void view_test();
+int lock_test_uniform(const char *p, int len);
+void *lock_test_writer(void *vargp);
+void *lock_test_reader(void *vargp);
+void lock_test();
+void *seq_test_writer(void *vargp);
+void *seq_test_reader(void *vargp);
+void seq_test();
+void kv_test();
+void server_test();
+void backend_test();
+void bus_test();
+void async_test_callback(struct eeprom_aio *aio);
+long elapsed_us(const struct timespec *start);
+void timing_test();
+void geometry_test();
+void *geometry_test_thread(void *vargp);
 void *thread_func_0(void *vargp);
 void *thread_func_1(void *vargp);
 void *thread_func_2(void *vargp);
@@ -0,0 +1,69 @@
+/*
+    @file   eeprom_prefetch.h
+
+    @brief  This file contains header functions for eeprom_prefetch.c
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_PREFETCH_H
+#define EEPROM_PREFETCH_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "../include/eeprom_async.h"
+
+struct eeprom_dev;
+
+// Number of page runs that can be prefetched at the same time
+#define EEPROM_PREFETCH_WINDOWS 4
+
+enum prefetch_state {
+    PREFETCH_EMPTY,
+    PREFETCH_LOADING,           // Read queued on the async worker
+    PREFETCH_READY
+};
+
+// A run of pages read ahead of the caller
+struct prefetch_window {
+    enum prefetch_state state;
+    uint32_t first;             // First page
+    int pages;
+    int stale;                  // Written while loading, dropped on completion
+    uint64_t touched;           // When it was last filled or read, the oldest is reused first
+    uint8_t *used;              // One byte per page, 1 once it was read from here
+    char *buf;                  // depth pages
+    struct eeprom_aio aio;
+    struct eeprom_prefetch *pf;
+};
+
+// Read-ahead state of one device
+struct eeprom_prefetch {
+    int depth;                  // Pages read ahead, 0 while shutting down
+    pthread_mutex_t lock;
+    pthread_cond_t idle;        // Broadcast when a window stops loading
+    uint64_t tick;
+    struct prefetch_window win[EEPROM_PREFETCH_WINDOWS];
+};
+
+// Recent reads of one thread, to tell where it goes next
+struct prefetch_stream {
+    struct eeprom_dev *dev;
+    uint32_t last_off;
+    uint32_t last_end;
+    uint32_t stride;            // Distance between the last two reads
+};
+
+void prefetch_open(struct eeprom_dev *dev, int depth);
+void prefetch_close(struct eeprom_dev *dev);
+int prefetch_read_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, char *buf);
+int prefetch_write_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, const char *buf);
+int prefetch_erase_pages(struct eeprom_dev *dev, uint32_t offset, int num_page);
+void prefetch_note(struct eeprom_dev *dev, uint32_t offset, int size);
+void eeprom_dev_set_prefetch_depth(struct eeprom_dev *dev, int depth);
+int eeprom_dev_get_prefetch_depth(struct eeprom_dev *dev);
+
+// Same as above on the default device
+void eeprom_set_prefetch_depth(int depth);
+
+#endif
@@ -0,0 +1,72 @@
+/*
+    @file   eeprom_server.h
+
+    @brief  This file contains header functions for eeprom_server.c and
+            the wire protocol spoken with eeprom_client.c
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_SERVER_H
+#define EEPROM_SERVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+struct eeprom_dev;
+
+#define EEPROM_SERVER_PATH "/tmp/eeprom.sock"
+
+enum eeprom_server_op {
+    EEPROM_OP_READ = 1,
+    EEPROM_OP_WRITE = 2
+};
+
+// Request, followed by size bytes for EEPROM_OP_WRITE. Fields are in host
+// byte order, the socket never leaves the machine.
+struct eeprom_server_req {
+    uint32_t id;                // Echoed in the response
+    uint16_t op;
+    uint16_t pad;
+    uint32_t offset;
+    int32_t size;
+};
+
+// Response, followed by size bytes: the data of an EEPROM_OP_READ that
+// passed eeprom_param_check, nothing otherwise. Responses come back in the
+// order the requests were sent.
+struct eeprom_server_resp {
+    uint32_t id;
+    int32_t status;             // Same as eeprom_dev_read_bytes/_write_bytes
+    int32_t size;
+};
+
+// One client connection. Bytes are buffered both ways, so the server
+// never blocks on a client.
+struct eeprom_server_conn {
+    int fd;
+    char *in;                   // Received bytes not handled yet
+    size_t in_len, in_cap;
+    size_t in_done;             // Bytes of in taken by the current round
+    char *out;                  // Responses not sent yet, from out_off on
+    size_t out_len, out_off, out_cap;
+    size_t out_round;           // Responses of the current round start here
+    int closing;                // Drop once the responses are out
+};
+
+// A daemon thread serving one device over a Unix domain socket.
+struct eeprom_server {
+    struct eeprom_dev *dev;
+    int listen_fd;
+    int wake[2];                // Self-pipe written by eeprom_server_stop
+    pthread_t thread;
+    struct eeprom_server_conn *conns;
+    int num_conns, cap_conns;
+    char path[108];
+};
+
+struct eeprom_server *eeprom_server_start(struct eeprom_dev *dev, const char *path);
+void eeprom_server_stop(struct eeprom_server *srv);
+
+#endif
@@ -0,0 +1,44 @@
+/*
+    @file   eeprom_snapshot.h
+
+    @brief  This file contains header functions for eeprom_snapshot.c
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_SNAPSHOT_H
+#define EEPROM_SNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct eeprom_dev;
+
+// Pages a snapshot reads per transfer. Writers to those pages wait for
+// the transfer, writers elsewhere carry on.
+#define EEPROM_SNAPSHOT_CHUNK 64
+
+// A snapshot being taken. A page is copied into buf once: by the
+// snapshot, or by the first write to it, just before the write.
+struct eeprom_snapshot {
+    char *buf;
+    uint32_t *copied;           // Bitmap of the pages already in buf
+    int failed;                 // A page could not be read
+};
+
+void snapshot_preserve(struct eeprom_dev *dev, uint32_t offset, int num_page);
+
+int eeprom_dev_snapshot(struct eeprom_dev *dev, void *buf, size_t len);
+int eeprom_dev_restore(struct eeprom_dev *dev, const void *buf, size_t len);
+int eeprom_dev_snapshot_file(struct eeprom_dev *dev, const char *path);
+int eeprom_dev_restore_file(struct eeprom_dev *dev, const char *path);
+int eeprom_dev_program(struct eeprom_dev *dev, uint32_t offset, const void *buf, size_t len);
+
+// Same as above on the default device
+int eeprom_snapshot(void *buf, size_t len);
+int eeprom_restore(const void *buf, size_t len);
+int eeprom_snapshot_file(const char *path);
+int eeprom_restore_file(const char *path);
+int eeprom_program(uint32_t offset, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+    @file   eeprom_stats.h
+    
+    @brief  This file contains header functions for eeprom_stats.c
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_STATS_H
+#define EEPROM_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Optional, more expensive parts of the instrumentation
+#define EEPROM_STATS_LOCK_TIMING 0x1    // Lock wait and hold time
+#define EEPROM_STATS_TRACE 0x2          // Ring buffer of locked operations
+
+// Records kept by the trace, a power of 2
+#define EEPROM_TRACE_SIZE 4096
+
+struct eeprom_stats {
+    uint64_t calls[4];          // eeprom_read/eeprom_write calls per alignment case
+    uint64_t vector_calls;      // eeprom_readv/eeprom_writev calls
+    uint64_t page_reads;        // Pages read from the image
+    uint64_t page_writes;       // Pages written to the image
+    uint64_t rmw;               // Partially written pages that had to be read first
+    uint64_t bytes_read;        // Bytes returned to callers
+    uint64_t bytes_written;     // Bytes given by callers
+    uint64_t lock_acquires;     // With EEPROM_STATS_LOCK_TIMING only
+    uint64_t lock_wait_ns;
+    uint64_t lock_hold_ns;
+    uint64_t wear_moves;        // Logical pages moved by wear leveling
+    uint64_t elided_writes;     // Page writes skipped, the page was unchanged
+    uint64_t txn_commits;       // Transactions given to eeprom_txn_commit
+    uint64_t journal_blocks;    // Journal blocks written, one per commit group
+    uint64_t prefetch_pages;    // Pages queued for read-ahead
+    uint64_t prefetch_hits;     // Page reads served by read-ahead
+    uint64_t prefetch_waste;    // Pages read ahead and dropped unread
+    uint64_t page_erases;       // Pages erased on the image
+    uint64_t crc_errors;        // Pages that failed their checksum
+    uint64_t view_copies;       // Views that had to copy the bytes
+    uint64_t seq_reads;         // Reads served without a lock (EEPROM_LOCK_SEQ)
+    uint64_t seq_retries;       // Lock-free reads that raced with a writer
+    uint64_t bus_transactions;  // Commands on the simulated bus (ll_config.bus)
+    uint64_t bus_bytes;         // Bytes on the wire, command and address included
+    uint64_t bus_polls;         // ACK polls or status reads during write cycles
+    uint64_t server_requests;   // Requests served by eeprom_server
+    uint64_t server_batches;    // Rounds of requests it served together
+};
+
+// Counter indexes, in the order of the fields above
+enum eeprom_stat {
+    STAT_CALLS_CASE1,
+    STAT_CALLS_CASE2,
+    STAT_CALLS_CASE3,
+    STAT_CALLS_CASE4,
+    STAT_VECTOR_CALLS,
+    STAT_PAGE_READS,
+    STAT_PAGE_WRITES,
+    STAT_RMW,
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_LOCK_ACQUIRES,
+    STAT_LOCK_WAIT_NS,
+    STAT_LOCK_HOLD_NS,
+    STAT_WEAR_MOVES,
+    STAT_ELIDED_WRITES,
+    STAT_TXN_COMMITS,
+    STAT_JOURNAL_BLOCKS,
+    STAT_PREFETCH_PAGES,
+    STAT_PREFETCH_HITS,
+    STAT_PREFETCH_WASTE,
+    STAT_PAGE_ERASES,
+    STAT_CRC_ERRORS,
+    STAT_VIEW_COPIES,
+    STAT_SEQ_READS,
+    STAT_SEQ_RETRIES,
+    STAT_BUS_TRANSACTIONS,
+    STAT_BUS_BYTES,
+    STAT_BUS_POLLS,
+    STAT_SERVER_REQUESTS,
+    STAT_SERVER_BATCHES,
+    STAT_COUNT
+};
+
+// One locked operation
+struct eeprom_trace_rec {
+    uint64_t start_ns;          // When the lock was requested
+    uint32_t wait_ns;
+    uint32_t hold_ns;
+    uint32_t offset;
+    int size;
+    uint32_t thread;            // Small id of the calling thread
+    int write;
+};
+
+extern int eeprom_stats_flags;
+
+// Counters of the calling thread, set up by its first stats_add
+extern __thread uint64_t *stats_counters;
+
+uint64_t *stats_register();
+uint64_t stats_now();
+void stats_lock_acquired(uint64_t wait_start);
+void stats_lock_released(uint32_t offset, int size, int write);
+
+void eeprom_stats_set_flags(int flags);
+void eeprom_stats_snapshot(struct eeprom_stats *out);
+void eeprom_stats_reset();
+int eeprom_trace_read(struct eeprom_trace_rec *out, int max);
+void eeprom_trace_dump(FILE *f);
+
+/*
+    This function adds n to a counter of the calling thread. Only the
+    owning thread writes its counters, so no atomic read-modify-write is
+    needed; the relaxed store just keeps eeprom_stats_snapshot from
+    seeing a torn value.
+*/
+static inline void stats_add(enum eeprom_stat stat, uint64_t n) {
+    uint64_t *c = stats_counters;
+    if (__builtin_expect(c == NULL, 0)) {
+        c = stats_register();
+    }
+    __atomic_store_n(&c[stat], __atomic_load_n(&c[stat], __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+#endif
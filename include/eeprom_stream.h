@@ -0,0 +1,44 @@
+/*
+    @file   eeprom_stream.h
+
+    @brief  This file contains header functions for eeprom_stream.c
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_STREAM_H
+#define EEPROM_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../include/eeprom_async.h"
+
+struct eeprom_dev;
+
+enum eeprom_stream_mode {
+    EEPROM_STREAM_READ,
+    EEPROM_STREAM_WRITE
+};
+
+// Sequential cursor over a device. It buffers the page at the cursor,
+// so an access never re-reads or re-writes a page it shares with the
+// previous one.
+struct eeprom_stream {
+    struct eeprom_dev *dev;
+    enum eeprom_stream_mode mode;
+    uint32_t pos;               // Next byte given to or taken from the caller
+    uint32_t page;              // Offset of the page in cur, UINT32_MAX for none
+    char *cur;
+    int lo, hi;                 // EEPROM_STREAM_WRITE: bytes of cur to write back
+    char *next;                 // EEPROM_STREAM_READ: page being prefetched
+    struct eeprom_aio prefetch;
+    int prefetching;            // prefetch was submitted and not waited for
+};
+
+struct eeprom_stream *eeprom_stream_open(struct eeprom_dev *dev, uint32_t offset,
+                                         enum eeprom_stream_mode mode);
+int eeprom_stream_read_next(struct eeprom_stream *s, void *buf, size_t len);
+int eeprom_stream_write_next(struct eeprom_stream *s, const void *buf, size_t len);
+int eeprom_stream_close(struct eeprom_stream *s);
+
+#endif
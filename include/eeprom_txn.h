@@ -0,0 +1,77 @@
+/*
+    @file   eeprom_txn.h
+    
+    @brief  This file contains header functions for eeprom_txn.c
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_TXN_H
+#define EEPROM_TXN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+struct eeprom_dev;
+
+#define EEPROM_JOURNAL_MAGIC 0x4A524E4Cu    // "JRNL"
+
+// State of the journal block, kept in its header page
+enum journal_state {
+    JOURNAL_COMMITTED = 1,      // Pages must be (re)applied on open
+    JOURNAL_APPLIED = 2         // Nothing to do
+};
+
+// First page of the journal. It is written after the rest of the block,
+// so a block only counts once its header made it to the image.
+struct journal_header {
+    uint32_t magic;
+    uint32_t state;
+    uint32_t seq;
+    uint32_t npages;            // Pages in the block
+    uint32_t check;             // Checksum of the index and data pages
+};
+
+// Buffered write of a transaction
+struct txn_seg {
+    uint32_t offset;
+    int size;
+    char *buf;                  // Copy of the caller's data
+};
+
+struct eeprom_txn {
+    struct eeprom_dev *dev;
+    struct txn_seg *seg;
+    int nseg;
+    int cap;
+    int pages;                  // Upper bound of the pages it touches
+    int result;
+    int done;
+    struct eeprom_txn *next;    // Commit queue
+};
+
+// Journal of one device, after the data (and wear leveling) pages of
+// its image. Commits that arrive while another one is being written are
+// grouped into the next journal block.
+struct eeprom_journal {
+    uint32_t start;             // Offset of the header page in the image
+    int pages;
+    uint32_t seq;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    struct eeprom_txn *head;    // Commits waiting for a leader
+    struct eeprom_txn *tail;
+    int busy;                   // A leader is writing a block
+    int unapplied;              // The last block may be committed but not applied
+};
+
+int journal_open(struct eeprom_dev *dev, uint32_t start, int pages);
+void journal_close(struct eeprom_dev *dev);
+
+struct eeprom_txn *eeprom_txn_begin(struct eeprom_dev *dev);
+int eeprom_txn_write(struct eeprom_txn *txn, uint32_t offset, const void *buf, size_t len);
+int eeprom_txn_commit(struct eeprom_txn *txn);
+void eeprom_txn_abort(struct eeprom_txn *txn);
+
+#endif
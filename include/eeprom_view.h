@@ -0,0 +1,34 @@
+/*
+    @file   eeprom_view.h
+
+    @brief  This file contains header functions for eeprom_view.c
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_VIEW_H
+#define EEPROM_VIEW_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct eeprom_dev;
+
+// Read-only view of a byte range of a device. Writers to the range wait
+// until it is released, see eeprom_dev_view_acquire for what the thread
+// holding it must not do.
+struct eeprom_view {
+    const char *data;           // The bytes, valid until eeprom_view_release
+    size_t len;
+    struct eeprom_dev *dev;
+    uint32_t offset;
+    char *copy;                 // Set when data is a copy, not the image
+};
+
+int eeprom_dev_view_acquire(struct eeprom_dev *dev, uint32_t offset, size_t len, struct eeprom_view *view);
+void eeprom_view_release(struct eeprom_view *view);
+
+// Same as above on the default device
+int eeprom_view_acquire(uint32_t offset, size_t len, struct eeprom_view *view);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+    @file   eeprom_wear.h
+    
+    @brief  This file contains header functions for eeprom_wear.c
+
+    @author     Frank Lee
+*/
+
+#ifndef EEPROM_WEAR_H
+#define EEPROM_WEAR_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "../include/eeprom_geometry.h"
+
+struct eeprom_dev;
+
+// Default number of writes a physical page takes before its logical page
+// is moved to a spare
+#define EEPROM_WEAR_THRESHOLD 64
+
+// Seeds the check word of a metadata entry, so a zero filled or erased
+// metadata region holds no valid entry
+#define EEPROM_WEAR_MAGIC 0x5EA1DA7Au
+
+struct eeprom_wear_config {
+    int spares;         // Spare physical pages, 0 turns wear leveling off
+    int threshold;      // 0 for EEPROM_WEAR_THRESHOLD
+};
+
+// Metadata entry of one physical page, written when a logical page moves
+// into it
+struct wear_entry {
+    uint32_t seq;       // Move number, the highest entry of a logical page wins
+    uint32_t erase;     // Erase count of the page after the move
+    uint32_t logical;   // Logical page moved in
+    uint32_t check;     // seq ^ erase ^ logical ^ EEPROM_WEAR_MAGIC
+};
+
+// Last slot of a metadata page, after page_size / 16 - 1 entries. Every
+// metadata page has two copies on the image and a move writes the one
+// not in use, so a torn write never costs the page the entries it held.
+struct wear_footer {
+    uint32_t seq;       // seq of the move that wrote the copy, the highest wins
+    uint32_t mpage;     // Metadata page number
+    uint32_t pad;
+    uint32_t check;     // CRC-32 of the copy up to here, seeded with EEPROM_WEAR_MAGIC
+};
+
+// Wear leveling state of one device. The image holds phys_pages data pages
+// followed by two copies of each of the meta_pages pages of wear_entry,
+// one entry per data page.
+struct eeprom_wear {
+    pthread_mutex_t lock;       // Serializes writes and moves
+    int logical_pages;
+    int phys_pages;
+    int meta_pages;
+    int per_meta;               // Entries per metadata page
+    int threshold;
+    uint32_t *l2p;              // Physical page of every logical page
+    int32_t *p2l;               // Logical page of every physical page, -1 for a spare
+    uint32_t *erase;            // Erase count of every physical page
+    uint32_t *since;            // Writes since the page got its logical page
+    int *spare;                 // Physical pages not holding a logical page
+    int num_spares;
+    struct wear_entry *meta;    // RAM copy of the entries, one per physical page
+    uint8_t *meta_copy;         // Copy (0 or 1) of every metadata page in use
+    uint32_t seq;
+    uint64_t moves;
+};
+
+struct eeprom_wear_info {
+    uint32_t min_erase;
+    uint32_t max_erase;
+    uint64_t moves;             // Logical pages moved since the device was opened
+};
+
+uint32_t wear_image_size(const struct eeprom_geometry *geo, const struct eeprom_wear_config *cfg);
+int wear_open(struct eeprom_dev *dev, const struct eeprom_wear_config *cfg);
+void wear_close(struct eeprom_dev *dev);
+int wear_read_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, char *buf);
+int wear_write_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, const char *buf);
+int wear_erase_pages(struct eeprom_dev *dev, uint32_t offset, int num_page);
+int eeprom_dev_wear_info(struct eeprom_dev *dev, struct eeprom_wear_info *out);
+
+#endif
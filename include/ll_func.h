@@ -1,14 +1,108 @@
 /*
     @file   ll_func.h
-    
+
     @brief  This file contains header functions for ll_func.c
+            It also contains the backing store configuration and the
+            handle of an open image
 
     @author     Frank Lee
 */
 
+#ifndef LL_FUNC_H
+#define LL_FUNC_H
+
 #include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
+#include "../include/eeprom_geometry.h"
+
+#define LL_DEFAULT_PAGE_SIZE PAGE_SIZE
+#define LL_DEFAULT_PATH "test.txt"
+#define LL_DEFAULT_SIZE EEPROM_SIZE
+
+// How the image file is accessed once it is open
+enum ll_mode {
+    LL_MODE_MMAP,       // Image is mapped, a page read/write is a memcpy
+    LL_MODE_PREAD       // Image is accessed with pread/pwrite
+};
+
+// When written pages are pushed to stable storage
+enum ll_sync {
+    LL_SYNC_NONE,       // Leave it to the kernel (or an explicit ll_sync)
+    LL_SYNC_WRITE       // msync/fdatasync after every ll_write
+};
+
+// Command set the image is accessed with. With a bus, every access is
+// turned into the commands of a serial part, which are counted (see
+// eeprom_stats) and charged to the timing model with their command and
+// address bytes.
+enum ll_bus {
+    LL_BUS_NONE,        // Page transfers, no command or address bytes
+    LL_BUS_I2C,         // 24Cxx: device address, word address, data. A
+                        // write burst stays within a page, ACK polling
+    LL_BUS_SPI          // 25xx: READ/WRITE opcodes after WREN, address,
+                        // data. RDSR polling, page erase command
+};
+
+// Timing of the simulated part. All zero (the default) makes every
+// access complete instantly.
+struct ll_timing {
+    uint32_t byte_ns;       // Bus transfer time per byte
+    uint32_t page_write_ns; // Write cycle (tWR) per page written
+    int busy;               // 0: a write returns after its write cycle
+                            // 1: a write returns after the transfer, and
+                            //    the next access polls until the write
+                            //    cycle is over
+};
 
+// What an erased byte reads back as
+#define LL_ERASED_BYTE 0xFF
+
+// A 400 kHz I2C part with a 5 ms write cycle (9 bus clocks per byte)
+#define LL_TIMING_I2C_400K { .byte_ns = 22500, .page_write_ns = 5000000, .busy = 1 }
+
+struct ll_config {
+    const char *path;   // Image file
+    uint32_t size;      // Size of the image in bytes
+    uint32_t page_size; // Bytes per page, 0 for LL_DEFAULT_PAGE_SIZE
+    enum ll_mode mode;
+    enum ll_sync sync;
+    struct ll_timing timing;
+    enum ll_bus bus;
+};
+
+// An open image
+struct ll_dev {
+    int fd;
+    char *map;                  // Only used in LL_MODE_MMAP
+    struct ll_config config;
+    char path[256];
+    pthread_mutex_t timing_lock;
+    uint64_t bus_free;          // When the bus is idle again (ns)
+    uint64_t ready;             // When the write cycle is over (ns)
+    int fail_armed;             // Power loss simulation, see ll_dev_fail_after
+    int fail_pages_left;
+};
+
+struct ll_dev *ll_dev_open(const struct ll_config *config);
+void ll_dev_close(struct ll_dev *ll);
+int ll_dev_sync(struct ll_dev *ll);
+int ll_dev_read_pages(struct ll_dev *ll, uint32_t offset, int num_page, char *buf);
+int ll_dev_write_pages(struct ll_dev *ll, uint32_t offset, int num_page, const char *buf);
+int ll_dev_read_bytes(struct ll_dev *ll, uint32_t offset, size_t len, char *buf);
+int ll_dev_write_bytes(struct ll_dev *ll, uint32_t offset, size_t len, const char *buf);
+void ll_dev_set_timing(struct ll_dev *ll, const struct ll_timing *timing);
+int ll_dev_erase(struct ll_dev *ll, uint32_t offset, int num_page);
+void ll_dev_fail_after(struct ll_dev *ll, int pages);
+
+// Same as above on the default image
+int ll_open(const struct ll_config *config);
+int ll_close();
+int ll_sync();
 int ll_read(uint32_t offset, char *buf);
-int ll_write(uint32_t offset, char *buf);
+int ll_write(uint32_t offset, const char *buf);
+int ll_read_pages(uint32_t offset, int num_page, char *buf);
+int ll_write_pages(uint32_t offset, int num_page, const char *buf);
 void ll_eeprom_reset();
+
+#endif
@@ -11,271 +11,892 @@
 #define DEBUG_MODE 0
 
 
-// Global mem_mutex that is being used by both eeprom_read and eeprom_write
-pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Device used by the functions without a handle (eeprom_read, ...)
+static struct eeprom_dev *default_dev;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
 
 
 
 /*
-    This function reads from EEPROM memory and stores the read values
-    into a character array given in the parameter. To fulfill all
-    corner/edge cases, this function is divided into four big cases.
-    The explanation of each case is given in README.md file.
-    When the read begins, it locks the mem_mutex and only unlocks when
-    the function returns.
+    This function splits an access of size bytes at offset into the
+    page segments it touches:
+    - head: the partially covered page the access starts in
+    - body: the run of pages the access covers completely
+    - tail: the partially covered page the access ends in
+    Any of them can be empty. An access that starts and ends inside one
+    page is only a head. The four cases described in README.md are the
+    four combinations of an empty or non-empty head and tail.
+    It is always inlined, so with a constant shift the page math folds
+    into constant shifts and masks.
     
+    @param *span: The segments to fill in
+    @param offset: Amount of offset from the beginning of EEPROM
+    @param size: Size of the access, at least 1
+    @param shift: Pages are 1 << shift bytes
+*/
+static inline __attribute__((always_inline))
+void page_span_init(struct page_span *span, uint32_t offset, int size, const int shift) {
+    const uint32_t page_size = 1u << shift;
+    const uint32_t mask = page_size - 1;
+    uint32_t end = offset + size;
+    uint32_t first = offset & ~mask;
+    uint32_t last = (end-1) & ~mask;
     
+    memset(span, 0, sizeof(*span));
+    if ((offset & mask) != 0 || (first == last && (end & mask) != 0)) {
+        span->head = first;
+        span->head_off = offset & mask;
+        span->head_len = (first == last ? end : first + page_size) - offset;
+        first += page_size;
+    }
+    if ((end & mask) != 0 && last >= first) {
+        span->tail = last;
+        span->tail_len = end & mask;
+        last -= page_size;
+    }
+    if (last + page_size > first) {
+        span->body = first;
+        span->body_pages = ((last - first) >> shift) + 1;
+    }
+}
+
+/*
+    This function tells which of the four cases of README.md an access
+    falls in, as the counter to bump.
+*/
+static inline enum eeprom_stat span_case(uint32_t offset, int size, uint32_t mask) {
+    if ((offset & mask) == 0) {
+        return (size & mask) == 0 ? STAT_CALLS_CASE1 : STAT_CALLS_CASE2;
+    }
+    return ((offset + size) & mask) == 0 ? STAT_CALLS_CASE3 : STAT_CALLS_CASE4;
+}
+
+/*
+    This function checks whether writing len bytes of buf over the same
+    bytes of a page that was just read would change nothing, in which
+    case the page write is skipped.
+*/
+static inline int span_unchanged(struct eeprom_dev *dev, const char *page, const char *buf, int len) {
+    if (dev->elide_mode == EEPROM_ELIDE_OFF || memcmp(page, buf, len) != 0) {
+        return 0;
+    }
+    stats_add(STAT_ELIDED_WRITES, 1);
+    return 1;
+}
+
+/*
+    This function tells whether the span engine hands an access straight
+    to the simulated bus (see ll_config.bus) as byte commands: the image
+    holds the logical bytes, and no layer in between keeps copies or
+    checksums of them.
+*/
+static int span_direct(const struct eeprom_dev *dev) {
+    return dev->ll->config.bus != LL_BUS_NONE && dev->cache.mode == EEPROM_CACHE_OFF &&
+           dev->wear == NULL && dev->crc == NULL && dev->prefetch == NULL;
+}
+
+/*
+    This function is the lock-free read of EEPROM_LOCK_SEQ. When every
+    page of the access is held by the page cache, the bytes are copied
+    straight from its RAM copy, and the copy only counts if dev->seq was
+    even and did not change meanwhile, i.e. no writer ran. The RAM copy
+    stays allocated until eeprom_close, so a read that raced with a
+    writer copies garbage and tries again, but never faults. The copy
+    is a plain loop and is left alone by the thread sanitizer, since
+    racing with writers is the point of it.
+    
+    @return: 1 if buf holds the bytes, 0 if the caller must lock and
+             read them
+*/
+__attribute__((no_sanitize_thread))
+static int span_read_seq(struct eeprom_dev *dev, uint32_t offset, int size, char *buf, const int shift) {
+    const struct eeprom_cache *cache = &dev->cache;
+    const uint32_t first = offset >> shift, last = (offset + size - 1) >> shift;
+    uint32_t page;
+    int tries, i;
+    
+    for (tries = 0; tries < EEPROM_SEQ_RETRIES; tries++) {
+        uint32_t seq = __atomic_load_n(&dev->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            stats_add(STAT_SEQ_RETRIES, 1);
+            continue;
+        }
+        if (__atomic_load_n(&cache->mode, __ATOMIC_RELAXED) == EEPROM_CACHE_OFF) {
+            return 0;
+        }
+        for (page = first; page <= last; page++) {
+            if (!__atomic_load_n(&cache->valid[page], __ATOMIC_ACQUIRE)) {
+                return 0;
+            }
+        }
+        for (i = 0; i < size; i++) {
+            buf[i] = cache->image[offset + i];
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&dev->seq, __ATOMIC_RELAXED) == seq) {
+            stats_add(STAT_SEQ_READS, 1);
+            return 1;
+        }
+        stats_add(STAT_SEQ_RETRIES, 1);
+    }
+    return 0;
+}
+
+/*
+    This function is the read half of the span engine. The edge pages
+    are read into a temp page and only the wanted bytes are copied, while
+    the body is read straight into buf with one multi-page transfer.
+    In EEPROM_LOCK_SEQ mode, cached pages are read without a lock first
+    (see span_read_seq). On a bus the whole span is one sequential read
+    when span_direct allows it.
+    
+    @param *dev: The device
     @param offset: Amount of offset from the beginning of EEPROM
     @param size: Size of desired read access
     @param *buf: Pointer to the buffer to store the read values
+    @param shift: Pages are 1 << shift bytes
     
-    @return: 0 for successful read
-    @return: -1 for invalid offset
-    @return: -2 for invalid size
-    @return: -3 for index out of bound
+    @return: 0 for success, -5 for failure to access the device
 */
-int eeprom_read(uint32_t offset, int size, char *buf) {
-
-    // Checking input validity
-    int param_check = eeprom_param_check(offset, size);
-    if (param_check != 0) {
-        return param_check;
+static inline __attribute__((always_inline))
+int span_read(struct eeprom_dev *dev, uint32_t offset, int size, char *buf, const int shift) {
+    struct page_span span;
+    page_span_init(&span, offset, size, shift);
+    // Temp page
+    char temp[1 << shift];
+    int err = 0;
+    
+    stats_add(span_case(offset, size, (1u << shift) - 1), 1);
+    stats_add(STAT_BYTES_READ, size);
+    
+    if (dev->lock_mode == EEPROM_LOCK_SEQ && span_read_seq(dev, offset, size, buf, shift)) {
+        return 0;
+    }
+    // Lock the pages being read
+    eeprom_lock(dev, offset, size, 0);
+    if (span_direct(dev)) {
+        err = ll_dev_read_bytes(dev->ll, offset, size, buf);
+        eeprom_unlock(dev, offset, size, 0);
+        return err != 0 ? -5 : 0;
     }
+    if (span.head_len > 0) {
+        err |= cache_read(dev, span.head, temp);
+        memcpy(buf, temp + span.head_off, span.head_len);  // Storing only desired bytes
+    }
+    if (span.body_pages > 0) {
+        err |= cache_read_pages(dev, span.body, span.body_pages, buf + span.head_len);
+    }
+    if (span.tail_len > 0) {
+        err |= cache_read(dev, span.tail, temp);
+        memcpy(buf + size - span.tail_len, temp, span.tail_len);
+    }
+    if (dev->prefetch != NULL) {
+        prefetch_note(dev, offset, size);
+    }
+    // Unlock the pages
+    eeprom_unlock(dev, offset, size, 0);
     
-    // Incrementer
-    int i;
-    int j;
+    return err != 0 ? -5 : 0;
+}
+
+/*
+    This function is the write half of the span engine. The edge pages
+    are read, partially overwritten and written back, while the body is
+    written straight from buf with one multi-page transfer. An edge page
+    the new bytes would not change is not written back, and unchanged
+    body pages are skipped by cache_write_pages. On a bus, when
+    span_direct allows it, the bytes are written with one write burst
+    per page instead, and no page is read (unless EEPROM_ELIDE_READ asks
+    for it).
+    
+    @param *dev: The device
+    @param offset: Amount of offset from the beginning of EEPROM
+    @param size: Size of desired write access
+    @param *buf: Pointer to the buffer to be written in EEPROM
+    @param shift: Pages are 1 << shift bytes
     
-    // Number of page reads to do
-    int num_page;
+    @return: 0 for success, -5 for failure to access the device
+*/
+static inline __attribute__((always_inline))
+int span_write(struct eeprom_dev *dev, uint32_t offset, int size, const char *buf, const int shift) {
+    struct page_span span;
+    page_span_init(&span, offset, size, shift);
     // Temp page
-    char temp[PAGE_SIZE];
-    
-    // Case #1: offset and size are both multiples of PAGE_SIZE
-    if (offset % PAGE_SIZE == 0 && size % PAGE_SIZE == 0) {
-        // Because size is a multiple of PAGE_SIZE, size/PAGE_SIZE is number of page reads
-        num_page = size/PAGE_SIZE;
-        // Lock memory mutex
-        mutex_lock(&mem_mutex);
-        for (i = 0; i < num_page; i++) {
-            ll_read(offset + i*PAGE_SIZE, buf + i*PAGE_SIZE); // Copying the read bytes into buf
-        }
-        // Unlock memory mutex
-        mutex_unlock(&mem_mutex);
-    }
-    
-    // Case #2: offset is multiple of PAGE_SIZE and size is not multiple of PAGE_SIZE
-    else if (offset % PAGE_SIZE == 0 && size % PAGE_SIZE != 0) {
-        // The number of page reads is the truncated value of size, which is still
-        // size/PAGE_SIZE
-        num_page = size/PAGE_SIZE;
-        // Lock memory mutex
-        mutex_lock(&mem_mutex);
-        for (i = 0; i < num_page; i++) {
-            ll_read(offset + i*PAGE_SIZE, buf + i*PAGE_SIZE); // Copying the read bytes into buf
+    char temp[1 << shift];
+    int err = 0;
+    
+    stats_add(span_case(offset, size, (1u << shift) - 1), 1);
+    stats_add(STAT_BYTES_WRITTEN, size);
+    
+    // Lock the pages being written
+    eeprom_lock(dev, offset, size, 1);
+    if (span_direct(dev) && dev->elide_mode != EEPROM_ELIDE_READ) {
+        uint32_t first = offset >> shift << shift;
+        snapshot_preserve(dev, first, (int)((offset + size - first + (1u << shift) - 1) >> shift));
+        err = ll_dev_write_bytes(dev->ll, offset, size, buf);
+        eeprom_unlock(dev, offset, size, 1);
+        return err != 0 ? -5 : 0;
+    }
+    stats_add(STAT_RMW, (span.head_len > 0) + (span.tail_len > 0));
+    if (span.head_len > 0) {
+        err |= cache_read(dev, span.head, temp);      // Read entire page to temp
+        if (!span_unchanged(dev, temp + span.head_off, buf, span.head_len)) {
+            memcpy(temp + span.head_off, buf, span.head_len);   // Overwriting portion of temp
+            err |= cache_write(dev, span.head, temp);     // Copy the updated page back
         }
-        // Reading the remaining bytes
-        ll_read((i+offset/PAGE_SIZE)*PAGE_SIZE, temp);    // Reading entire page
-        // Unlock memory mutex
-        mutex_unlock(&mem_mutex);
-        memcpy(buf + i*PAGE_SIZE, temp, size%PAGE_SIZE);  // Storing only desired bytes from the page
-        memset(temp, 0, PAGE_SIZE-1);    // Clear temp array
-    }
-    
-    // Case #3: offset is not a multiple of PAGE_SIZE and offset+size is multiple of PAGE_SIZE
-    else if (offset % PAGE_SIZE != 0 && (offset+size) % PAGE_SIZE == 0) {
-        // Lock memory mutex
-        mutex_lock(&mem_mutex);
-        ll_read((offset/PAGE_SIZE)*PAGE_SIZE, temp);  // Reading the floor(offset)'th page
-        memcpy(buf, temp+(offset%PAGE_SIZE), PAGE_SIZE-(offset%PAGE_SIZE));  // Storing only desired bytes
-        memset(temp, 0, PAGE_SIZE-1);    // Clear temp array
-        
-        // Number of page reads is the floor(size)
-        num_page = size/PAGE_SIZE;
-        // This incrementer indicates the ceil(offset), where page reads should begin
-        j = (offset/PAGE_SIZE)+1;  
-        for (i = 0; i < num_page; i++) {
-            ll_read(j*PAGE_SIZE, buf+(PAGE_SIZE-(offset%PAGE_SIZE))+(i*PAGE_SIZE));
-            j++;
+    }
+    if (span.body_pages > 0) {
+        err |= cache_write_pages(dev, span.body, span.body_pages, buf + span.head_len);
+    }
+    if (span.tail_len > 0) {
+        err |= cache_read(dev, span.tail, temp);
+        if (!span_unchanged(dev, temp, buf + size - span.tail_len, span.tail_len)) {
+            memcpy(temp, buf + size - span.tail_len, span.tail_len);
+            err |= cache_write(dev, span.tail, temp);
         }
-        // Unlock memory mutex
-        mutex_unlock(&mem_mutex);
     }
+    // Unlock the pages
+    eeprom_unlock(dev, offset, size, 1);
     
-    // Case #4: offset is not multiple of PAGE_SIZE and offset+size is not multiple of PAGE_SIZE
-    else if (offset % PAGE_SIZE != 0 && size % PAGE_SIZE != 0) {
-        // Lock memory mutex
-        mutex_lock(&mem_mutex);
-        // Same behavior as above to read first couple bytes
-        ll_read((offset/PAGE_SIZE)*PAGE_SIZE, temp);
-        memcpy(buf, temp+(offset%PAGE_SIZE), PAGE_SIZE-(offset%PAGE_SIZE));
-        memset(temp, 0, PAGE_SIZE-1);
-        
-        // Number of page reads is the number of aligned pages in size
-        num_page = ((offset+size)/PAGE_SIZE) - ((offset/PAGE_SIZE)+1);
-        // Same behavior as Case #3
-        j = (offset/PAGE_SIZE)+1;
-        for (i = 0; i < num_page; i++) {
-            ll_read(j*PAGE_SIZE, buf+(PAGE_SIZE-(offset%PAGE_SIZE))+(i*PAGE_SIZE));
-            j++;
-        }
-        
-        // Do one more page read after where we left off
-        ll_read(j*PAGE_SIZE, temp);
-        // Unlock memory mutex
-        mutex_unlock(&mem_mutex);
-        // Storing only desired bytes
-        memcpy(buf+(i*PAGE_SIZE)+(PAGE_SIZE-(offset%PAGE_SIZE)), temp, (offset+size)%PAGE_SIZE);
-        memset(temp, 0, PAGE_SIZE-1);
+    return err != 0 ? -5 : 0;
+}
+
+// One copy of the span engine per supported page size, each compiled with
+// a constant shift
+#define DEFINE_SPAN_ENGINE(shift) \
+    static int span_read_##shift(struct eeprom_dev *dev, uint32_t offset, int size, char *buf) { \
+        return span_read(dev, offset, size, buf, shift); \
+    } \
+    static int span_write_##shift(struct eeprom_dev *dev, uint32_t offset, int size, const char *buf) { \
+        return span_write(dev, offset, size, buf, shift); \
     }
+
+DEFINE_SPAN_ENGINE(5)
+DEFINE_SPAN_ENGINE(6)
+DEFINE_SPAN_ENGINE(7)
+DEFINE_SPAN_ENGINE(8)
+
+// Span engines indexed by page shift
+static int (*const span_read_engine[EEPROM_MAX_PAGE_SHIFT+1])(struct eeprom_dev *, uint32_t, int, char *) = {
+    [5] = span_read_5, [6] = span_read_6, [7] = span_read_7, [8] = span_read_8,
+};
+static int (*const span_write_engine[EEPROM_MAX_PAGE_SHIFT+1])(struct eeprom_dev *, uint32_t, int, const char *) = {
+    [5] = span_write_5, [6] = span_write_6, [7] = span_write_7, [8] = span_write_8,
+};
+
+/*
+    This function opens a device. The device gets its own image, locks,
+    cache and geometry, so any number of devices can be used at the same
+    time without contending with each other.
+    
+    @param *config: Geometry, backing store, lock mode, cache mode, wear
+                    leveling, journal and read-ahead, or NULL for the
+                    build-time default geometry on LL_DEFAULT_PATH with
+                    the global lock and none of the others. The
+                    image size and page size are taken from the geometry
+                    (plus the spares with wear leveling and the journal
+                    pages with transactions).
+    
+    @return: The open device, or NULL for an unsupported geometry or an
+             image that could not be opened or recovered
+*/
+struct eeprom_dev *eeprom_open(const struct eeprom_config *config) {
+    struct eeprom_config defaults = {
+        .geo = { EEPROM_PAGE_SHIFT, EEPROM_SIZE },
+        .ll = { .path = LL_DEFAULT_PATH, .mode = LL_MODE_MMAP, .sync = LL_SYNC_NONE },
+        .lock_mode = EEPROM_LOCK_GLOBAL,
+        .cache_mode = EEPROM_CACHE_OFF,
+    };
+    if (config == NULL) {
+        config = &defaults;
+    }
+    if (!geometry_supported(&config->geo)) {
+        printf("ERROR: Unsupported geometry!\n");
+        return NULL;
+    }
+    if (config->journal_pages != 0 && config->journal_pages < 3) {
+        printf("ERROR: A journal needs at least 3 pages!\n");
+        return NULL;
+    }
+    
+    struct ll_config ll = config->ll;
+    ll.size = config->geo.size;
+    ll.page_size = geometry_page_size(&config->geo);
+    if (config->wear.spares > 0) {
+        ll.size = wear_image_size(&config->geo, &config->wear);
+    }
+    uint32_t journal_start = ll.size;
+    ll.size += (uint32_t)config->journal_pages * ll.page_size;
+    uint32_t crc_start = ll.size;
+    if (config->crc) {
+        ll.size += crc_region_size(&config->geo);
+    }
+    
+    struct eeprom_dev *dev = calloc(1, sizeof(*dev));
+    dev->ll = ll_dev_open(&ll);
+    if (dev->ll == NULL) {
+        free(dev);
+        return NULL;
+    }
+    dev->geo = config->geo;
+    if (config->wear.spares > 0 && wear_open(dev, &config->wear) != 0) {
+        ll_dev_close(dev->ll);
+        free(dev);
+        return NULL;
+    }
+    dev->lock_mode = config->lock_mode;
+    dev->elide_mode = config->elide_mode;
+    pthread_mutex_init(&dev->mutex, NULL);
+    pthread_rwlock_init(&dev->rwlock, NULL);
+    pthread_mutex_init(&dev->snapshot_lock, NULL);
+    dev->num_stripes = (geometry_num_pages(&dev->geo) + EEPROM_STRIPE_PAGES - 1)/EEPROM_STRIPE_PAGES;
+    dev->stripe_lock = malloc(dev->num_stripes * sizeof(pthread_rwlock_t));
+    for (int i = 0; i < dev->num_stripes; i++) {
+        pthread_rwlock_init(&dev->stripe_lock[i], NULL);
+    }
+    // Recovery writes to the image, so it goes before the cache, and it
+    // updates the checksums
+    if (config->crc && crc_open(dev, crc_start) != 0) {
+        eeprom_close(dev);
+        return NULL;
+    }
+    if (config->journal_pages > 0 && journal_open(dev, journal_start, config->journal_pages) != 0) {
+        eeprom_close(dev);
+        return NULL;
+    }
+    eeprom_dev_set_cache_mode(dev, config->cache_mode);
+    if (config->prefetch_depth > 0) {
+        prefetch_open(dev, config->prefetch_depth);
+    }
+    return dev;
+}
+
+/*
+    This function completes queued asynchronous requests, flushes the
+    cache of a device, closes its image and
+    frees it. No other thread may be using the device.
+    
+    @param *dev: The device to close
+*/
+void eeprom_close(struct eeprom_dev *dev) {
+    if (dev == NULL) {
+        return;
+    }
+    eeprom_async_stop(dev);
+    eeprom_dev_set_cache_mode(dev, EEPROM_CACHE_OFF);
+    cache_close(dev);
+    prefetch_close(dev);
+    journal_close(dev);
+    crc_close(dev);
+    wear_close(dev);
+    ll_dev_close(dev->ll);
+    for (int i = 0; i < dev->num_stripes; i++) {
+        pthread_rwlock_destroy(&dev->stripe_lock[i]);
+    }
+    free(dev->stripe_lock);
+    pthread_rwlock_destroy(&dev->rwlock);
+    pthread_mutex_destroy(&dev->snapshot_lock);
+    pthread_mutex_destroy(&dev->mutex);
+    free(dev);
+}
+
+/*
+    This function opens the default device if nobody configured it
+    before its first use.
+*/
+static void open_default() {
+    if (default_dev == NULL) {
+        default_dev = eeprom_open(NULL);
+    }
+}
+
+/*
+    This function returns the device used by the functions without a
+    handle, opening it on first use.
+*/
+struct eeprom_dev *eeprom_default() {
+    pthread_once(&default_once, open_default);
+    return default_dev;
+}
+
+/*
+    This function reopens the default device with another geometry and
+    image. Its lock and cache modes are kept. It must be called while no
+    other thread is accessing the default device.
     
-    // Ending the character array
-    buf[size] = '\0';
+    @param *geo: Page size and capacity, must be geometry_supported
+    @param *config: Backing store configuration, or NULL for the default
+                    image. Its size and page_size are taken from geo.
+    
+    @return: 0 for success
+    @return: -1 for unsupported geometry or failure to open the image,
+             the default device is left as it was
+*/
+int eeprom_configure(const struct eeprom_geometry *geo, const struct ll_config *config) {
+    struct eeprom_dev *old = eeprom_default();
+    struct eeprom_config cfg = {
+        .geo = *geo,
+        .ll = { .path = LL_DEFAULT_PATH, .mode = LL_MODE_MMAP, .sync = LL_SYNC_NONE },
+        .lock_mode = old != NULL ? old->lock_mode : EEPROM_LOCK_GLOBAL,
+        .cache_mode = old != NULL ? old->cache.mode : EEPROM_CACHE_OFF,
+        .elide_mode = old != NULL ? old->elide_mode : EEPROM_ELIDE_KNOWN,
+        .prefetch_depth = old != NULL ? eeprom_dev_get_prefetch_depth(old) : 0,
+    };
+    if (config != NULL) {
+        cfg.ll = *config;
+    }
+    
+    // Queued requests and cached pages reach the image before it is reopened
+    if (old != NULL) {
+        eeprom_async_stop(old);
+        eeprom_dev_flush(old);
+    }
+    struct eeprom_dev *dev = eeprom_open(&cfg);
+    if (dev == NULL) {
+        return -1;
+    }
+    default_dev = dev;
+    eeprom_close(old);
     return 0;
 }
 
+/*
+    This function checks the parameters of a byte access. Lengths that
+    do not fit in an int are out of bound for any geometry.
+*/
+static int bytes_param_check(struct eeprom_dev *dev, uint32_t offset, size_t len) {
+    if (len > INT_MAX) {
+        printf("ERROR: Index out of bound!\n");
+        return -3;
+    }
+    return eeprom_dev_param_check(dev, offset, (int)len);
+}
 
 /*
-    This function writes to EEPROM memory with offset and size given by
-    a character array in the parameter. To fulfill all
-    corner/edge cases, this function is divided into four big cases.
-    The explanation of each case is given in README.md file.
-    When the write begins, it locks the mem_mutex and only unlocks when
-    the function returns.
+    This function reads len bytes from EEPROM memory into buf. The
+    access is split into head, body and tail segments by page_span_init
+    and handed to the span engine built for the device's page size.
+    When the read begins, it locks the pages being read (see eeprom_lock)
+    and only unlocks when all page reads are done.
+    Nothing is stored past buf[len-1].
     
+    @param *dev: The device
+    @param offset: Amount of offset from the beginning of EEPROM
+    @param *buf: Pointer to the buffer to store len bytes
+    @param len: Size of desired read access
+    
+    @return: 0 for successful read
+    @return: -1 for invalid offset
+    @return: -2 for invalid size
+    @return: -3 for index out of bound
+    @return: -5 for failure to access the device
+*/
+int eeprom_dev_read_bytes(struct eeprom_dev *dev, uint32_t offset, void *buf, size_t len) {
+    int param_check = bytes_param_check(dev, offset, len);
+    if (param_check != 0) {
+        return param_check;
+    }
+    return span_read_engine[dev->geo.page_shift](dev, offset, (int)len, buf);
+}
+
+/*
+    This function writes len bytes from buf to EEPROM memory. The buffer
+    may hold any bytes, '\0' included. The access is split into head,
+    body and tail segments by page_span_init and handed to the span
+    engine built for the device's page size.
+    When the write begins, it locks the pages being written (see
+    eeprom_lock) and only unlocks when all page writes are done.
     
+    @param *dev: The device
     @param offset: Amount of offset from the beginning of EEPROM
-    @param size: Size of desired read access
-    @param *buf: Pointer to the buffer to be written in EEPROM
+    @param *buf: Pointer to the len bytes to be written in EEPROM
+    @param len: Size of desired write access
     
     @return: 0 for successful write
     @return: -1 for invalid offset
     @return: -2 for invalid size
     @return: -3 for index out of bound
-    @return: -4 for sizeof(buf) != size
+    @return: -5 for failure to access the device
 */
-int eeprom_write(uint32_t offset, int size, char *buf) {
+int eeprom_dev_write_bytes(struct eeprom_dev *dev, uint32_t offset, const void *buf, size_t len) {
+    int param_check = bytes_param_check(dev, offset, len);
+    if (param_check != 0) {
+        return param_check;
+    }
+    return span_write_engine[dev->geo.page_shift](dev, offset, (int)len, buf);
+}
+
+/*
+    This function reads from EEPROM memory and stores the read values
+    into a character array given in the parameter, followed by a '\0',
+    so buf must hold size+1 bytes. See eeprom_dev_read_bytes.
+    
+    @param *dev: The device
+    @param offset: Amount of offset from the beginning of EEPROM
+    @param size: Size of desired read access
+    @param *buf: Pointer to the buffer to store the read values
+    
+    @return: Same as eeprom_dev_read_bytes
+*/
+int eeprom_dev_read(struct eeprom_dev *dev, uint32_t offset, int size, char *buf) {
+    if (size <= 0) {
+        return eeprom_dev_param_check(dev, offset, size);
+    }
+    int ret = eeprom_dev_read_bytes(dev, offset, buf, size);
+    if (ret == 0 || ret == -5) {
+        // Ending the character array
+        buf[size] = '\0';
+    }
+    return ret;
+}
+
 
+/*
+    This function writes a string to EEPROM memory. The string must be
+    exactly size characters long. See eeprom_dev_write_bytes.
+    
+    @param *dev: The device
+    @param offset: Amount of offset from the beginning of EEPROM
+    @param size: Size of desired write access
+    @param *buf: Pointer to the string to be written in EEPROM
+    
+    @return: Same as eeprom_dev_write_bytes
+    @return: -4 for strlen(buf) != size
+*/
+int eeprom_dev_write(struct eeprom_dev *dev, uint32_t offset, int size, char *buf) {
 
     // Checking for input validity
-    int param_check = eeprom_param_check(offset, size);
+    int param_check = eeprom_dev_param_check(dev, offset, size);
     if (param_check != 0) {
         return param_check;
     }
     // Checking the input buf size
-    if (strlen(buf) != size) {
+    if (strnlen(buf, size + 1) != size) {
         printf("ERROR: Size of buf is different than the amount of size to be written!\n");
         return -4;
     }
     
-    // Incrementer
+    return eeprom_dev_write_bytes(dev, offset, buf, size);
+}
+
+/*
+    These functions do the same as the functions above on the default
+    device.
+*/
+int eeprom_read_bytes(uint32_t offset, void *buf, size_t len) {
+    return eeprom_dev_read_bytes(eeprom_default(), offset, buf, len);
+}
+int eeprom_write_bytes(uint32_t offset, const void *buf, size_t len) {
+    return eeprom_dev_write_bytes(eeprom_default(), offset, buf, len);
+}
+int eeprom_read(uint32_t offset, int size, char *buf) {
+    return eeprom_dev_read(eeprom_default(), offset, size, buf);
+}
+int eeprom_write(uint32_t offset, int size, char *buf) {
+    return eeprom_dev_write(eeprom_default(), offset, size, buf);
+}
+
+/*
+    This function orders two segment pointers by offset for qsort.
+*/
+static int iov_compare(const void *a, const void *b) {
+    const struct eeprom_iovec *x = *(const struct eeprom_iovec **)a;
+    const struct eeprom_iovec *y = *(const struct eeprom_iovec **)b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/*
+    This function checks every segment, sorts them by offset and finds
+    the byte span they cover. It is shared by eeprom_dev_readv and
+    eeprom_dev_writev.
+    
+    @param *dev: The device
+    @param *iov: Segments given by the caller
+    @param iovcnt: Number of segments
+    @param **sorted: Set to a malloc'd array of pointers to the segments,
+                     sorted by offset. The caller frees it.
+    @param *lo: Set to the smallest segment offset
+    @param *hi: Set to the largest segment end
+    
+    @return: 0 for success, otherwise the eeprom_dev_param_check error of
+             the first invalid segment, or -2 for iovcnt <= 0
+*/
+static int iov_prepare(struct eeprom_dev *dev, const struct eeprom_iovec *iov, int iovcnt,
+                       const struct eeprom_iovec ***sorted, uint32_t *lo, uint32_t *hi) {
     int i;
-    int j;
     
-    // Number of page writes to do
-    int num_page;
-    // Temp page
-    char temp[PAGE_SIZE];
-    
-    // Case #1: offset and size are both multiples of PAGE_SIZE
-    if (offset % PAGE_SIZE == 0 && size % PAGE_SIZE == 0) {
-        // Because size is a multiple of PAGE_SIZE, size/PAGE_SIZE is number of page writes
-        num_page = size/PAGE_SIZE;
-        // Lock memory mutex
-        mutex_lock(&mem_mutex);
-        for (i = 0; i < num_page; i++) {
-            ll_write(offset + i*PAGE_SIZE, buf + i*PAGE_SIZE); // Write the bytes
+    if (iovcnt <= 0) {
+        printf("ERROR: Invalid segment count!\n");
+        return -2;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        int param_check = eeprom_dev_param_check(dev, iov[i].offset, iov[i].size);
+        if (param_check != 0) {
+            return param_check;
         }
-        // Unlock memory mutex
-        mutex_unlock(&mem_mutex);
-    }
-    
-    // Case #2: offset is multiple of PAGE_SIZE and size is not multiple of PAGE_SIZE
-    else if (offset % PAGE_SIZE == 0 && size % PAGE_SIZE != 0) {
-        // The number of page writes is the truncated value of size, which is still
-        // size/PAGE_SIZE
-        num_page = size/PAGE_SIZE;
-        // Lock memory mutex
-        mutex_lock(&mem_mutex);
-        for (i = 0; i < num_page; i++) {
-            ll_write(offset + i*PAGE_SIZE, buf + i*PAGE_SIZE); // Write the bytes
+    }
+    *sorted = malloc(iovcnt * sizeof(**sorted));
+    for (i = 0; i < iovcnt; i++) {
+        (*sorted)[i] = &iov[i];
+    }
+    qsort(*sorted, iovcnt, sizeof(**sorted), iov_compare);
+    
+    *lo = (*sorted)[0]->offset;
+    *hi = 0;
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].offset + iov[i].size > *hi) {
+            *hi = iov[i].offset + iov[i].size;
         }
-        // Writing the remaining bytes
-        ll_read((i+offset/PAGE_SIZE)*PAGE_SIZE, temp);      // Read entire page to temp
-        memcpy(temp, buf + i*PAGE_SIZE, size%PAGE_SIZE);    // Overwriting portion of temp with remaining bytes
-        ll_write((i+offset/PAGE_SIZE)*PAGE_SIZE, temp);     // Copy the updated page back
-        // Unlock memory mutex
-        mutex_unlock(&mem_mutex);
-        memset(temp, 0, PAGE_SIZE-1);    // Clear temp array
-    }
-    
-    // Case #3: offset is not a multiple of PAGE_SIZE and offset+size is multiple of PAGE_SIZE
-    else if (offset % PAGE_SIZE != 0 && (offset+size) % PAGE_SIZE == 0) {
-        // Lock memory mutex
-        mutex_lock(&mem_mutex);
-        ll_read((offset/PAGE_SIZE)*PAGE_SIZE, temp);    // Reading the floor(offset)'th page
-        memcpy(temp+(offset%PAGE_SIZE), buf, PAGE_SIZE-(offset%PAGE_SIZE));     // Overwriting portion of temp
-        ll_write((offset/PAGE_SIZE)*PAGE_SIZE, temp);   // Copy the updated page back
-        memset(temp, 0, PAGE_SIZE-1);    // Clear temp array
-        
-        // Number of page writes is the floor(size)
-        num_page = size/PAGE_SIZE;
-        // This incrementer indicates the ceil(offset), where page writes should begin
-        j = (offset/PAGE_SIZE)+1;  
-        for (i = 0; i < num_page; i++) {
-            ll_write(j*PAGE_SIZE, buf+(PAGE_SIZE-(offset%PAGE_SIZE))+(i*PAGE_SIZE));
-            j++;
+    }
+    return 0;
+}
+
+/*
+    This function finds the run of pages starting at sorted[i]. A run
+    grows as long as the next segment starts in the same page as the
+    run's last page or in the page right after it.
+    
+    @param shift: Pages are 1 << shift bytes
+    @param **sorted: Segments sorted by offset
+    @param iovcnt: Number of segments
+    @param i: Index of the first segment of the run
+    @param *first: Set to the first page of the run
+    @param *last: Set to the last page of the run
+    
+    @return: Index of the first segment after the run
+*/
+static int iov_run(const int shift, const struct eeprom_iovec **sorted, int iovcnt, int i, int *first, int *last) {
+    *first = sorted[i]->offset >> shift;
+    *last = (sorted[i]->offset + sorted[i]->size - 1) >> shift;
+    for (i++; i < iovcnt && (sorted[i]->offset >> shift) <= *last + 1; i++) {
+        int end = (sorted[i]->offset + sorted[i]->size - 1) >> shift;
+        if (end > *last) {
+            *last = end;
         }
-        // Unlock memory mutex
-        mutex_unlock(&mem_mutex);
-    }
-    
-    // Case #4: offset is not multiple of PAGE_SIZE and offset+size is not multiple of PAGE_SIZE
-    else if (offset % PAGE_SIZE != 0 && size % PAGE_SIZE != 0) {
-        // Lock memory mutex
-        mutex_lock(&mem_mutex);
-        // Same behavior as above to write first couple bytes
-        ll_read((offset/PAGE_SIZE)*PAGE_SIZE, temp);
-        memcpy(temp+(offset%PAGE_SIZE), buf, PAGE_SIZE-(offset%PAGE_SIZE));
-        ll_write((offset/PAGE_SIZE)*PAGE_SIZE, temp);
-        memset(temp, 0, PAGE_SIZE-1);
-        
-        // Number of page writes is the number of aligned pages in size
-        num_page = ((offset+size)/PAGE_SIZE) - ((offset/PAGE_SIZE)+1);
-        // Same behavior as Case #3
-        j = (offset/PAGE_SIZE)+1;
-        for (i = 0; i < num_page; i++) {
-            ll_write(j*PAGE_SIZE, buf+(PAGE_SIZE-(offset%PAGE_SIZE))+(i*PAGE_SIZE));
-            j++;
+    }
+    return i;
+}
+
+/*
+    This function reads a batch of segments as one operation. The pages
+    covering every segment are locked once, so the whole batch is atomic
+    with respect to other callers. Segments touching the same or adjacent
+    pages are merged into runs, and every run is read with a single
+    cache_read_pages call, so each page is read at most once.
+    Unlike eeprom_dev_read, no '\0' is stored after a segment.
+    
+    @param *dev: The device
+    @param *iov: Array of (offset, size, buf) segments
+    @param iovcnt: Number of segments
+    
+    @return: 0 for successful read
+    @return: -1 for invalid offset
+    @return: -2 for invalid size or segment count
+    @return: -3 for index out of bound
+    @return: -5 for failure to access the device
+*/
+int eeprom_dev_readv(struct eeprom_dev *dev, const struct eeprom_iovec *iov, int iovcnt) {
+    const struct eeprom_iovec **sorted;
+    uint32_t lo, hi;
+    int first, last;
+    int i, j, k;
+    int err = 0;
+    
+    int param_check = iov_prepare(dev, iov, iovcnt, &sorted, &lo, &hi);
+    if (param_check != 0) {
+        return param_check;
+    }
+    
+    // Scratch copy of the pages between lo and hi, indexed from base
+    const int shift = dev->geo.page_shift;
+    const uint32_t page_size = 1u << shift;
+    uint32_t base = lo & ~(page_size - 1);
+    char *scratch = malloc(hi - base + page_size);
+    
+    stats_add(STAT_VECTOR_CALLS, 1);
+    eeprom_lock(dev, lo, hi - lo, 0);
+    for (i = 0; i < iovcnt; i = j) {
+        j = iov_run(shift, sorted, iovcnt, i, &first, &last);
+        err |= cache_read_pages(dev, first << shift, last-first+1, scratch + (first << shift) - base);
+        for (k = i; k < j; k++) {
+            memcpy(sorted[k]->buf, scratch + sorted[k]->offset - base, sorted[k]->size);
+            stats_add(STAT_BYTES_READ, sorted[k]->size);
         }
+    }
+    eeprom_unlock(dev, lo, hi - lo, 0);
+    
+    free(scratch);
+    free(sorted);
+    return err != 0 ? -5 : 0;
+}
+
+/*
+    This function writes a batch of segments as one operation. The pages
+    covering every segment are locked once, so the whole batch is atomic
+    with respect to other callers. Segments touching the same or adjacent
+    pages are merged into runs. Only the pages of a run that the segments
+    do not fully cover are read first, and every run is written with a
+    single cache_write_pages call, so each page is read and written at
+    most once. Overlapping segments are applied in array order.
+    The size of every segment is taken as given, buffers are not checked
+    with strlen.
+    
+    @param *dev: The device
+    @param *iov: Array of (offset, size, buf) segments
+    @param iovcnt: Number of segments
+    
+    @return: 0 for successful write
+    @return: -1 for invalid offset
+    @return: -2 for invalid size or segment count
+    @return: -3 for index out of bound
+    @return: -5 for failure to access the device, no run is written
+               after a page of the batch failed to be read
+*/
+int eeprom_dev_writev(struct eeprom_dev *dev, const struct eeprom_iovec *iov, int iovcnt) {
+    const struct eeprom_iovec **sorted;
+    uint32_t lo, hi;
+    int first, last;
+    int i, j, k, page;
+    int err = 0;
+    
+    int param_check = iov_prepare(dev, iov, iovcnt, &sorted, &lo, &hi);
+    if (param_check != 0) {
+        return param_check;
+    }
+    
+    // Scratch copy of the pages between lo and hi, indexed from base
+    const int shift = dev->geo.page_shift;
+    const uint32_t page_size = 1u << shift;
+    uint32_t base = lo & ~(page_size - 1);
+    char *scratch = malloc(hi - base + page_size);
+    
+    stats_add(STAT_VECTOR_CALLS, 1);
+    eeprom_lock(dev, lo, hi - lo, 1);
+    for (i = 0; i < iovcnt; i = j) {
+        j = iov_run(shift, sorted, iovcnt, i, &first, &last);
         
-        // Do one more page write after where we left off
-        ll_read(j*PAGE_SIZE, temp);
-        
-        // Storing only desired bytes
-        memcpy(temp, buf+(i*PAGE_SIZE)+(PAGE_SIZE-(offset%PAGE_SIZE)), (offset+size)%PAGE_SIZE);
-        ll_write(j*PAGE_SIZE, temp);        // Updating the new page
-        // Unlock memory mutex
-        mutex_unlock(&mem_mutex);
-        memset(temp, 0, PAGE_SIZE-1);
+        // Read the pages of the run that are not completely overwritten.
+        // Segments are sorted, so sweeping them once per page tells how
+        // far from the start of the page the coverage is contiguous.
+        int read_from = -1;
+        for (page = first; page <= last + 1; page++) {
+            int full = 0;
+            if (page <= last) {
+                uint32_t covered = page << shift;
+                for (k = i; k < j && sorted[k]->offset <= covered; k++) {
+                    if (sorted[k]->offset + sorted[k]->size > covered) {
+                        covered = sorted[k]->offset + sorted[k]->size;
+                    }
+                }
+                full = covered >= (uint32_t)(page+1) << shift;
+            }
+            if (!full && page <= last && read_from < 0) {
+                read_from = page;
+            } else if ((full || page > last) && read_from >= 0) {
+                err |= cache_read_pages(dev, read_from << shift, page-read_from,
+                                        scratch + (read_from << shift) - base);
+                stats_add(STAT_RMW, page-read_from);
+                read_from = -1;
+            }
+        }
     }
+    // Apply the segments in the order the caller gave them
+    for (k = 0; k < iovcnt; k++) {
+        memcpy(scratch + iov[k].offset - base, iov[k].buf, iov[k].size);
+        stats_add(STAT_BYTES_WRITTEN, iov[k].size);
+    }
+    // A page that could not be read is not written back half filled in
+    for (i = 0; i < iovcnt && err == 0; i = j) {
+        j = iov_run(shift, sorted, iovcnt, i, &first, &last);
+        err |= cache_write_pages(dev, first << shift, last-first+1, scratch + (first << shift) - base);
+    }
+    eeprom_unlock(dev, lo, hi - lo, 1);
     
+    free(scratch);
+    free(sorted);
+    return err != 0 ? -5 : 0;
+}
+
+/*
+    These functions do the same as eeprom_dev_readv and eeprom_dev_writev
+    on the default device.
+*/
+int eeprom_readv(const struct eeprom_iovec *iov, int iovcnt) {
+    return eeprom_dev_readv(eeprom_default(), iov, iovcnt);
+}
+int eeprom_writev(const struct eeprom_iovec *iov, int iovcnt) {
+    return eeprom_dev_writev(eeprom_default(), iov, iovcnt);
+}
+
+/*
+    This function erases whole pages of a device, so they read back as
+    LL_ERASED_BYTE. The range is erased on the image with one bulk erase
+    per run of pages that are consecutive there, instead of a write per
+    page, and the page cache and read-ahead windows are kept in step.
     
-    return 0;
+    @param *dev: The device
+    @param offset: Where to start, a multiple of the page size
+    @param size: Bytes to erase, a multiple of the page size
     
+    @return: 0 for success
+    @return: -1 for invalid or unaligned offset
+    @return: -2 for invalid size or a size that is not whole pages
+    @return: -3 for index out of bound
+    @return: -5 for failure to access the device
+*/
+int eeprom_dev_erase(struct eeprom_dev *dev, uint32_t offset, int size) {
+    const uint32_t mask = geometry_page_size(&dev->geo) - 1;
+    int ret;
+    
+    ret = eeprom_dev_param_check(dev, offset, size);
+    if (ret != 0) {
+        return ret;
+    }
+    if ((offset & mask) != 0) {
+        printf("ERROR: Offset is not page aligned!\n");
+        return -1;
+    }
+    if ((size & mask) != 0) {
+        printf("ERROR: Size is not whole pages!\n");
+        return -2;
+    }
+    eeprom_lock(dev, offset, size, 1);
+    ret = cache_erase_pages(dev, offset, size >> dev->geo.page_shift);
+    eeprom_unlock(dev, offset, size, 1);
+    return ret != 0 ? -5 : 0;
 }
+
 /*
-    This function resets the eeprom by calling the lowlevl reset
-    function. 
+    This function erases every page of a device, see eeprom_dev_erase.
+    Wear leveling metadata and the journal are left alone, they only
+    describe where the pages live and what was committed.
+    
+    @param *dev: The device
+    
+    @return: 0 for success, -5 for failure to access the device
+*/
+int eeprom_dev_reset(struct eeprom_dev *dev) {
+    return eeprom_dev_erase(dev, 0, dev->geo.size);
+}
+
+/*
+    This function resets the eeprom by erasing every page of the default
+    device. It goes through eeprom_dev_reset rather than ll_eeprom_reset,
+    so the cache of the device sees the erase.
     
 */
 void eeprom_reset() {
-    ll_eeprom_reset();
+    eeprom_dev_reset(eeprom_default());
+}
+
+int eeprom_erase(uint32_t offset, int size) {
+    return eeprom_dev_erase(eeprom_default(), offset, size);
 }
 
 
 /*
-    This function checks the validity of the parameters.
+    This function checks the validity of the parameters against the
+    capacity of a device.
     
     @return: 0 for valid input
     @return: -1 for invalid offset
@@ -283,9 +904,9 @@ void eeprom_reset() {
     @return: -3 for index out of bound
 */
     
-int eeprom_param_check(uint32_t offset, int size) {
+int eeprom_dev_param_check(struct eeprom_dev *dev, uint32_t offset, int size) {
     // Checking for input validity
-    if (offset > EEPROM_SIZE) {
+    if (offset > dev->geo.size) {
         printf("ERROR: Invalid offset value!\n");
         return -1;
     }
@@ -294,7 +915,7 @@ int eeprom_param_check(uint32_t offset, int size) {
         return -2;
     }
     // Checking for index out of bound
-    if (offset + size > EEPROM_SIZE) {
+    if (offset + size > dev->geo.size) {
         printf("ERROR: Index out of bound!\n"); 
         // Unlock memory mutex
         return -3;
@@ -303,22 +924,154 @@ int eeprom_param_check(uint32_t offset, int size) {
 }
 
 /*
-    This function calls pthread_mutex_lock and prints debug
-    statement if DEBUG_MODE is 1.
+    This function checks the validity of the parameters against the
+    default device, see eeprom_dev_param_check.
+*/
+int eeprom_param_check(uint32_t offset, int size) {
+    return eeprom_dev_param_check(eeprom_default(), offset, size);
+}
+
+/*
+    This function calls pthread_mutex_lock on the mutex of the default
+    device and prints debug statement if DEBUG_MODE is 1.
 */
 void mutex_lock() {
-    pthread_mutex_lock(&mem_mutex);
+    pthread_mutex_lock(&eeprom_default()->mutex);
     if (DEBUG_MODE == 1) {
         printf("Mutex locked\n");
     }
 }
 /*
-    This function calls pthread_mutex_unlock and prints debug
-    statement if DEBUG_MODE is 1.
+    This function calls pthread_mutex_unlock on the mutex of the default
+    device and prints debug statement if DEBUG_MODE is 1.
 */
 void mutex_unlock() {
-    pthread_mutex_unlock(&mem_mutex);
+    pthread_mutex_unlock(&eeprom_default()->mutex);
     if (DEBUG_MODE == 1) {
         printf("Mutex unlocked\n");
     }
 }
+
+/*
+    This function selects how eeprom_dev_read and eeprom_dev_write lock
+    the device. It must be called while no other thread is accessing the
+    device. EEPROM_LOCK_SEQ only reads without a lock while the page
+    cache is on.
+
+    @param *dev: The device
+    @param mode: EEPROM_LOCK_GLOBAL, EEPROM_LOCK_RW, EEPROM_LOCK_STRIPED
+                 or EEPROM_LOCK_SEQ
+*/
+void eeprom_dev_set_lock_mode(struct eeprom_dev *dev, enum eeprom_lock_mode mode) {
+    dev->lock_mode = mode;
+}
+
+/*
+    This function selects the lock mode of the default device.
+*/
+void eeprom_set_lock_mode(enum eeprom_lock_mode mode) {
+    eeprom_dev_set_lock_mode(eeprom_default(), mode);
+}
+
+/*
+    This function locks the pages touched by an access of size bytes at
+    offset. Depending on the lock mode it takes
+    - EEPROM_LOCK_GLOBAL: the device mutex, readers and writers exclude
+      each other
+    - EEPROM_LOCK_RW: the device wide reader-writer lock, readers run
+      concurrently
+    - EEPROM_LOCK_STRIPED: the reader-writer lock of every stripe the
+      access touches, so accesses to disjoint stripes run in parallel.
+      Stripes are always taken in ascending order, which keeps two
+      multi-page accesses from deadlocking, and they are all held until
+      eeprom_unlock, which keeps multi-page accesses atomic.
+    - EEPROM_LOCK_SEQ: the device mutex, like EEPROM_LOCK_GLOBAL. A writer
+      also makes dev->seq odd until eeprom_unlock, which tells lock-free
+      readers (see span_read_seq) to try again.
+    The parameters must already have passed eeprom_param_check.
+    With EEPROM_STATS_LOCK_TIMING set, the time spent waiting for the
+    locks is counted.
+
+    @param *dev: The device
+    @param offset: Amount of offset from the beginning of EEPROM
+    @param size: Size of the access
+    @param write: 1 to lock for writing, 0 to lock for reading
+*/
+void eeprom_lock(struct eeprom_dev *dev, uint32_t offset, int size, int write) {
+    int first, last, i;
+    uint64_t wait_start = eeprom_stats_flags != 0 ? stats_now() : 0;
+
+    switch (dev->lock_mode) {
+    case EEPROM_LOCK_GLOBAL:
+        pthread_mutex_lock(&dev->mutex);
+        break;
+    case EEPROM_LOCK_SEQ:
+        pthread_mutex_lock(&dev->mutex);
+        if (write) {
+            // Acquire keeps the writes to the pages after the odd count
+            __atomic_fetch_add(&dev->seq, 1, __ATOMIC_ACQ_REL);
+        }
+        break;
+    case EEPROM_LOCK_RW:
+        if (write) {
+            pthread_rwlock_wrlock(&dev->rwlock);
+        } else {
+            pthread_rwlock_rdlock(&dev->rwlock);
+        }
+        break;
+    case EEPROM_LOCK_STRIPED:
+        first = (offset >> dev->geo.page_shift)/EEPROM_STRIPE_PAGES;
+        last = ((offset+size-1) >> dev->geo.page_shift)/EEPROM_STRIPE_PAGES;
+        for (i = first; i <= last; i++) {
+            if (write) {
+                pthread_rwlock_wrlock(&dev->stripe_lock[i]);
+            } else {
+                pthread_rwlock_rdlock(&dev->stripe_lock[i]);
+            }
+        }
+        break;
+    }
+    if (wait_start != 0) {
+        stats_lock_acquired(wait_start);
+    }
+}
+
+/*
+    This function releases the locks taken by eeprom_lock with the same
+    parameters. With EEPROM_STATS_LOCK_TIMING set, the hold time is
+    counted, and with EEPROM_STATS_TRACE the operation is traced.
+
+    @param *dev: The device
+    @param offset: Amount of offset from the beginning of EEPROM
+    @param size: Size of the access
+    @param write: 1 if locked for writing, 0 if locked for reading
+*/
+void eeprom_unlock(struct eeprom_dev *dev, uint32_t offset, int size, int write) {
+    int first, last, i;
+
+    if (eeprom_stats_flags != 0) {
+        stats_lock_released(offset, size, write);
+    }
+
+    switch (dev->lock_mode) {
+    case EEPROM_LOCK_GLOBAL:
+        pthread_mutex_unlock(&dev->mutex);
+        break;
+    case EEPROM_LOCK_SEQ:
+        if (write) {
+            __atomic_fetch_add(&dev->seq, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&dev->mutex);
+        break;
+    case EEPROM_LOCK_RW:
+        pthread_rwlock_unlock(&dev->rwlock);
+        break;
+    case EEPROM_LOCK_STRIPED:
+        first = (offset >> dev->geo.page_shift)/EEPROM_STRIPE_PAGES;
+        last = ((offset+size-1) >> dev->geo.page_shift)/EEPROM_STRIPE_PAGES;
+        for (i = last; i >= first; i--) {
+            pthread_rwlock_unlock(&dev->stripe_lock[i]);
+        }
+        break;
+    }
+}
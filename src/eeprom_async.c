@@ -0,0 +1,224 @@
+/*
+    @file   eeprom_async.c
+    
+    @brief  This file contains the asynchronous request queue. Requests
+            are served by one worker thread per device.
+
+    @author     Frank Lee
+*/
+
+#include "../include/eeprom.h"
+#include "../include/eeprom_async.h"
+
+// Serializes starting the worker of a device
+static pthread_mutex_t async_start_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+    This function checks whether two requests touch a common byte.
+*/
+static int aio_overlap(const struct eeprom_aio *a, const struct eeprom_aio *b) {
+    return a->offset < b->offset + b->size && b->offset < a->offset + a->size;
+}
+
+/*
+    This function runs one phase of a batch: every write of the phase
+    with a single eeprom_dev_writev and every read with a single
+    eeprom_dev_readv. The requests of a phase never have a read and a
+    write touching the same byte, so the order of the two calls does not
+    matter, and overlapping writes are kept in submission order by
+    eeprom_dev_writev.
+    
+    @param *dev: The device
+    @param **phase: Requests of the phase in submission order
+    @param n: Number of requests
+*/
+static void async_run_phase(struct eeprom_dev *dev, struct eeprom_aio **phase, int n) {
+    struct eeprom_iovec rv[EEPROM_AIO_BATCH], wv[EEPROM_AIO_BATCH];
+    int nr = 0, nw = 0;
+    int i;
+    
+    for (i = 0; i < n; i++) {
+        struct eeprom_iovec *v = phase[i]->op == EEPROM_AIO_WRITE ? &wv[nw++] : &rv[nr++];
+        v->offset = phase[i]->offset;
+        v->size = phase[i]->size;
+        v->buf = phase[i]->buf;
+    }
+    int wret = nw > 0 ? eeprom_dev_writev(dev, wv, nw) : 0;
+    int rret = nr > 0 ? eeprom_dev_readv(dev, rv, nr) : 0;
+    for (i = 0; i < n; i++) {
+        // Pairs with the acquire load of eeprom_aio_poll
+        __atomic_store_n(&phase[i]->result, phase[i]->op == EEPROM_AIO_WRITE ? wret : rret,
+                         __ATOMIC_RELEASE);
+    }
+}
+
+/*
+    This function is the worker thread of a device. It takes every
+    pending request (up to EEPROM_AIO_BATCH) at once and splits them into
+    phases. A request joins the current phase unless it is a read
+    overlapping a write of the phase or a write overlapping a read of
+    the phase, so a read still sees every write submitted before it.
+    Within a phase, writes are merged into one eeprom_dev_writev call
+    and reads into one eeprom_dev_readv call.
+*/
+static void *async_worker(void *vargp) {
+    struct eeprom_dev *dev = vargp;
+    struct eeprom_async *q = dev->async;
+    struct eeprom_aio *batch[EEPROM_AIO_BATCH];
+    eeprom_aio_callback callback[EEPROM_AIO_BATCH];
+    int n, i, j, start;
+    
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (q->head == NULL && !q->stop) {
+            pthread_cond_wait(&q->work, &q->lock);
+        }
+        if (q->head == NULL) {
+            break;
+        }
+        // A request without a callback may be freed as soon as its
+        // result is set, so the callbacks are picked up now
+        for (n = 0; n < EEPROM_AIO_BATCH && q->head != NULL; n++) {
+            batch[n] = q->head;
+            callback[n] = batch[n]->callback;
+            q->head = q->head->next;
+        }
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        pthread_mutex_unlock(&q->lock);
+        
+        start = 0;
+        for (i = 1; i <= n; i++) {
+            int conflict = 0;
+            for (j = start; j < i && i < n && !conflict; j++) {
+                conflict = batch[i]->op != batch[j]->op && aio_overlap(batch[i], batch[j]);
+            }
+            if (i == n || conflict) {
+                async_run_phase(dev, batch + start, i - start);
+                start = i;
+            }
+        }
+        
+        // Results are published before any waiter is woken up
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_broadcast(&q->done);
+        pthread_mutex_unlock(&q->lock);
+        for (i = 0; i < n; i++) {
+            if (callback[i] != NULL) {
+                callback[i](batch[i]);
+            }
+        }
+        pthread_mutex_lock(&q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+/*
+    This function submits an asynchronous read or write. The request is
+    checked right away; a valid one is queued and the call returns
+    without waiting for any I/O. Completion is signalled by the request's
+    callback, by eeprom_aio_poll or by eeprom_aio_wait. The worker
+    thread of the device is started by the first submission.
+    
+    @param *dev: The device
+    @param *aio: The request, which must stay valid until it completes
+    
+    @return: 0 if the request was queued
+    @return: -1 for invalid offset
+    @return: -2 for invalid size
+    @return: -3 for index out of bound
+*/
+int eeprom_aio_submit(struct eeprom_dev *dev, struct eeprom_aio *aio) {
+    int param_check = eeprom_dev_param_check(dev, aio->offset, aio->size);
+    if (param_check != 0) {
+        aio->result = param_check;
+        return param_check;
+    }
+    
+    pthread_mutex_lock(&async_start_lock);
+    if (dev->async == NULL) {
+        struct eeprom_async *q = calloc(1, sizeof(*q));
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->work, NULL);
+        pthread_cond_init(&q->done, NULL);
+        dev->async = q;
+        pthread_create(&q->worker, NULL, async_worker, dev);
+    }
+    pthread_mutex_unlock(&async_start_lock);
+    
+    struct eeprom_async *q = dev->async;
+    aio->result = EEPROM_AIO_PENDING;
+    aio->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail != NULL) {
+        q->tail->next = aio;
+    } else {
+        q->head = aio;
+    }
+    q->tail = aio;
+    pthread_cond_signal(&q->work);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/*
+    This function checks whether a request has completed.
+    
+    @param *aio: The request
+    
+    @return: EEPROM_AIO_PENDING while in flight, otherwise the result of
+             the request (0 for success, same errors as eeprom_dev_readv
+             and eeprom_dev_writev)
+*/
+int eeprom_aio_poll(struct eeprom_aio *aio) {
+    return __atomic_load_n(&aio->result, __ATOMIC_ACQUIRE);
+}
+
+/*
+    This function blocks until a request has completed.
+    
+    @param *dev: The device the request was submitted to
+    @param *aio: The request
+    
+    @return: The result of the request
+*/
+int eeprom_aio_wait(struct eeprom_dev *dev, struct eeprom_aio *aio) {
+    struct eeprom_async *q = dev->async;
+    
+    if (q == NULL) {
+        return eeprom_aio_poll(aio);
+    }
+    pthread_mutex_lock(&q->lock);
+    while (eeprom_aio_poll(aio) == EEPROM_AIO_PENDING) {
+        pthread_cond_wait(&q->done, &q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return eeprom_aio_poll(aio);
+}
+
+/*
+    This function completes every queued request and stops the worker
+    thread of a device. It is called by eeprom_close.
+    
+    @param *dev: The device
+*/
+void eeprom_async_stop(struct eeprom_dev *dev) {
+    struct eeprom_async *q = dev->async;
+    
+    if (q == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&q->lock);
+    q->stop = 1;
+    pthread_cond_signal(&q->work);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->worker, NULL);
+    pthread_cond_destroy(&q->work);
+    pthread_cond_destroy(&q->done);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+    dev->async = NULL;
+}
@@ -0,0 +1,400 @@
+/*
+    @file   eeprom_bench.c
+
+    @brief  This file contains the throughput and latency benchmark of
+            eeprom_read/eeprom_write. It sweeps the four alignment cases,
+            transfer sizes, read/write mixes and thread counts, and prints
+            one CSV line per combination. With -e it compares erasing
+            the device with eeprom_dev_erase against writing erased pages
+            one at a time instead. With -b the device sits on a simulated
+            bus, and the commands and wire bytes per operation show what
+            byte commands save over page transfers. With -s it compares
+            small reads in process against reads through eeprom_server,
+            one at a time and pipelined.
+
+    @author     Frank Lee
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/eeprom.h"
+
+#define BENCH_PATH "bench.img"
+#define BENCH_SOCKET "bench.sock"
+#define BENCH_SERVER_SIZE 32        // Bytes per read of the -s benchmark
+#define BENCH_MAX_THREADS 8
+
+static const int bench_pages[] = { 0, 1, 4, 32 };       // Whole pages per access
+static const int bench_write_pct[] = { 0, 50, 100 };
+static const int bench_threads[] = { 1, 2, 4, 8 };
+static const int bench_depths[] = { 1, 16 };             // Reads in flight per client
+
+// One combination of the sweep
+struct bench_case {
+    int align_case;     // 1..4, see README.md
+    int pages;
+    int write_pct;
+    int threads;
+};
+
+struct bench_thread {
+    struct eeprom_dev *dev;
+    const struct bench_case *bc;
+    int ops;
+    unsigned int seed;
+    uint64_t *lat;      // ops latencies in ns
+    uint64_t bytes;
+};
+
+/*
+    This function returns the monotonic clock in nanoseconds.
+*/
+static uint64_t bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+    This function picks the offset and size of one access of the given
+    alignment case, with pages whole pages in its middle:
+    Case 1: aligned offset, whole pages only
+    Case 2: aligned offset, ends half way into a page
+    Case 3: starts half way into a page, aligned end
+    Case 4: starts a quarter into a page, ends half way into a page
+
+    @param *bc: The combination
+    @param page_size: Page size of the device
+    @param num_pages: Pages of the device
+    @param *seed: rand_r state
+    @param *offset: Where the offset is stored
+
+    @return: The size of the access
+*/
+static int bench_access(const struct bench_case *bc, int page_size, int num_pages,
+                        unsigned int *seed, uint32_t *offset) {
+    uint32_t base = (uint32_t)(rand_r(seed) % (num_pages - bc->pages - 1)) * page_size;
+    int size = bc->pages * page_size;
+
+    switch (bc->align_case) {
+    case 2:
+        size += page_size / 2;
+        break;
+    case 3:
+        base += page_size / 2;
+        size += page_size / 2;
+        break;
+    case 4:
+        base += page_size / 4;
+        size += page_size / 4;
+        break;
+    }
+    *offset = base;
+    return size;
+}
+
+static void *bench_thread_func(void *vargp) {
+    struct bench_thread *bt = vargp;
+    const struct bench_case *bc = bt->bc;
+    int page_size = geometry_page_size(&bt->dev->geo);
+    int num_pages = geometry_num_pages(&bt->dev->geo);
+    char *buf = malloc((size_t)(bc->pages + 2) * page_size);
+    uint32_t offset;
+    int i;
+
+    memset(buf, 'b', (size_t)(bc->pages + 2) * page_size);
+    for (i = 0; i < bt->ops; i++) {
+        int size = bench_access(bc, page_size, num_pages, &bt->seed, &offset);
+        int write = (int)(rand_r(&bt->seed) % 100) < bc->write_pct;
+        uint64_t start = bench_now();
+        if (write) {
+            eeprom_dev_write_bytes(bt->dev, offset, buf, size);
+        } else {
+            eeprom_dev_read_bytes(bt->dev, offset, buf, size);
+        }
+        bt->lat[i] = bench_now() - start;
+        bt->bytes += size;
+    }
+    free(buf);
+    return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+    This function runs one combination and prints its CSV line.
+
+    @param *dev: The device
+    @param *bc: The combination
+    @param ops: Operations per thread
+*/
+static void bench_run(struct eeprom_dev *dev, const struct bench_case *bc, int ops) {
+    struct bench_thread bt[BENCH_MAX_THREADS];
+    pthread_t tid[BENCH_MAX_THREADS];
+    uint64_t *lat = malloc(sizeof(*lat) * ops * bc->threads);
+    struct eeprom_stats st;
+    uint64_t bytes = 0;
+    int i;
+
+    eeprom_stats_reset();
+    uint64_t start = bench_now();
+    for (i = 0; i < bc->threads; i++) {
+        bt[i] = (struct bench_thread){ dev, bc, ops, 12345u + i, lat + (size_t)i * ops, 0 };
+        pthread_create(&tid[i], NULL, bench_thread_func, &bt[i]);
+    }
+    for (i = 0; i < bc->threads; i++) {
+        pthread_join(tid[i], NULL);
+        bytes += bt[i].bytes;
+    }
+    double secs = (bench_now() - start) / 1e9;
+    eeprom_stats_snapshot(&st);
+
+    size_t n = (size_t)ops * bc->threads;
+    qsort(lat, n, sizeof(*lat), bench_cmp);
+    printf("%d,%d,%d,%d,%zu,%.0f,%.0f,%llu,%llu,%llu,%.2f,%.1f\n",
+           bc->align_case, bc->pages, bc->write_pct, bc->threads, n,
+           n / secs, bytes / secs,
+           (unsigned long long)lat[n * 50 / 100],
+           (unsigned long long)lat[n * 99 / 100],
+           (unsigned long long)lat[n * 999 / 1000],
+           (double)st.bus_transactions / n, (double)st.bus_bytes / n);
+    fflush(stdout);
+    free(lat);
+}
+
+/*
+    This function erases the whole device ops times with each method and
+    prints one CSV line per method: a bulk eeprom_dev_erase, and a loop
+    of one eeprom_dev_write_bytes of an erased page per page.
+
+    @param *dev: The device
+    @param ops: Whole device erases per method
+*/
+static void bench_erase(struct eeprom_dev *dev, int ops) {
+    int page_size = geometry_page_size(&dev->geo);
+    int num_pages = geometry_num_pages(&dev->geo);
+    char *page = malloc(page_size);
+    int i, p, m;
+
+    memset(page, LL_ERASED_BYTE, page_size);
+    printf("method,pages,ops,ops_per_s,pages_per_s\n");
+    for (m = 0; m < 2; m++) {
+        uint64_t start = bench_now();
+        for (i = 0; i < ops; i++) {
+            if (m == 0) {
+                eeprom_dev_erase(dev, 0, dev->geo.size);
+                continue;
+            }
+            for (p = 0; p < num_pages; p++) {
+                eeprom_dev_write_bytes(dev, (uint32_t)p * page_size, page, page_size);
+            }
+        }
+        double secs = (bench_now() - start) / 1e9;
+        printf("%s,%d,%d,%.0f,%.0f\n", m == 0 ? "erase" : "page_writes", num_pages, ops,
+               ops / secs, (double)ops * num_pages / secs);
+        fflush(stdout);
+    }
+    free(page);
+}
+
+// One thread of the -s benchmark
+struct bench_server_thread {
+    struct eeprom_dev *dev;
+    struct eeprom_client *client;   // NULL to read in process
+    int depth;
+    int ops;
+    unsigned int seed;
+};
+
+static void *bench_server_func(void *vargp) {
+    struct bench_server_thread *bt = vargp;
+    uint32_t range = bt->dev->geo.size - BENCH_SERVER_SIZE;
+    char buf[EEPROM_CLIENT_DEPTH][BENCH_SERVER_SIZE];
+    int i;
+
+    if (bt->client == NULL) {
+        for (i = 0; i < bt->ops; i++) {
+            eeprom_dev_read_bytes(bt->dev, rand_r(&bt->seed) % range, buf[0], BENCH_SERVER_SIZE);
+        }
+        return NULL;
+    }
+    // Keep depth reads in flight, slot i % depth is free once read i - depth completes
+    for (i = 0; i < bt->ops + bt->depth; i++) {
+        if (i >= bt->depth) {
+            eeprom_client_complete(bt->client);
+        }
+        if (i < bt->ops) {
+            eeprom_client_send_read(bt->client, rand_r(&bt->seed) % range, BENCH_SERVER_SIZE,
+                                    buf[i % bt->depth]);
+        }
+    }
+    return NULL;
+}
+
+/*
+    This function reads BENCH_SERVER_SIZE bytes at random offsets, ops
+    times per thread, in process and through a server on the same device
+    with depth reads in flight per client, and prints one CSV line per
+    path, depth and thread count.
+
+    @param *dev: The device
+    @param ops: Reads per thread
+*/
+static void bench_server(struct eeprom_dev *dev, int ops) {
+    struct bench_server_thread bt[BENCH_MAX_THREADS];
+    pthread_t tid[BENCH_MAX_THREADS];
+    int d, t, i;
+
+    struct eeprom_server *srv = eeprom_server_start(dev, BENCH_SOCKET);
+    if (srv == NULL) {
+        return;
+    }
+    printf("path,threads,depth,ops,ops_per_s,reads_per_batch\n");
+    for (d = -1; d < (int)(sizeof(bench_depths) / sizeof(bench_depths[0])); d++) {
+        // d == -1 is the in process baseline
+        int depth = d < 0 ? 1 : bench_depths[d];
+        for (t = 0; t < sizeof(bench_threads) / sizeof(bench_threads[0]); t++) {
+            int threads = bench_threads[t];
+            struct eeprom_stats st;
+
+            for (i = 0; i < threads; i++) {
+                bt[i] = (struct bench_server_thread){ dev, NULL, depth, ops, 12345u + i };
+                if (d >= 0) {
+                    bt[i].client = eeprom_client_open(BENCH_SOCKET);
+                }
+            }
+            eeprom_stats_reset();
+            uint64_t start = bench_now();
+            for (i = 0; i < threads; i++) {
+                pthread_create(&tid[i], NULL, bench_server_func, &bt[i]);
+            }
+            for (i = 0; i < threads; i++) {
+                pthread_join(tid[i], NULL);
+            }
+            double secs = (bench_now() - start) / 1e9;
+            eeprom_stats_snapshot(&st);
+            for (i = 0; i < threads; i++) {
+                if (bt[i].client != NULL) {
+                    eeprom_client_close(bt[i].client);
+                }
+            }
+            size_t n = (size_t)ops * threads;
+            printf("%s,%d,%d,%zu,%.0f,%.1f\n", d < 0 ? "local" : "socket", threads, depth, n, n / secs,
+                   st.server_batches > 0 ? (double)st.server_requests / st.server_batches : 1.0);
+            fflush(stdout);
+        }
+    }
+    eeprom_server_stop(srv);
+}
+
+static void bench_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-n ops] [-l global|rw|striped|seq] [-c off|wt|wb] [-b i2c|spi] [-t] [-e] [-s]\n"
+            "  -n  operations per thread and combination (default 2000)\n"
+            "  -l  lock mode (default global)\n"
+            "  -c  cache mode (default off)\n"
+            "  -b  simulated bus (default none)\n"
+            "  -t  use the LL_TIMING_I2C_400K timing model\n"
+            "  -e  erase benchmark, ops whole device erases per method\n"
+            "  -s  server benchmark, ops reads per thread and combination\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    struct eeprom_config cfg = {
+        .geo = { EEPROM_PAGE_SHIFT, EEPROM_SIZE },
+        .ll = { .path = BENCH_PATH, .mode = LL_MODE_MMAP },
+        .lock_mode = EEPROM_LOCK_GLOBAL,
+        .cache_mode = EEPROM_CACHE_OFF,
+    };
+    struct ll_timing i2c = LL_TIMING_I2C_400K;
+    int ops = 2000;
+    int erase = 0;
+    int server = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:l:c:b:tes")) != -1) {
+        switch (opt) {
+        case 'n':
+            ops = atoi(optarg);
+            break;
+        case 'l':
+            cfg.lock_mode = !strcmp(optarg, "rw") ? EEPROM_LOCK_RW :
+                            !strcmp(optarg, "striped") ? EEPROM_LOCK_STRIPED :
+                            !strcmp(optarg, "seq") ? EEPROM_LOCK_SEQ : EEPROM_LOCK_GLOBAL;
+            break;
+        case 'c':
+            cfg.cache_mode = !strcmp(optarg, "wt") ? EEPROM_CACHE_WRITETHROUGH :
+                             !strcmp(optarg, "wb") ? EEPROM_CACHE_WRITEBACK : EEPROM_CACHE_OFF;
+            break;
+        case 'b':
+            cfg.ll.bus = !strcmp(optarg, "i2c") ? LL_BUS_I2C :
+                         !strcmp(optarg, "spi") ? LL_BUS_SPI : LL_BUS_NONE;
+            break;
+        case 't':
+            cfg.ll.timing = i2c;
+            break;
+        case 'e':
+            erase = 1;
+            break;
+        case 's':
+            server = 1;
+            break;
+        default:
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (ops <= 0) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    struct eeprom_dev *dev = eeprom_open(&cfg);
+    if (dev == NULL) {
+        return 1;
+    }
+
+    if (erase) {
+        bench_erase(dev, ops);
+        eeprom_close(dev);
+        remove(BENCH_PATH);
+        return 0;
+    }
+    if (server) {
+        bench_server(dev, ops);
+        eeprom_close(dev);
+        remove(BENCH_PATH);
+        return 0;
+    }
+
+    printf("case,pages,write_pct,threads,ops,ops_per_s,bytes_per_s,p50_ns,p99_ns,p999_ns,"
+           "bus_cmds_per_op,bus_bytes_per_op\n");
+    for (int c = 1; c <= 4; c++) {
+        for (int p = 0; p < sizeof(bench_pages) / sizeof(bench_pages[0]); p++) {
+            // Case 1 with no whole page would be an empty access
+            if (c == 1 && bench_pages[p] == 0) {
+                continue;
+            }
+            for (int w = 0; w < sizeof(bench_write_pct) / sizeof(bench_write_pct[0]); w++) {
+                for (int t = 0; t < sizeof(bench_threads) / sizeof(bench_threads[0]); t++) {
+                    struct bench_case bc = { c, bench_pages[p], bench_write_pct[w], bench_threads[t] };
+                    bench_run(dev, &bc, ops);
+                }
+            }
+        }
+    }
+
+    eeprom_close(dev);
+    remove(BENCH_PATH);
+    return 0;
+}
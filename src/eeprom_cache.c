@@ -0,0 +1,486 @@
+/*
+    @file   eeprom_cache.c
+    
+    @brief  This file contains the page cache that sits between eeprom.c
+            and ll_func.c
+
+    @author     Frank Lee
+*/
+
+#include "../include/eeprom.h"
+#include "../include/eeprom_cache.h"
+
+
+/*
+    These functions set, clear and test a bit in the dirty bitmap. Pages
+    under different stripe locks can share a word, so updates are atomic.
+*/
+static void dirty_set(struct eeprom_cache *cache, int page) {
+    __atomic_fetch_or(&cache->dirty[page/32], 1u << (page%32), __ATOMIC_RELAXED);
+}
+static void dirty_clear(struct eeprom_cache *cache, int page) {
+    __atomic_fetch_and(&cache->dirty[page/32], ~(1u << (page%32)), __ATOMIC_RELAXED);
+}
+static int dirty_test(struct eeprom_cache *cache, int page) {
+    return (__atomic_load_n(&cache->dirty[page/32], __ATOMIC_RELAXED) >> (page%32)) & 1;
+}
+
+
+/*
+    This function selects the cache mode of a device. Leaving
+    EEPROM_CACHE_WRITEBACK flushes the dirty pages first, and turning
+    the cache off forgets every page. The RAM copy itself is kept until
+    cache_close, so lock-free readers (see EEPROM_LOCK_SEQ) never touch
+    freed memory. The whole device is locked while the mode changes.
+    
+    @param *dev: The device
+    @param mode: EEPROM_CACHE_OFF, EEPROM_CACHE_WRITETHROUGH or
+                 EEPROM_CACHE_WRITEBACK
+*/
+void eeprom_dev_set_cache_mode(struct eeprom_dev *dev, enum eeprom_cache_mode mode) {
+    struct eeprom_cache *cache = &dev->cache;
+    
+    eeprom_lock(dev, 0, dev->geo.size, 1);
+    if (cache->mode == EEPROM_CACHE_WRITEBACK && mode != EEPROM_CACHE_WRITEBACK) {
+        cache_flush_locked(dev);
+    }
+    if (cache->image == NULL && mode != EEPROM_CACHE_OFF) {
+        cache->pages = geometry_num_pages(&dev->geo);
+        cache->image = malloc(dev->geo.size);
+        cache->valid = calloc(cache->pages, 1);
+        cache->dirty = calloc((cache->pages + 31)/32, sizeof(uint32_t));
+    } else if (cache->mode != EEPROM_CACHE_OFF && mode == EEPROM_CACHE_OFF) {
+        memset(cache->valid, 0, cache->pages);
+    }
+    // Lock-free readers see the RAM copy before the mode
+    __atomic_store_n(&cache->mode, mode, __ATOMIC_RELEASE);
+    eeprom_unlock(dev, 0, dev->geo.size, 1);
+}
+
+/*
+    This function frees the RAM copy of a device whose cache is off.
+    It is called by eeprom_close.
+*/
+void cache_close(struct eeprom_dev *dev) {
+    struct eeprom_cache *cache = &dev->cache;
+    
+    free(cache->image);
+    free(cache->valid);
+    free(cache->dirty);
+    cache->image = NULL;
+    cache->valid = NULL;
+    cache->dirty = NULL;
+}
+
+/*
+    This function marks num_page pages as held by the RAM copy. The store
+    publishes the bytes to lock-free readers, so it comes after them.
+*/
+static void valid_set(struct eeprom_cache *cache, int page, int num_page, uint8_t valid) {
+    int i;
+    
+    for (i = 0; i < num_page; i++) {
+        __atomic_store_n(&cache->valid[page+i], valid, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+    This function returns the cache mode of a device.
+*/
+enum eeprom_cache_mode eeprom_dev_get_cache_mode(struct eeprom_dev *dev) {
+    return dev->cache.mode;
+}
+
+/*
+    This function reads one page through the cache. A page that is not
+    in RAM yet is loaded from the image. The caller must hold the lock
+    for the page.
+    
+    @param *dev: The device
+    @param offset: Offset of the page, a multiple of the page size
+    @param *buf: The buffer to store one page
+    
+    @return: 0 for success, otherwise the prefetch_read_pages error
+*/
+int cache_read(struct eeprom_dev *dev, uint32_t offset, char *buf) {
+    struct eeprom_cache *cache = &dev->cache;
+    int page = offset >> dev->geo.page_shift;
+    
+    if (cache->mode == EEPROM_CACHE_OFF) {
+        return prefetch_read_pages(dev, offset, 1, buf);
+    }
+    if (!cache->valid[page]) {
+        int ret = prefetch_read_pages(dev, offset, 1, cache->image + offset);
+        if (ret != 0) {
+            return ret;
+        }
+        valid_set(cache, page, 1, 1);
+    }
+    memcpy(buf, cache->image + offset, geometry_page_size(&dev->geo));
+    return 0;
+}
+
+/*
+    This function writes num_page consecutive pages through the cache
+    without checking whether they changed. In write-through mode the
+    pages are also written to the image with a single prefetch_write_pages
+    call, in write-back mode they are only marked dirty.
+*/
+static int cache_store_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, const char *buf) {
+    struct eeprom_cache *cache = &dev->cache;
+    int page = offset >> dev->geo.page_shift;
+    int i;
+    
+    snapshot_preserve(dev, offset, num_page);
+    if (cache->mode == EEPROM_CACHE_OFF) {
+        return prefetch_write_pages(dev, offset, num_page, buf);
+    }
+    memcpy(cache->image + offset, buf, (size_t)num_page << dev->geo.page_shift);
+    for (i = 0; i < num_page; i++) {
+        __atomic_store_n(&cache->valid[page+i], 1, __ATOMIC_RELAXED);
+        if (cache->mode == EEPROM_CACHE_WRITEBACK) {
+            dirty_set(cache, page+i);
+        }
+    }
+    if (cache->mode == EEPROM_CACHE_WRITEBACK) {
+        return 0;
+    }
+    return prefetch_write_pages(dev, offset, num_page, buf);
+}
+
+/*
+    This function writes one page through the cache that the caller
+    already knows has changed, such as an edge page of the span engine
+    after comparing it. In write-through mode the page is also written
+    to the image, in write-back mode it is only marked dirty. The caller
+    must hold the write lock for the page.
+    
+    @param *dev: The device
+    @param offset: Offset of the page, a multiple of the page size
+    @param *buf: The buffer holding one page
+    
+    @return: 0 for success, otherwise the prefetch_write_pages error
+*/
+int cache_write(struct eeprom_dev *dev, uint32_t offset, const char *buf) {
+    return cache_store_pages(dev, offset, 1, buf);
+}
+
+/*
+    This function reads num_page consecutive pages through the cache.
+    With the cache off they are read with a single ll_dev_read_pages
+    call. The caller must hold the lock for the pages.
+    
+    @param *dev: The device
+    @param offset: Offset of the first page, a multiple of the page size
+    @param num_page: Number of pages to read
+    @param *buf: The buffer to store num_page pages
+    
+    @return: 0 for success, otherwise the prefetch_read_pages error
+*/
+int cache_read_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, char *buf) {
+    int i;
+    
+    if (dev->cache.mode == EEPROM_CACHE_OFF) {
+        return prefetch_read_pages(dev, offset, num_page, buf);
+    }
+    for (i = 0; i < num_page; i++) {
+        uint32_t pos = (uint32_t)i << dev->geo.page_shift;
+        int ret = cache_read(dev, offset + pos, buf + pos);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+    This function makes num_page consecutive pages resident in the RAM
+    copy, so they can be used in place at cache->image + offset. Runs of
+    pages that are not loaded yet are read with one prefetch_read_pages
+    call each. The caller must hold the lock for the pages.
+    
+    @param *dev: The device, with the cache on
+    @param offset: Offset of the first page, a multiple of the page size
+    @param num_page: Number of pages
+    
+    @return: 0 for success, otherwise the prefetch_read_pages error
+*/
+int cache_load_pages(struct eeprom_dev *dev, uint32_t offset, int num_page) {
+    struct eeprom_cache *cache = &dev->cache;
+    const int shift = dev->geo.page_shift;
+    int page = offset >> shift;
+    int i, run = 0;
+    
+    for (i = 0; i <= num_page; i++) {
+        if (i < num_page && !cache->valid[page+i]) {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            uint32_t pos = (uint32_t)(page + i - run) << shift;
+            int ret = prefetch_read_pages(dev, pos, run, cache->image + pos);
+            if (ret != 0) {
+                return ret;
+            }
+            valid_set(cache, page + i - run, run, 1);
+            run = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+    This function writes num_page consecutive pages through the cache,
+    skipping pages whose current contents already match buf (see
+    eeprom_dev_set_elide_mode). Every run of changed pages is written to
+    the image with a single prefetch_write_pages call, unless the cache is
+    in write-back mode. The caller must hold the write lock for the
+    pages.
+    
+    @param *dev: The device
+    @param offset: Offset of the first page, a multiple of the page size
+    @param num_page: Number of pages to write
+    @param *buf: The buffer holding num_page pages
+    
+    @return: 0 for success, otherwise the prefetch_write_pages error
+*/
+int cache_write_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, const char *buf) {
+    struct eeprom_cache *cache = &dev->cache;
+    const int shift = dev->geo.page_shift;
+    const size_t page_size = (size_t)1 << shift;
+    int page = offset >> shift;
+    char *old = NULL;
+    int i, run = 0, ret = 0;
+    
+    if (dev->elide_mode == EEPROM_ELIDE_OFF ||
+        (cache->mode == EEPROM_CACHE_OFF && dev->elide_mode == EEPROM_ELIDE_KNOWN)) {
+        return cache_store_pages(dev, offset, num_page, buf);
+    }
+    if (cache->mode == EEPROM_CACHE_OFF) {
+        // EEPROM_ELIDE_READ, a page read is much cheaper than a write cycle
+        old = malloc((size_t)num_page << shift);
+        if (prefetch_read_pages(dev, offset, num_page, old) != 0) {
+            free(old);
+            return cache_store_pages(dev, offset, num_page, buf);
+        }
+    }
+    for (i = 0; i <= num_page; i++) {
+        size_t pos = (size_t)i << shift;
+        int same = 0;
+        if (i < num_page) {
+            if (old != NULL) {
+                same = memcmp(old + pos, buf + pos, page_size) == 0;
+            } else if (cache->valid[page+i]) {
+                same = memcmp(cache->image + offset + pos, buf + pos, page_size) == 0;
+            }
+            if (same) {
+                stats_add(STAT_ELIDED_WRITES, 1);
+            } else {
+                run++;
+                continue;
+            }
+        }
+        if (run > 0) {
+            size_t start = (size_t)(i - run) << shift;
+            int err = cache_store_pages(dev, offset + start, run, buf + start);
+            if (ret == 0) {
+                ret = err;
+            }
+            run = 0;
+        }
+    }
+    free(old);
+    return ret;
+}
+
+/*
+    This function writes num_page consecutive pages straight to the
+    image, even in write-back mode, and keeps the cache in step: cached
+    copies are updated and the pages are no longer dirty. It is used
+    where the caller must know the pages reached the image, such as
+    when a journal is applied. The caller must hold the write lock for
+    the pages.
+    
+    @param *dev: The device
+    @param offset: Offset of the first page, a multiple of the page size
+    @param num_page: Number of pages to write
+    @param *buf: The buffer holding num_page pages
+    
+    @return: 0 for success, otherwise the prefetch_write_pages error
+*/
+int cache_write_through_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, const char *buf) {
+    struct eeprom_cache *cache = &dev->cache;
+    int page = offset >> dev->geo.page_shift;
+    
+    snapshot_preserve(dev, offset, num_page);
+    int ret = prefetch_write_pages(dev, offset, num_page, buf);
+    
+    if (ret == 0 && cache->mode != EEPROM_CACHE_OFF) {
+        memcpy(cache->image + offset, buf, (size_t)num_page << dev->geo.page_shift);
+        for (int i = 0; i < num_page; i++) {
+            __atomic_store_n(&cache->valid[page+i], 1, __ATOMIC_RELAXED);
+            if (cache->mode == EEPROM_CACHE_WRITEBACK) {
+                dirty_clear(cache, page+i);
+            }
+        }
+    }
+    return ret;
+}
+
+/*
+    This function erases num_page consecutive pages on the image, even in
+    write-back mode, and keeps the cache in step: cached copies read as
+    erased and dirty pages of the range are dropped, since the erase
+    replaces them. The caller must hold the write lock for the pages.
+    
+    @param *dev: The device
+    @param offset: Offset of the first page, a multiple of the page size
+    @param num_page: Number of pages to erase
+    
+    @return: 0 for success, otherwise the prefetch_erase_pages error
+*/
+int cache_erase_pages(struct eeprom_dev *dev, uint32_t offset, int num_page) {
+    struct eeprom_cache *cache = &dev->cache;
+    int page = offset >> dev->geo.page_shift;
+    
+    snapshot_preserve(dev, offset, num_page);
+    int ret = prefetch_erase_pages(dev, offset, num_page);
+    
+    if (cache->mode != EEPROM_CACHE_OFF) {
+        memset(cache->image + offset, LL_ERASED_BYTE, (size_t)num_page << dev->geo.page_shift);
+        for (int i = 0; i < num_page; i++) {
+            // Unknown what made it to the image, it is read again
+            __atomic_store_n(&cache->valid[page+i], ret == 0, __ATOMIC_RELAXED);
+            if (cache->mode == EEPROM_CACHE_WRITEBACK) {
+                dirty_clear(cache, page+i);
+            }
+        }
+    }
+    return ret;
+}
+
+/*
+    This function selects when a device skips page writes that would not
+    change the page:
+    - EEPROM_ELIDE_KNOWN (default): whenever the current contents are
+      known without extra I/O, i.e. the edge pages the span engine reads
+      anyway and pages held by the cache
+    - EEPROM_ELIDE_READ: also reads uncached pages before writing them
+    - EEPROM_ELIDE_OFF: every page is written
+    
+    @param *dev: The device
+    @param mode: The new mode
+*/
+void eeprom_dev_set_elide_mode(struct eeprom_dev *dev, enum eeprom_elide_mode mode) {
+    eeprom_lock(dev, 0, dev->geo.size, 1);
+    dev->elide_mode = mode;
+    eeprom_unlock(dev, 0, dev->geo.size, 1);
+}
+
+/*
+    This function writes every dirty page back to the image. Runs of
+    adjacent dirty pages are written with a single ll_dev_write_pages
+    call, and a run is only clean once its write succeeded. The caller
+    must hold the write lock for the whole device.
+    
+    @param *dev: The device
+    
+    @return: 0 for success, otherwise the first prefetch_write_pages error
+*/
+int cache_flush_locked(struct eeprom_dev *dev) {
+    struct eeprom_cache *cache = &dev->cache;
+    int page = 0;
+    int ret = 0;
+    
+    if (cache->mode != EEPROM_CACHE_WRITEBACK) {
+        return 0;
+    }
+    while (page < cache->pages) {
+        // Skip whole clean words
+        if (page % 32 == 0 && cache->dirty[page/32] == 0) {
+            page += 32;
+            continue;
+        }
+        if (!dirty_test(cache, page)) {
+            page++;
+            continue;
+        }
+        int first = page;
+        while (page < cache->pages && dirty_test(cache, page)) {
+            page++;
+        }
+        uint32_t pos = (uint32_t)first << dev->geo.page_shift;
+        int err = prefetch_write_pages(dev, pos, page-first, cache->image + pos);
+        if (err != 0) {
+            // The run stays dirty, so the next flush writes it again
+            if (ret == 0) {
+                ret = err;
+            }
+            continue;
+        }
+        for (int i = first; i < page; i++) {
+            dirty_clear(cache, i);
+        }
+    }
+    return ret;
+}
+
+/*
+    This function writes every dirty page of a device back to its image,
+    along with the checksum table pages that are not written back yet
+    (see crc_flush). Pages are only dirty in EEPROM_CACHE_WRITEBACK mode.
+    
+    @param *dev: The device
+    
+    @return: 0 for success, otherwise the prefetch_write_pages error, or
+             -1 if the checksums could not be written
+*/
+int eeprom_dev_flush(struct eeprom_dev *dev) {
+    eeprom_lock(dev, 0, dev->geo.size, 1);
+    int ret = cache_flush_locked(dev);
+    if (crc_flush(dev) != 0 && ret == 0) {
+        ret = -1;
+    }
+    eeprom_unlock(dev, 0, dev->geo.size, 1);
+    return ret;
+}
+
+/*
+    This function flushes the dirty pages of a device and then pushes
+    its image to stable storage.
+    
+    @param *dev: The device
+    
+    @return: 0 for success, -1 if either step failed
+*/
+int eeprom_dev_sync(struct eeprom_dev *dev) {
+    eeprom_lock(dev, 0, dev->geo.size, 1);
+    int ret = cache_flush_locked(dev);
+    if (crc_flush(dev) != 0) {
+        ret = -1;
+    }
+    if (ll_dev_sync(dev->ll) != 0) {
+        ret = -1;
+    }
+    eeprom_unlock(dev, 0, dev->geo.size, 1);
+    return ret;
+}
+
+/*
+    These functions do the same as the ones above on the default device.
+*/
+void eeprom_set_cache_mode(enum eeprom_cache_mode mode) {
+    eeprom_dev_set_cache_mode(eeprom_default(), mode);
+}
+enum eeprom_cache_mode eeprom_get_cache_mode() {
+    return eeprom_dev_get_cache_mode(eeprom_default());
+}
+int eeprom_flush() {
+    return eeprom_dev_flush(eeprom_default());
+}
+int eeprom_sync() {
+    return eeprom_dev_sync(eeprom_default());
+}
+void eeprom_set_elide_mode(enum eeprom_elide_mode mode) {
+    eeprom_dev_set_elide_mode(eeprom_default(), mode);
+}
@@ -0,0 +1,254 @@
+/*
+    @file   eeprom_client.c
+
+    @brief  This file contains the client side of the service in
+            eeprom_server.c. The calls mirror eeprom_read_bytes and
+            friends, and requests can be pipelined: send_read and
+            send_write only queue a request, and complete waits for the
+            oldest one.
+
+    @author     Frank Lee
+*/
+
+#include "../include/eeprom.h"
+#include "../include/eeprom_server.h"
+#include "../include/eeprom_client.h"
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+/*
+    This function reads exactly len bytes from the server.
+
+    @return: 0, or -5 if the connection is lost
+*/
+static int client_recv(struct eeprom_client *c, void *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t got = read(c->fd, (char *)buf + done, len - done);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            printf("ERROR: Lost the connection to the server!\n");
+            return -5;
+        }
+        done += got;
+    }
+    return 0;
+}
+
+/*
+    This function sends the queued requests.
+
+    @return: 0, or -5 if the connection is lost
+*/
+static int client_flush(struct eeprom_client *c) {
+    size_t done = 0;
+
+    while (done < c->out_len) {
+        ssize_t sent = send(c->fd, c->out + done, c->out_len - done, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            printf("ERROR: Lost the connection to the server!\n");
+            return -5;
+        }
+        done += sent;
+    }
+    c->out_len = 0;
+    return 0;
+}
+
+/*
+    This function queues a request and takes a slot for its response.
+
+    @return: 0 for success
+    @return: -2 for a full pipeline or invalid size
+    @return: -5 for a broken connection
+*/
+static int client_queue(struct eeprom_client *c, uint16_t op, uint32_t offset, int size,
+                        const void *data, void *buf) {
+    if (c->broken) {
+        printf("ERROR: Connection to the server is broken!\n");
+        return -5;
+    }
+    if (c->count == EEPROM_CLIENT_DEPTH) {
+        printf("ERROR: Too many requests in flight!\n");
+        return -2;
+    }
+    if (size < 0) {
+        printf("ERROR: Invalid size!\n");
+        return -2;
+    }
+    struct eeprom_server_req h = { c->next_id++, op, 0, offset, size };
+    size_t len = sizeof(h) + (data != NULL ? size : 0);
+    if (c->out_len + len > c->out_cap) {
+        c->out_cap = (c->out_len + len) * 2;
+        c->out = realloc(c->out, c->out_cap);
+    }
+    memcpy(c->out + c->out_len, &h, sizeof(h));
+    if (data != NULL) {
+        memcpy(c->out + c->out_len + sizeof(h), data, size);
+    }
+    c->out_len += len;
+
+    c->slot[(c->head + c->count) % EEPROM_CLIENT_DEPTH] = (struct eeprom_client_slot){ h.id, buf, size };
+    c->count++;
+    return 0;
+}
+
+/*
+    This function connects to a server.
+
+    @param *path: Socket of the server, EEPROM_SERVER_PATH for the daemon
+
+    @return: The client, or NULL for failure to connect
+*/
+struct eeprom_client *eeprom_client_open(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("ERROR: Socket path is too long!\n");
+        return NULL;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        printf("ERROR: Cannot connect to %s (%d)\n", path, errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    struct eeprom_client *c = calloc(1, sizeof(*c));
+    c->fd = fd;
+    return c;
+}
+
+/*
+    This function disconnects from the server. Requests still in flight
+    may or may not have been served.
+
+    @param *c: The client
+*/
+void eeprom_client_close(struct eeprom_client *c) {
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
+
+/*
+    These functions queue a read of size bytes into buf, or a write of
+    the size bytes at buf, without waiting for it. The write data is
+    copied, buf can be reused right away. A read's buf must stay valid
+    until the request is completed. At most EEPROM_CLIENT_DEPTH requests
+    can be in flight, and they are served in the order they were sent.
+
+    @param *c: The client
+    @param offset: Amount of offset from the beginning of EEPROM
+    @param size: Size of desired access
+    @param *buf: Pointer to the buffer
+
+    @return: 0 for success
+    @return: -2 for a full pipeline or invalid size
+    @return: -5 for a broken connection
+*/
+int eeprom_client_send_read(struct eeprom_client *c, uint32_t offset, int size, void *buf) {
+    return client_queue(c, EEPROM_OP_READ, offset, size, NULL, buf);
+}
+int eeprom_client_send_write(struct eeprom_client *c, uint32_t offset, int size, const void *buf) {
+    return client_queue(c, EEPROM_OP_WRITE, offset, size, buf, NULL);
+}
+
+/*
+    This function waits for the oldest request in flight to be served,
+    sending the queued ones first. A response that does not belong to
+    the request, or a connection lost in the middle of one, leaves the
+    client out of step with the server, so from then on the client is
+    broken and every call fails with -5.
+
+    @param *c: The client
+
+    @return: Status of the request, same as eeprom_dev_read_bytes or
+             eeprom_dev_write_bytes
+    @return: -4 for no request in flight
+    @return: -5 for failure to reach the server, or a broken connection
+*/
+int eeprom_client_complete(struct eeprom_client *c) {
+    struct eeprom_server_resp r;
+
+    if (c->count == 0) {
+        printf("ERROR: No request in flight!\n");
+        return -4;
+    }
+    struct eeprom_client_slot *s = &c->slot[c->head];
+    c->head = (c->head + 1) % EEPROM_CLIENT_DEPTH;
+    c->count--;
+    if (c->broken) {
+        printf("ERROR: Connection to the server is broken!\n");
+        return -5;
+    }
+    if (client_flush(c) != 0 || client_recv(c, &r, sizeof(r)) != 0) {
+        c->broken = 1;
+        return -5;
+    }
+    if (r.id != s->id || r.size < 0 || (r.size > 0 && (s->buf == NULL || r.size != s->size))) {
+        printf("ERROR: Unexpected response from the server!\n");
+        c->broken = 1;
+        return -5;
+    }
+    if (r.size > 0 && client_recv(c, s->buf, r.size) != 0) {
+        c->broken = 1;
+        return -5;
+    }
+    return r.status;
+}
+
+/*
+    These functions do the same as eeprom_dev_read_bytes and
+    eeprom_dev_write_bytes through the server, waiting for the request
+    and any request sent before it.
+*/
+int eeprom_client_read_bytes(struct eeprom_client *c, uint32_t offset, void *buf, size_t len) {
+    int ret = eeprom_client_send_read(c, offset, len > INT_MAX ? -1 : (int)len, buf);
+    while (ret == 0 && c->count > 1) {
+        eeprom_client_complete(c);
+    }
+    return ret != 0 ? ret : eeprom_client_complete(c);
+}
+int eeprom_client_write_bytes(struct eeprom_client *c, uint32_t offset, const void *buf, size_t len) {
+    int ret = eeprom_client_send_write(c, offset, len > INT_MAX ? -1 : (int)len, buf);
+    while (ret == 0 && c->count > 1) {
+        eeprom_client_complete(c);
+    }
+    return ret != 0 ? ret : eeprom_client_complete(c);
+}
+
+/*
+    These functions do the same as eeprom_dev_read and eeprom_dev_write
+    through the server.
+
+    @return: Same as eeprom_client_read_bytes/_write_bytes
+    @return: -4 for strlen(buf) != size (write)
+*/
+int eeprom_client_read(struct eeprom_client *c, uint32_t offset, int size, char *buf) {
+    int ret = eeprom_client_read_bytes(c, offset, buf, size < 0 ? (size_t)INT_MAX + 1 : (size_t)size);
+    if (size > 0 && ret == 0) {
+        // Ending the character array
+        buf[size] = '\0';
+    }
+    return ret;
+}
+int eeprom_client_write(struct eeprom_client *c, uint32_t offset, int size, char *buf) {
+    if (size > 0 && strnlen(buf, size + 1) != (size_t)size) {
+        printf("ERROR: Size of buf is different than the amount of size to be written!\n");
+        return -4;
+    }
+    return eeprom_client_write_bytes(c, offset, buf, size < 0 ? (size_t)INT_MAX + 1 : (size_t)size);
+}
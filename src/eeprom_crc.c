@@ -0,0 +1,470 @@
+/*
+    @file   eeprom_crc.c
+
+    @brief  This file contains the per-page checksums. The layer sits
+            between the read-ahead prefetcher and wear leveling, keeps a
+            CRC-32 of every logical page in a region at the end of the
+            image, and checks every page read from the image against it.
+
+    @author     Frank Lee
+*/
+
+#include "../include/eeprom.h"
+#include "../include/eeprom_crc.h"
+
+// CRC-32 (IEEE 802.3, reflected) of every byte value
+static uint32_t crc_lut[256];
+
+static pthread_once_t crc_lut_once = PTHREAD_ONCE_INIT;
+
+
+/*
+    This function fills crc_lut.
+*/
+static void crc_lut_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ 0xEDB88320u : c >> 1;
+        }
+        crc_lut[i] = c;
+    }
+}
+
+/*
+    This function continues a CRC-32 over len more bytes, one table
+    lookup per byte. Start with 0.
+
+    @param crc: CRC of the bytes so far
+    @param *buf: The bytes
+    @param len: Number of bytes
+
+    @return: CRC of all the bytes
+*/
+uint32_t eeprom_crc32(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+
+    pthread_once(&crc_lut_once, crc_lut_init);
+    crc = ~crc;
+    while (len-- > 0) {
+        crc = crc_lut[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/*
+    This function returns the number of table pages for a geometry.
+*/
+static int crc_table_pages(const struct eeprom_geometry *geo) {
+    int per_page = geometry_page_size(geo) / sizeof(uint32_t);
+    return (geometry_num_pages(geo) + per_page - 1) / per_page;
+}
+
+/*
+    This function returns the size of the checksum region of a device:
+    the header page and the table pages.
+
+    @param *geo: Geometry of the device
+
+    @return: Region size in bytes
+*/
+uint32_t crc_region_size(const struct eeprom_geometry *geo) {
+    return (uint32_t)(1 + crc_table_pages(geo)) * geometry_page_size(geo);
+}
+
+/*
+    This function marks the table page holding the checksum of page
+    dirty. The caller holds c->lock.
+*/
+static void crc_set(struct eeprom_dev *dev, int page, uint32_t crc) {
+    struct eeprom_crc *c = dev->crc;
+    int tpage = page * (int)sizeof(uint32_t) >> dev->geo.page_shift;
+
+    c->table[page] = crc;
+    if (!(c->dirty[tpage/32] & (1u << (tpage%32)))) {
+        c->dirty[tpage/32] |= 1u << (tpage%32);
+        c->num_dirty++;
+    }
+}
+
+/*
+    This function writes the dirty table pages back, one transfer per run
+    of them. A run stays dirty if its write fails, so the next write back
+    retries it. The caller holds c->lock.
+
+    @return: 0 for success, otherwise the first ll_dev_write_pages error
+*/
+static int crc_write_back(struct eeprom_dev *dev) {
+    struct eeprom_crc *c = dev->crc;
+    const int shift = dev->geo.page_shift;
+    int i, j, run = 0, ret = 0;
+
+    for (i = 0; i <= c->table_pages; i++) {
+        if (i < c->table_pages && (c->dirty[i/32] & (1u << (i%32)))) {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            uint32_t first = i - run;
+            int err = ll_dev_write_pages(dev->ll, c->start + ((1 + first) << shift), run,
+                                         (char *)c->table + ((size_t)first << shift));
+            for (j = first; err == 0 && j < i; j++) {
+                c->dirty[j/32] &= ~(1u << (j%32));
+                c->num_dirty--;
+            }
+            if (ret == 0) {
+                ret = err;
+            }
+            run = 0;
+        }
+    }
+    return ret;
+}
+
+/*
+    This function writes the header page of the checksum region. It is
+    written with clean cleared when the device is opened and with clean
+    set once the table was written back on close.
+
+    @return: 0 for success, otherwise the ll_dev_write_pages error
+*/
+static int crc_write_header(struct eeprom_dev *dev, uint32_t clean) {
+    const int page_size = 1 << dev->geo.page_shift;
+    struct crc_header h = { EEPROM_CRC_MAGIC, geometry_num_pages(&dev->geo), clean, 0 };
+    char *page = malloc(page_size);
+    int ret;
+
+    h.check = eeprom_crc32(0, &h, offsetof(struct crc_header, check));
+    memset(page, LL_ERASED_BYTE, page_size);
+    memcpy(page, &h, sizeof(h));
+    ret = ll_dev_write_pages(dev->ll, dev->crc->start, 1, page);
+    free(page);
+    return ret;
+}
+
+/*
+    This function frees the checksum state of a device.
+*/
+static void crc_free(struct eeprom_dev *dev) {
+    struct eeprom_crc *c = dev->crc;
+
+    pthread_mutex_destroy(&c->lock);
+    free(c->table);
+    free(c->dirty);
+    free(c);
+    dev->crc = NULL;
+}
+
+/*
+    This function sets up the checksums of a device whose image is
+    already open, with a single read of the checksum region. A region
+    without a valid header, like the one of a new image or of an image
+    that was used without checksums so far, is built from the current
+    contents of the pages: one read of the data pages and one write of
+    the region. A header without clean set means the device was not
+    closed, so the entries of the pages written since the last write back
+    never made it to the image. Every page is then read, and the entries
+    that do not match are rebuilt from the pages and counted in c->stale.
+
+    @param *dev: The device, with wear leveling already set up
+    @param start: Offset of the checksum region in the image
+
+    @return: 0 for success, -5 for failure to access the device
+*/
+int crc_open(struct eeprom_dev *dev, uint32_t start) {
+    struct eeprom_crc *c = calloc(1, sizeof(*c));
+    const int shift = dev->geo.page_shift;
+    const int page_size = 1 << shift;
+    const int pages = geometry_num_pages(&dev->geo);
+    struct crc_header h;
+    char *region;
+    int p, ret;
+
+    c->start = start;
+    c->table_pages = crc_table_pages(&dev->geo);
+    c->dirty = calloc((c->table_pages + 31) / 32, sizeof(uint32_t));
+    pthread_mutex_init(&c->lock, NULL);
+    dev->crc = c;
+
+    region = malloc((size_t)(1 + c->table_pages) << shift);
+    memset(region, LL_ERASED_BYTE, page_size);
+    c->erased = eeprom_crc32(0, region, page_size);
+    ret = ll_dev_read_pages(dev->ll, start, 1 + c->table_pages, region);
+    memcpy(&h, region, sizeof(h));
+    // The table is kept separately, so write back never touches the header
+    c->table = malloc((size_t)c->table_pages << shift);
+    memcpy(c->table, region + page_size, (size_t)c->table_pages << shift);
+
+    if (ret == 0 && (h.magic != EEPROM_CRC_MAGIC || h.pages != pages ||
+                     h.check != eeprom_crc32(0, &h, offsetof(struct crc_header, check)))) {
+        char *data = malloc(dev->geo.size);
+        // Writing the last page first extends a short file, so the data
+        // pages read back now the way they will from now on
+        ret = ll_dev_write_pages(dev->ll, start + ((uint32_t)c->table_pages << shift), 1,
+                                 region + ((size_t)c->table_pages << shift));
+        if (ret == 0) {
+            ret = wear_read_pages(dev, 0, pages, data);
+        }
+        for (p = 0; p < pages && ret == 0; p++) {
+            c->table[p] = eeprom_crc32(0, data + ((size_t)p << shift), page_size);
+        }
+        free(data);
+        if (ret == 0) {
+            h = (struct crc_header){ EEPROM_CRC_MAGIC, pages, 0, 0 };
+            h.check = eeprom_crc32(0, &h, offsetof(struct crc_header, check));
+            memset(region, LL_ERASED_BYTE, page_size);
+            memcpy(region, &h, sizeof(h));
+            memcpy(region + page_size, c->table, (size_t)c->table_pages << shift);
+            ret = ll_dev_write_pages(dev->ll, start, 1 + c->table_pages, region);
+        }
+    } else if (ret == 0) {
+        if (!h.clean) {
+            char *data = malloc(dev->geo.size);
+            ret = wear_read_pages(dev, 0, pages, data);
+            for (p = 0; p < pages && ret == 0; p++) {
+                uint32_t crc = eeprom_crc32(0, data + ((size_t)p << shift), page_size);
+                if (crc != c->table[p]) {
+                    crc_set(dev, p, crc);
+                    c->stale++;
+                }
+            }
+            free(data);
+            if (ret == 0) {
+                ret = crc_write_back(dev);
+            }
+        }
+        // Until the device is closed the table on the image may lag behind
+        if (ret == 0) {
+            ret = crc_write_header(dev, 0);
+        }
+    }
+    free(region);
+    if (ret != 0) {
+        printf("ERROR: Cannot set up the page checksums!\n");
+        crc_free(dev);
+        return -5;
+    }
+    return 0;
+}
+
+/*
+    This function writes the table back, marks the table on the image
+    clean and frees the checksum state of a device.
+
+    @param *dev: The device
+*/
+void crc_close(struct eeprom_dev *dev) {
+    struct eeprom_crc *c = dev->crc;
+
+    if (c == NULL) {
+        return;
+    }
+    if (crc_flush(dev) == 0) {
+        crc_write_header(dev, 1);
+    }
+    crc_free(dev);
+}
+
+/*
+    This function writes back the dirty table pages of a device. It is
+    called by eeprom_dev_flush, eeprom_dev_sync and eeprom_close.
+
+    @param *dev: The device
+
+    @return: 0 for success (or without checksums), otherwise the
+             ll_dev_write_pages error
+*/
+int crc_flush(struct eeprom_dev *dev) {
+    struct eeprom_crc *c = dev->crc;
+    int ret;
+
+    if (c == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&c->lock);
+    ret = crc_write_back(dev);
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+/*
+    This function checks num_page consecutive logical pages against their
+    checksums. The caller holds the lock for the pages, so their entries
+    are stable.
+
+    @param *dev: The device
+    @param first: First page
+    @param num_page: Number of pages
+    @param *buf: Their contents
+
+    @return: 0 if every page matches (or without checksums), -3 otherwise
+*/
+int crc_check_pages(struct eeprom_dev *dev, int first, int num_page, const char *buf) {
+    struct eeprom_crc *c = dev->crc;
+    const int shift = dev->geo.page_shift;
+    int i, ret = 0;
+
+    for (i = 0; c != NULL && i < num_page; i++) {
+        if (eeprom_crc32(0, buf + ((size_t)i << shift), (size_t)1 << shift) != c->table[first + i]) {
+            printf("ERROR: Checksum mismatch on page %d!\n", first + i);
+            stats_add(STAT_CRC_ERRORS, 1);
+            ret = -3;
+        }
+    }
+    return ret;
+}
+
+/*
+    This function reads num_page consecutive logical pages with
+    wear_read_pages and checks every one of them against its checksum.
+    Without checksums it is wear_read_pages.
+
+    @param *dev: The device
+    @param offset: Offset of the first page
+    @param num_page: Number of pages to read
+    @param *buf: The buffer to store num_page pages
+
+    @return: 0 for success, -3 if a page does not match its checksum,
+             otherwise the wear_read_pages error
+*/
+int crc_read_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, char *buf) {
+    int ret = wear_read_pages(dev, offset, num_page, buf);
+
+    if (ret != 0) {
+        return ret;
+    }
+    return crc_check_pages(dev, offset >> dev->geo.page_shift, num_page, buf);
+}
+
+/*
+    This function writes num_page consecutive logical pages with
+    wear_write_pages and updates their checksums. The table pages that
+    hold them are only marked dirty. They are written back, one transfer
+    per run of them, once more than EEPROM_CRC_DIRTY_MAX of them are
+    dirty and by crc_flush, so a run of writes to nearby pages costs one
+    table page write per page_size / 4 pages rather than one per write.
+    The checksums are updated even if the write fails, so pages that may
+    not have been written fail their check until they are written again.
+
+    @param *dev: The device
+    @param offset: Offset of the first page
+    @param num_page: Number of pages to write
+    @param *buf: The buffer holding num_page pages
+
+    @return: 0 for success, otherwise the wear_write_pages or
+             ll_dev_write_pages error
+*/
+int crc_write_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, const char *buf) {
+    struct eeprom_crc *c = dev->crc;
+    const int shift = dev->geo.page_shift;
+    int first = offset >> shift;
+    uint32_t *crc;
+    int i, ret;
+
+    if (c == NULL) {
+        return wear_write_pages(dev, offset, num_page, buf);
+    }
+    crc = malloc(sizeof(*crc) * num_page);
+    for (i = 0; i < num_page; i++) {
+        crc[i] = eeprom_crc32(0, buf + ((size_t)i << shift), (size_t)1 << shift);
+    }
+    ret = wear_write_pages(dev, offset, num_page, buf);
+
+    pthread_mutex_lock(&c->lock);
+    for (i = 0; i < num_page; i++) {
+        crc_set(dev, first + i, crc[i]);
+    }
+    if (c->num_dirty > EEPROM_CRC_DIRTY_MAX) {
+        int err = crc_write_back(dev);
+        if (ret == 0) {
+            ret = err;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    free(crc);
+    return ret;
+}
+
+/*
+    This function erases num_page consecutive logical pages with
+    wear_erase_pages and sets their checksums to the one of an erased
+    page, see crc_write_pages.
+
+    @param *dev: The device
+    @param offset: Offset of the first page
+    @param num_page: Number of pages to erase
+
+    @return: 0 for success, otherwise the wear_erase_pages or
+             ll_dev_write_pages error
+*/
+int crc_erase_pages(struct eeprom_dev *dev, uint32_t offset, int num_page) {
+    struct eeprom_crc *c = dev->crc;
+    int first = offset >> dev->geo.page_shift;
+    int i, ret;
+
+    ret = wear_erase_pages(dev, offset, num_page);
+    if (c == NULL) {
+        return ret;
+    }
+    pthread_mutex_lock(&c->lock);
+    for (i = 0; i < num_page; i++) {
+        crc_set(dev, first + i, c->erased);
+    }
+    if (c->num_dirty > EEPROM_CRC_DIRTY_MAX) {
+        int err = crc_write_back(dev);
+        if (ret == 0) {
+            ret = err;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+/*
+    This function checks every page on the image against its checksum.
+    The whole device is read with one transfer, bypassing the cache and
+    the read-ahead windows, so what is checked is what the image holds.
+    Pages of a write-back cache that were not flushed yet are checked
+    as the image has them.
+
+    @param *dev: The device
+    @param *bad: Where the numbers of the bad pages are stored, or NULL
+    @param max: Room in bad
+
+    @return: The number of bad pages (which may exceed max)
+    @return: -1 for a device without checksums
+    @return: -5 for failure to access the device
+*/
+int eeprom_dev_verify(struct eeprom_dev *dev, uint32_t *bad, int max) {
+    struct eeprom_crc *c = dev->crc;
+    const int shift = dev->geo.page_shift;
+    const int pages = geometry_num_pages(&dev->geo);
+    int p, ret, num_bad = 0;
+
+    if (c == NULL) {
+        printf("ERROR: Device has no checksums!\n");
+        return -1;
+    }
+    char *data = malloc(dev->geo.size);
+    eeprom_lock(dev, 0, dev->geo.size, 0);
+    ret = wear_read_pages(dev, 0, pages, data);
+    for (p = 0; p < pages && ret == 0; p++) {
+        if (eeprom_crc32(0, data + ((size_t)p << shift), (size_t)1 << shift) != c->table[p]) {
+            if (bad != NULL && num_bad < max) {
+                bad[num_bad] = p;
+            }
+            num_bad++;
+        }
+    }
+    eeprom_unlock(dev, 0, dev->geo.size, 0);
+    free(data);
+    if (ret != 0) {
+        return -5;
+    }
+    stats_add(STAT_CRC_ERRORS, num_bad);
+    return num_bad;
+}
+
+int eeprom_verify(uint32_t *bad, int max) {
+    return eeprom_dev_verify(eeprom_default(), bad, max);
+}
@@ -0,0 +1,87 @@
+/*
+    @file   eeprom_daemon.c
+
+    @brief  This file contains eepromd, which serves one device to the
+            processes of the machine (see eeprom_server.c) until it gets
+            SIGINT or SIGTERM.
+
+    @author     Frank Lee
+*/
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../include/eeprom.h"
+#include "../include/eeprom_server.h"
+
+static void daemon_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-f image] [-p socket] [-l global|rw|striped|seq] [-c off|wt|wb]\n"
+            "  -f  image file (default eeprom.img)\n"
+            "  -p  socket path (default " EEPROM_SERVER_PATH ")\n"
+            "  -l  lock mode (default global)\n"
+            "  -c  cache mode (default off)\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    struct eeprom_config cfg = {
+        .geo = { EEPROM_PAGE_SHIFT, EEPROM_SIZE },
+        .ll = { .path = "eeprom.img", .mode = LL_MODE_MMAP },
+        .lock_mode = EEPROM_LOCK_GLOBAL,
+        .cache_mode = EEPROM_CACHE_OFF,
+    };
+    const char *path = EEPROM_SERVER_PATH;
+    sigset_t set;
+    int opt, sig;
+
+    while ((opt = getopt(argc, argv, "f:p:l:c:")) != -1) {
+        switch (opt) {
+        case 'f':
+            cfg.ll.path = optarg;
+            break;
+        case 'p':
+            path = optarg;
+            break;
+        case 'l':
+            cfg.lock_mode = !strcmp(optarg, "rw") ? EEPROM_LOCK_RW :
+                            !strcmp(optarg, "striped") ? EEPROM_LOCK_STRIPED :
+                            !strcmp(optarg, "seq") ? EEPROM_LOCK_SEQ : EEPROM_LOCK_GLOBAL;
+            break;
+        case 'c':
+            cfg.cache_mode = !strcmp(optarg, "wt") ? EEPROM_CACHE_WRITETHROUGH :
+                             !strcmp(optarg, "wb") ? EEPROM_CACHE_WRITEBACK : EEPROM_CACHE_OFF;
+            break;
+        default:
+            daemon_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Block the signals before any thread starts, so sigwait gets them
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    struct eeprom_dev *dev = eeprom_open(&cfg);
+    if (dev == NULL) {
+        return 1;
+    }
+    struct eeprom_server *srv = eeprom_server_start(dev, path);
+    if (srv == NULL) {
+        eeprom_close(dev);
+        return 1;
+    }
+    printf("Serving %s on %s\n", cfg.ll.path, path);
+    fflush(stdout);
+
+    sigwait(&set, &sig);
+    eeprom_server_stop(srv);
+    eeprom_close(dev);
+    return 0;
+}
@@ -0,0 +1,622 @@
+/*
+    @file   eeprom_kv.c
+
+    @brief  This file contains a log-structured key-value store on top of
+            the byte API. Puts and deletes append a record starting on a
+            fresh page, so no page is ever read back to be modified, and a
+            RAM index built by one sequential scan at open tells where the
+            latest record of every key is. Compaction copies the live
+            records into the other half of the region.
+
+    @author     Frank Lee
+*/
+
+#include "../include/eeprom.h"
+#include "../include/eeprom_kv.h"
+
+
+/*
+    This function hashes a key into a bucket of the index (FNV-1a).
+*/
+static int kv_hash(const char *key) {
+    uint32_t h = 2166136261u;
+
+    while (*key != '\0') {
+        h = (h ^ (uint8_t)*key++) * 16777619u;
+    }
+    return h % EEPROM_KV_BUCKETS;
+}
+
+/*
+    This function returns the offset of half idx of the region.
+*/
+static uint32_t kv_base(const struct eeprom_kv *kv, int idx) {
+    return kv->offset + idx * kv->half;
+}
+
+/*
+    This function returns how many bytes of the log a record takes,
+    rounded up to whole pages.
+*/
+static uint32_t kv_rec_size(const struct eeprom_kv *kv, int key_len, int val_len) {
+    const uint32_t mask = geometry_page_size(&kv->dev->geo) - 1;
+    uint32_t size = sizeof(struct kv_rec_header) + key_len + (val_len == EEPROM_KV_DELETED ? 0 : val_len);
+
+    return (size + mask) & ~mask;
+}
+
+/*
+    This function computes the check of a record from its lengths and
+    the bytes after its header.
+*/
+static uint32_t kv_rec_check(const struct kv_rec_header *h, const char *body) {
+    int body_len = h->key_len + (h->val_len == EEPROM_KV_DELETED ? 0 : h->val_len);
+    uint32_t crc = eeprom_crc32(0, &h->key_len, sizeof(h->key_len) + sizeof(h->val_len));
+
+    return eeprom_crc32(crc, body, body_len);
+}
+
+/*
+    This function returns the link pointing at the entry of a key, which
+    points at NULL if the key is not in the index.
+*/
+static struct kv_entry **kv_find(struct eeprom_kv *kv, const char *key) {
+    struct kv_entry **link = &kv->bucket[kv_hash(key)];
+
+    while (*link != NULL && strcmp((*link)->key, key) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/*
+    This function records in the index that the latest record of a key
+    is at pos, and keeps count of the bytes taken by live records.
+*/
+static void kv_index(struct eeprom_kv *kv, const char *key, uint32_t pos, int val_len) {
+    struct kv_entry **link = kv_find(kv, key);
+    struct kv_entry *e = *link;
+
+    if (e != NULL) {
+        kv->live -= kv_rec_size(kv, strlen(key), e->val_len);
+        if (val_len == EEPROM_KV_DELETED) {
+            *link = e->next;
+            free(e);
+            kv->count--;
+            return;
+        }
+    } else if (val_len == EEPROM_KV_DELETED) {
+        return;
+    } else {
+        e = calloc(1, sizeof(*e));
+        strcpy(e->key, key);
+        e->next = kv->bucket[kv_hash(key)];
+        kv->bucket[kv_hash(key)] = e;
+        kv->count++;
+    }
+    e->pos = pos;
+    e->val_len = val_len;
+    kv->live += kv_rec_size(kv, strlen(key), val_len);
+}
+
+/*
+    This function reads the header page of half idx.
+
+    @return: 1 if it is valid, and *gen is set, otherwise 0
+*/
+static int kv_read_header(struct eeprom_kv *kv, int idx, uint32_t *gen) {
+    struct kv_half_header h;
+
+    if (eeprom_dev_read_bytes(kv->dev, kv_base(kv, idx), &h, sizeof(h)) != 0 ||
+        h.magic != EEPROM_KV_MAGIC || h.check != eeprom_crc32(0, &h, offsetof(struct kv_half_header, check))) {
+        return 0;
+    }
+    *gen = h.gen;
+    return 1;
+}
+
+/*
+    This function writes the header page of half idx, which makes it the
+    active half once it is on the image.
+
+    @return: 0 for success, otherwise the eeprom_dev_write_bytes error
+*/
+static int kv_write_header(struct eeprom_kv *kv, int idx, uint32_t gen) {
+    const uint32_t page_size = geometry_page_size(&kv->dev->geo);
+    struct kv_half_header h = { EEPROM_KV_MAGIC, gen };
+    char *page = malloc(page_size);
+    int ret;
+
+    h.check = eeprom_crc32(0, &h, offsetof(struct kv_half_header, check));
+    memset(page, LL_ERASED_BYTE, page_size);
+    memcpy(page, &h, sizeof(h));
+    ret = eeprom_dev_write_bytes(kv->dev, kv_base(kv, idx), page, page_size);
+    free(page);
+    return ret;
+}
+
+/*
+    This function builds the index with one sequential pass over the
+    active half. The log ends at the first page that does not start a
+    record with a valid check, which is also where the next record goes.
+*/
+static void kv_scan(struct eeprom_kv *kv) {
+    const uint32_t page_size = geometry_page_size(&kv->dev->geo);
+    char body[EEPROM_KV_KEY_MAX + EEPROM_KV_VALUE_MAX];
+    char key[EEPROM_KV_KEY_MAX + 1];
+    struct kv_rec_header h;
+    struct eeprom_stream *s;
+
+    kv->tail = page_size;
+    s = eeprom_stream_open(kv->dev, kv_base(kv, kv->active) + kv->tail, EEPROM_STREAM_READ);
+    while (kv->tail + sizeof(h) <= kv->half) {
+        if (eeprom_stream_read_next(s, &h, sizeof(h)) != sizeof(h) || h.magic != EEPROM_KV_REC_MAGIC ||
+            h.key_len == 0 || h.key_len > EEPROM_KV_KEY_MAX ||
+            (h.val_len > EEPROM_KV_VALUE_MAX && h.val_len != EEPROM_KV_DELETED)) {
+            break;
+        }
+        uint32_t size = kv_rec_size(kv, h.key_len, h.val_len);
+        int body_len = h.key_len + (h.val_len == EEPROM_KV_DELETED ? 0 : h.val_len);
+        if (kv->tail + size > kv->half || eeprom_stream_read_next(s, body, body_len) != body_len ||
+            h.check != kv_rec_check(&h, body)) {
+            break;
+        }
+        memcpy(key, body, h.key_len);
+        key[h.key_len] = '\0';
+        // Skip the padding up to the next page
+        uint32_t pad = size - sizeof(h) - body_len;
+        while (pad > 0) {
+            int n = pad < sizeof(body) ? pad : sizeof(body);
+            if (eeprom_stream_read_next(s, body, n) != n) {
+                break;
+            }
+            pad -= n;
+        }
+        kv_index(kv, key, kv->tail, h.val_len);
+        kv->tail += size;
+    }
+    eeprom_stream_close(s);
+}
+
+/*
+    This function opens the store kept in a region of a device, and
+    creates an empty one if the region holds none. The region is split
+    into two halves of whole pages, so it must be at least four pages.
+
+    @param *dev: The device, which must stay open until the store is
+                 closed
+    @param offset: Start of the region, a multiple of the page size
+    @param size: Size of the region
+
+    @return: The store, or NULL for an invalid region or failure to
+             access the device
+*/
+struct eeprom_kv *eeprom_kv_open(struct eeprom_dev *dev, uint32_t offset, uint32_t size) {
+    const uint32_t page_size = geometry_page_size(&dev->geo);
+    uint32_t gen[2];
+    int valid[2];
+
+    if ((offset & (page_size - 1)) != 0 || size > dev->geo.size - offset || size / 2 < 2 * page_size) {
+        printf("ERROR: Invalid key-value region!\n");
+        return NULL;
+    }
+    struct eeprom_kv *kv = calloc(1, sizeof(*kv));
+    kv->dev = dev;
+    kv->offset = offset;
+    kv->half = size / 2 & ~(page_size - 1);
+    pthread_mutex_init(&kv->lock, NULL);
+    pthread_cond_init(&kv->compacted, NULL);
+
+    valid[0] = kv_read_header(kv, 0, &gen[0]);
+    valid[1] = kv_read_header(kv, 1, &gen[1]);
+    if (valid[0] || valid[1]) {
+        kv->active = valid[1] && (!valid[0] || gen[1] > gen[0]);
+        kv->gen = gen[kv->active];
+    } else if (eeprom_dev_erase(dev, offset, kv->half) != 0 || kv_write_header(kv, 0, 1) != 0) {
+        printf("ERROR: Cannot create the key-value store!\n");
+        pthread_cond_destroy(&kv->compacted);
+        pthread_mutex_destroy(&kv->lock);
+        free(kv);
+        return NULL;
+    } else {
+        kv->gen = 1;
+    }
+    kv_scan(kv);
+    return kv;
+}
+
+// Where a live record is copied by a compaction
+struct kv_move {
+    uint32_t from;              // Position in the active half
+    uint32_t to;                // Position in the other half
+    uint32_t size;
+};
+
+static int kv_move_compare(const void *a, const void *b) {
+    const struct kv_move *x = a, *y = b;
+    return (x->from > y->from) - (x->from < y->from);
+}
+
+/*
+    This function lists the live records in log order. The caller holds
+    kv->lock.
+
+    @return: The list, which the caller frees
+*/
+static struct kv_move *kv_live_records(struct eeprom_kv *kv) {
+    struct kv_move *moves = malloc((kv->count > 0 ? kv->count : 1) * sizeof(*moves));
+    struct kv_entry *e;
+    int i, n = 0;
+
+    for (i = 0; i < EEPROM_KV_BUCKETS; i++) {
+        for (e = kv->bucket[i]; e != NULL; e = e->next) {
+            moves[n++] = (struct kv_move){ e->pos, 0, kv_rec_size(kv, strlen(e->key), e->val_len) };
+        }
+    }
+    qsort(moves, n, sizeof(*moves), kv_move_compare);
+    return moves;
+}
+
+/*
+    This function erases half next and copies the listed records into
+    it, one read and one write per record, setting where each one went.
+    It only touches half next and records that no put changes, so the
+    helper thread runs it without kv->lock.
+
+    @return: 0 for success, -5 for failure to access the device
+*/
+static int kv_copy_records(struct eeprom_kv *kv, int next, struct kv_move *moves, int n, uint32_t *tail) {
+    uint32_t from = kv_base(kv, !next), to = kv_base(kv, next);
+    char *rec = malloc(kv_rec_size(kv, EEPROM_KV_KEY_MAX, EEPROM_KV_VALUE_MAX));
+    int i, ret;
+
+    *tail = geometry_page_size(&kv->dev->geo);
+    ret = eeprom_dev_erase(kv->dev, to, kv->half);
+    for (i = 0; i < n && ret == 0; i++) {
+        ret = eeprom_dev_read_bytes(kv->dev, from + moves[i].from, rec, moves[i].size);
+        if (ret == 0) {
+            ret = eeprom_dev_write_bytes(kv->dev, to + *tail, rec, moves[i].size);
+        }
+        moves[i].to = *tail;
+        *tail += moves[i].size;
+    }
+    free(rec);
+    return ret != 0 ? -5 : 0;
+}
+
+/*
+    This function makes half next active once its header is written,
+    pointing the index at the copies. Records at or past since were
+    appended to the old half after the copy started, and were moved
+    together to moved_to. The caller holds kv->lock.
+*/
+static void kv_switch(struct eeprom_kv *kv, const struct kv_move *moves, int n,
+                      uint32_t since, uint32_t moved_to, uint32_t tail) {
+    struct kv_entry *e;
+    int i;
+
+    for (i = 0; i < EEPROM_KV_BUCKETS; i++) {
+        for (e = kv->bucket[i]; e != NULL; e = e->next) {
+            if (e->pos >= since) {
+                e->pos = moved_to + e->pos - since;
+            } else {
+                struct kv_move key = { e->pos };
+                const struct kv_move *m = bsearch(&key, moves, n, sizeof(*moves), kv_move_compare);
+                e->pos = m->to;
+            }
+        }
+    }
+    kv->active = !kv->active;
+    kv->gen++;
+    kv->tail = tail;
+}
+
+/*
+    This function waits for the helper thread to finish. The caller
+    holds kv->lock.
+*/
+static void kv_wait_compactor(struct eeprom_kv *kv) {
+    while (kv->compacting) {
+        pthread_cond_wait(&kv->compacted, &kv->lock);
+    }
+}
+
+/*
+    This function copies the live records into the other half and makes
+    it the active half by writing its header last. A power loss before
+    that leaves the old half active. A compaction running on the helper
+    thread is waited for first. The caller holds kv->lock.
+
+    @return: 0 for success, -5 for failure to access the device
+*/
+static int kv_compact_locked(struct eeprom_kv *kv) {
+    uint32_t tail;
+    int ret;
+
+    kv_wait_compactor(kv);
+    const int next = !kv->active;
+    const int n = kv->count;
+    struct kv_move *moves = kv_live_records(kv);
+    ret = kv_copy_records(kv, next, moves, n, &tail);
+    if (ret == 0 && kv_write_header(kv, next, kv->gen + 1) != 0) {
+        ret = -5;
+    }
+    if (ret == 0) {
+        kv_switch(kv, moves, n, kv->tail, tail, tail);
+    }
+    free(moves);
+    return ret;
+}
+
+/*
+    This function is the helper thread started by kv_append. It lists
+    the live records under kv->lock, copies them without it, so gets and
+    puts go on meanwhile, and takes the lock again to copy the records
+    appended since, write the header and switch halves. A failure to
+    access the device is left in kv->compact_failed for the next put.
+*/
+static void *kv_compact_thread(void *vargp) {
+    struct eeprom_kv *kv = vargp;
+    char *rec = NULL;
+    uint32_t since, tail;
+    int next, n, ret;
+
+    pthread_mutex_lock(&kv->lock);
+    struct kv_move *moves = kv_live_records(kv);
+    n = kv->count;
+    next = !kv->active;
+    since = kv->tail;
+    pthread_mutex_unlock(&kv->lock);
+
+    ret = kv_copy_records(kv, next, moves, n, &tail);
+
+    pthread_mutex_lock(&kv->lock);
+    uint32_t len = kv->tail - since;
+    if (ret == 0 && tail + len > kv->half) {
+        // The puts since filled the room, a later put tries again
+        ret = -3;
+    }
+    if (ret == 0 && len > 0) {
+        // Records are whole pages and positions are relative to a half,
+        // so the records appended since move as one block
+        rec = malloc(len);
+        if (eeprom_dev_read_bytes(kv->dev, kv_base(kv, !next) + since, rec, len) != 0 ||
+            eeprom_dev_write_bytes(kv->dev, kv_base(kv, next) + tail, rec, len) != 0) {
+            ret = -5;
+        }
+        free(rec);
+    }
+    if (ret == 0 && kv_write_header(kv, next, kv->gen + 1) != 0) {
+        ret = -5;
+    }
+    if (ret == 0) {
+        kv_switch(kv, moves, n, since, tail, tail + len);
+    }
+    kv->compact_failed = ret == -5;
+    kv->compacting = 0;
+    pthread_cond_broadcast(&kv->compacted);
+    pthread_mutex_unlock(&kv->lock);
+    free(moves);
+    return NULL;
+}
+
+/*
+    This function appends a record to the active half, compacting first
+    if it does not fit or if the helper thread failed, and points the
+    index at it. Once the log passes EEPROM_KV_COMPACT_PCT percent and
+    at least a quarter of the half is taken by stale records, compaction
+    is started on a helper thread, which only holds kv->lock at its start
+    and end, so gets and puts are not held up by the copy. The caller
+    holds kv->lock.
+
+    @return: 0 for success, -3 for a full store, -5 for failure to
+             access the device
+*/
+static int kv_append(struct eeprom_kv *kv, const char *key, const void *val, int val_len) {
+    const uint32_t page_size = geometry_page_size(&kv->dev->geo);
+    const int key_len = strlen(key);
+    uint32_t size = kv_rec_size(kv, key_len, val_len);
+    struct kv_rec_header h = { EEPROM_KV_REC_MAGIC, 0, key_len, val_len };
+    int ret;
+
+    if (kv->tail + size > kv->half) {
+        // The helper thread may be about to make room
+        kv_wait_compactor(kv);
+    }
+    if (kv->compact_failed) {
+        kv->compact_failed = 0;
+        if (kv_compact_locked(kv) != 0) {
+            return -5;
+        }
+    }
+    if (kv->tail + size > kv->half && kv_compact_locked(kv) != 0) {
+        return -5;
+    }
+    if (kv->tail + size > kv->half) {
+        printf("ERROR: Key-value store is full!\n");
+        return -3;
+    }
+
+    char *rec = malloc(size);
+    memset(rec, LL_ERASED_BYTE, size);
+    memcpy(rec + sizeof(h), key, key_len);
+    if (val_len != EEPROM_KV_DELETED) {
+        memcpy(rec + sizeof(h) + key_len, val, val_len);
+    }
+    h.check = kv_rec_check(&h, rec + sizeof(h));
+    memcpy(rec, &h, sizeof(h));
+    // Whole pages, so none of them is read first
+    ret = eeprom_dev_write_bytes(kv->dev, kv_base(kv, kv->active) + kv->tail, rec, size);
+    free(rec);
+    if (ret != 0) {
+        return -5;
+    }
+    kv_index(kv, key, kv->tail, val_len);
+    kv->tail += size;
+
+    if (!kv->compacting && kv->tail >= (uint64_t)kv->half * EEPROM_KV_COMPACT_PCT / 100 &&
+        kv->tail - page_size - kv->live >= kv->half / 4) {
+        if (kv->joinable) {
+            // It already let go of the lock, we hold it
+            pthread_join(kv->compactor, NULL);
+        }
+        kv->joinable = pthread_create(&kv->compactor, NULL, kv_compact_thread, kv) == 0;
+        kv->compacting = kv->joinable;
+    }
+    return 0;
+}
+
+/*
+    This function checks a key.
+
+    @return: Its length, or -1 for an empty or too long key
+*/
+static int kv_key_check(const char *key) {
+    size_t len = key != NULL ? strlen(key) : 0;
+
+    if (len == 0 || len > EEPROM_KV_KEY_MAX) {
+        printf("ERROR: Invalid key!\n");
+        return -1;
+    }
+    return (int)len;
+}
+
+/*
+    This function reads the value of a key with a single read of its
+    record, which is one page read for records that fit a page.
+
+    @param *kv: The store
+    @param *key: The key, up to EEPROM_KV_KEY_MAX characters
+    @param *buf: Where up to len bytes of the value are stored
+    @param len: Size of buf
+
+    @return: The length of the value, which may be larger than len
+    @return: -1 for an invalid key
+    @return: -4 for a key that is not in the store
+    @return: -5 for failure to access the device or a corrupt record
+*/
+int eeprom_kv_get(struct eeprom_kv *kv, const char *key, void *buf, size_t len) {
+    char rec[sizeof(struct kv_rec_header) + EEPROM_KV_KEY_MAX + EEPROM_KV_VALUE_MAX];
+    struct kv_rec_header h;
+    struct kv_entry *e;
+    int key_len = kv_key_check(key);
+    int ret;
+
+    if (key_len < 0) {
+        return key_len;
+    }
+    pthread_mutex_lock(&kv->lock);
+    e = *kv_find(kv, key);
+    if (e == NULL) {
+        pthread_mutex_unlock(&kv->lock);
+        return -4;
+    }
+    ret = eeprom_dev_read_bytes(kv->dev, kv_base(kv, kv->active) + e->pos, rec,
+                                sizeof(h) + key_len + e->val_len);
+    memcpy(&h, rec, sizeof(h));
+    if (ret == 0 && (h.magic != EEPROM_KV_REC_MAGIC || h.key_len != key_len || h.val_len != e->val_len ||
+                     h.check != kv_rec_check(&h, rec + sizeof(h)))) {
+        printf("ERROR: Corrupt key-value record!\n");
+        ret = -5;
+    }
+    if (ret == 0) {
+        memcpy(buf, rec + sizeof(h) + key_len, len < e->val_len ? len : e->val_len);
+        ret = e->val_len;
+    }
+    pthread_mutex_unlock(&kv->lock);
+    return ret < 0 ? -5 : ret;
+}
+
+/*
+    This function sets the value of a key by appending a record.
+
+    @param *kv: The store
+    @param *key: The key, up to EEPROM_KV_KEY_MAX characters
+    @param *val: The value
+    @param len: Size of the value, up to EEPROM_KV_VALUE_MAX
+
+    @return: 0 for success
+    @return: -1 for an invalid key
+    @return: -2 for invalid size
+    @return: -3 for a full store
+    @return: -5 for failure to access the device
+*/
+int eeprom_kv_put(struct eeprom_kv *kv, const char *key, const void *val, size_t len) {
+    int ret = kv_key_check(key);
+
+    if (ret < 0) {
+        return ret;
+    }
+    if (len > EEPROM_KV_VALUE_MAX) {
+        printf("ERROR: Invalid size value!\n");
+        return -2;
+    }
+    pthread_mutex_lock(&kv->lock);
+    ret = kv_append(kv, key, val, (int)len);
+    pthread_mutex_unlock(&kv->lock);
+    return ret;
+}
+
+/*
+    This function removes a key by appending a record that deletes it.
+
+    @param *kv: The store
+    @param *key: The key
+
+    @return: 0 for success
+    @return: -1 for an invalid key
+    @return: -3 for a full store
+    @return: -4 for a key that is not in the store
+    @return: -5 for failure to access the device
+*/
+int eeprom_kv_delete(struct eeprom_kv *kv, const char *key) {
+    int ret = kv_key_check(key);
+
+    if (ret < 0) {
+        return ret;
+    }
+    pthread_mutex_lock(&kv->lock);
+    if (*kv_find(kv, key) == NULL) {
+        ret = -4;
+    } else {
+        ret = kv_append(kv, key, NULL, EEPROM_KV_DELETED);
+    }
+    pthread_mutex_unlock(&kv->lock);
+    return ret;
+}
+
+/*
+    This function compacts the store right away, see kv_compact_locked.
+
+    @return: 0 for success, -5 for failure to access the device
+*/
+int eeprom_kv_compact(struct eeprom_kv *kv) {
+    int ret;
+
+    pthread_mutex_lock(&kv->lock);
+    ret = kv_compact_locked(kv);
+    pthread_mutex_unlock(&kv->lock);
+    return ret;
+}
+
+/*
+    This function waits for a compaction in progress and frees the
+    store. Every record is on the device already.
+*/
+void eeprom_kv_close(struct eeprom_kv *kv) {
+    int i;
+
+    if (kv->joinable) {
+        pthread_join(kv->compactor, NULL);
+    }
+    for (i = 0; i < EEPROM_KV_BUCKETS; i++) {
+        while (kv->bucket[i] != NULL) {
+            struct kv_entry *e = kv->bucket[i];
+            kv->bucket[i] = e->next;
+            free(e);
+        }
+    }
+    pthread_cond_destroy(&kv->compacted);
+    pthread_mutex_destroy(&kv->lock);
+    free(kv);
+}
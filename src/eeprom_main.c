@@ -14,9 +14,53 @@ int main() {
 
     eeprom_read_test();     // eeprom_read test
 
-    eeprom_reset();
+    reset_test();           // eeprom_reset, then the fixture is written back
 
     eeprom_write_test();    // eeprom_write test
+
+    cache_test();           // write-back cache test
+
+    vector_test();          // eeprom_readv/eeprom_writev test
+
+    bytes_test();           // eeprom_read_bytes/eeprom_write_bytes test
+
+    async_test();           // eeprom_aio_submit test
+
+    stats_test();           // instrumentation counters
+
+    wear_test();            // wear leveling
+
+    elide_test();           // unchanged page writes are skipped
+
+    txn_test();             // transactions survive a power loss
+
+    stream_test();          // sequential cursor
+
+    prefetch_test();        // read-ahead
+
+    snapshot_test();        // snapshot, restore and bulk program
+
+    erase_test();           // bulk erase
+
+    crc_test();             // per-page checksums
+
+    view_test();            // zero-copy reads
+
+    lock_test();            // lock modes keep writes atomic
+
+    seq_test();             // lock-free reads
+
+    kv_test();              // key-value store
+
+    server_test();          // service daemon
+
+    timing_test();          // ll timing model
+
+    backend_test();         // mmap and pread backends
+
+    bus_test();             // simulated I2C/SPI bus
+
+    geometry_test();        // every supported geometry
     
     
     printf("----Starting mutex test----\n");
@@ -73,7 +117,7 @@ void *thread_func_2(void *vargp) {
     // Continue until all threads have done 5 writes
     while (j < 5) {
         printf("Thread %d write #%d start.\n", myid, j + 1);
-        eeprom_write(0, 32, str);
+        eeprom_write_bytes(0, str, 32);     // str has no room for a '\0'
         printf("Thread %d write #%d end.\n", myid, j + 1);
         j++;
         
@@ -88,7 +132,7 @@ void *thread_func_3(void *vargp) {
     // Continue until all threads have done 5 writes
     while (j < 5) {
         printf("Thread %d write #%d start.\n", myid, j + 1);
-        eeprom_write(0, 32, str);
+        eeprom_write_bytes(0, str, 32);     // str has no room for a '\0'
         printf("Thread %d write #%d end.\n", myid, j + 1);
         j++;
         
@@ -241,3 +285,1606 @@ void eeprom_write_test() {
 
 
 }
+
+
+/*
+    The reset test erases the default device and checks every byte reads
+    back as LL_ERASED_BYTE. It then writes backup_test.txt back, the way
+    make restores test.txt, so the tests after it run against the
+    fixture text.
+*/
+void reset_test() {
+    struct eeprom_dev *dev = eeprom_default();
+    char *buf = malloc(dev->geo.size);
+    size_t len = 0;
+    int i, ok;
+
+    printf("----eeprom_reset test----\n");
+    eeprom_reset();
+    ok = eeprom_read_bytes(0, buf, dev->geo.size) == 0;
+    for (i = 0; i < dev->geo.size; i++) {
+        ok &= (unsigned char)buf[i] == LL_ERASED_BYTE;
+    }
+    printf("Every byte is erased --->%s\n", ok ? "PASS" : "FAIL");
+
+    FILE *f = fopen("backup_test.txt", "rb");
+    if (f != NULL) {
+        len = fread(buf, 1, dev->geo.size, f);
+        fclose(f);
+    }
+    ok = len > 0 && eeprom_write_bytes(0, buf, len) == 0;
+    printf("Fixture written back from backup_test.txt --->%s\n\n", ok ? "PASS" : "FAIL");
+    free(buf);
+}
+
+/*
+    This test checks the write-back cache. Writes must stay in RAM, be
+    visible to eeprom_read right away, and only reach the device after
+    eeprom_flush, also when an earlier flush failed.
+*/
+void cache_test() {
+    char out[256];
+    char pages[2*PAGE_SIZE];
+    char str[11] = "0123456789";
+    int i;
+
+    printf("----cache test----\n");
+    eeprom_set_cache_mode(EEPROM_CACHE_WRITEBACK);
+    for (i = 0; i < 5; i++) {
+        eeprom_write(60, 10, str);
+    }
+    eeprom_read(32, 64, out);
+    printf("Offset:32, Size:64 (cached) --->%s\n", out);
+    ll_read_pages(32, 2, pages);
+    printf("Device untouched before flush --->%s\n",
+           memcmp(pages+28, str, 10) != 0 ? "PASS" : "FAIL");
+    // Power is lost during the first flush, the second one retries
+    ll_dev_fail_after(eeprom_default()->ll, 0);
+    i = eeprom_flush();
+    ll_dev_fail_after(eeprom_default()->ll, -1);
+    printf("Failed flush is reported --->%s\n", i != 0 ? "PASS" : "FAIL");
+    i = eeprom_flush();
+    ll_read_pages(32, 2, pages);
+    printf("Device updated after flush --->%s\n\n",
+           i == 0 && memcmp(pages+28, str, 10) == 0 ? "PASS" : "FAIL");
+    eeprom_set_cache_mode(EEPROM_CACHE_OFF);
+}
+
+
+/*
+    This test checks eeprom_readv and eeprom_writev against the single
+    segment calls. The segments share pages, sit on adjacent pages and
+    overlap, so they exercise run merging and partial page reads.
+*/
+void vector_test() {
+    char expect[512];
+    char got[512];
+    char a[40], b[10], c[20], d[5];
+    int i;
+
+    printf("----eeprom_readv/eeprom_writev test----\n");
+    eeprom_read(1000, 300, expect);
+    struct eeprom_iovec rv[3] = {
+        { 1200, 40, a },    // Read out of order on purpose
+        { 1000, 10, b },
+        { 1010, 20, c },
+    };
+    eeprom_readv(rv, 3);
+    printf("eeprom_readv matches eeprom_read --->%s\n",
+           memcmp(a, expect+200, 40) == 0 && memcmp(b, expect, 10) == 0 &&
+           memcmp(c, expect+10, 20) == 0 ? "PASS" : "FAIL");
+
+    memset(a, 'A', sizeof(a));
+    memset(b, 'B', sizeof(b));
+    memset(c, 'C', sizeof(c));
+    memset(d, 'D', sizeof(d));
+    struct eeprom_iovec wv[4] = {
+        { 1030, 20, c },
+        { 1005, 10, b },
+        { 1120, 40, a },    // Page after the first run ends, merged into it
+        { 1012, 5, d },     // Overlaps b and c, applied last
+    };
+    eeprom_writev(wv, 4);
+    memcpy(expect+30, c, 20);
+    memcpy(expect+5, b, 10);
+    memcpy(expect+120, a, 40);
+    memcpy(expect+12, d, 5);
+    eeprom_read(1000, 300, got);
+    printf("eeprom_writev result --->%s\n", memcmp(got, expect, 300) == 0 ? "PASS" : "FAIL");
+    for (i = 0; i < 300; i++) {
+        if (got[i] != expect[i]) {
+            printf("Mismatch at offset %d\n", 1000 + i);
+            break;
+        }
+    }
+
+    // Power is lost before the batch is written
+    ll_dev_fail_after(eeprom_default()->ll, 0);
+    i = eeprom_writev(wv, 4);
+    ll_dev_fail_after(eeprom_default()->ll, -1);
+    printf("eeprom_writev reports a failed write --->%s\n\n", i == -5 ? "PASS" : "FAIL");
+}
+
+
+/*
+    The bytes test writes a blob holding '\0' bytes across a page
+    boundary and reads it back into a buffer with a guard byte, which
+    must not be touched.
+*/
+void bytes_test() {
+    unsigned char blob[48], got[49];
+    int i, ok;
+
+    printf("----eeprom_read_bytes/eeprom_write_bytes test----\n");
+    for (i = 0; i < sizeof(blob); i++) {
+        blob[i] = i % 3 == 0 ? 0 : 0x80 + i;
+    }
+    got[48] = 0xA5;
+    ok = eeprom_write_bytes(3000, blob, sizeof(blob)) == 0;
+    ok &= eeprom_read_bytes(3000, got, sizeof(blob)) == 0;
+    ok &= memcmp(got, blob, sizeof(blob)) == 0 && got[48] == 0xA5;
+    ok &= eeprom_write_bytes(3000, blob, 0) == -2;
+    ok &= eeprom_read_bytes(8180, got, 20) == -3;
+    printf("Binary data round trip --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+
+/*
+    The stats test does one access of every alignment case on pages
+    nobody else touches and checks what was counted, then traces one
+    more access.
+*/
+void stats_test() {
+    struct eeprom_stats st;
+    struct eeprom_trace_rec rec[4];
+    char buf[65];
+    int ok;
+
+    printf("----Instrumentation test----\n");
+    eeprom_stats_reset();
+    eeprom_read_bytes(3072, buf, 64);       // Case 1, 2 pages
+    eeprom_read_bytes(3072, buf, 40);       // Case 2, 2 pages
+    memset(buf, 'S', 24);
+    eeprom_write_bytes(3080, buf, 24);      // Case 3, 1 page read and written
+    memset(buf, 'T', 2);
+    eeprom_write_bytes(3081, buf, 2);       // Case 4, 1 page read and written
+    eeprom_stats_snapshot(&st);
+    ok = st.calls[0] == 1 && st.calls[1] == 1 && st.calls[2] == 1 && st.calls[3] == 1;
+    ok &= st.page_reads == 6 && st.page_writes == 2 && st.rmw == 2;
+    ok &= st.bytes_read == 104 && st.bytes_written == 26 && st.lock_acquires == 0;
+    printf("Counters --->%s\n", ok ? "PASS" : "FAIL");
+
+    eeprom_stats_reset();
+    eeprom_stats_set_flags(EEPROM_STATS_TRACE | EEPROM_STATS_LOCK_TIMING);
+    eeprom_read_bytes(3090, buf, 5);
+    eeprom_stats_set_flags(0);
+    eeprom_stats_snapshot(&st);
+    ok = st.lock_acquires == 1 && eeprom_trace_read(rec, 4) == 1;
+    ok &= rec[0].offset == 3090 && rec[0].size == 5 && rec[0].write == 0;
+    printf("Lock timing and trace --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+/*
+    The elide test writes back data that is already stored and counts
+    the page writes that still reach the image.
+*/
+void elide_test() {
+    struct eeprom_stats st;
+    char buf[64];
+    int ok;
+
+    printf("----Write elision test----\n");
+    eeprom_read_bytes(4096, buf, 64);
+    eeprom_stats_reset();
+    eeprom_write_bytes(4100, buf + 4, 50);  // Case 4, both edge pages unchanged
+    eeprom_stats_snapshot(&st);
+    ok = st.page_writes == 0 && st.elided_writes == 2;
+    eeprom_write_bytes(4096, buf, 64);      // Case 1, pages are not known
+    eeprom_stats_snapshot(&st);
+    ok &= st.page_writes == 2;
+    printf("Unchanged edge pages are not written --->%s\n", ok ? "PASS" : "FAIL");
+
+    eeprom_set_elide_mode(EEPROM_ELIDE_READ);
+    eeprom_stats_reset();
+    buf[40] ^= 1;
+    eeprom_write_bytes(4096, buf, 64);      // Only the second page changed
+    eeprom_stats_snapshot(&st);
+    ok = st.page_reads == 2 && st.page_writes == 1 && st.elided_writes == 1;
+    buf[40] ^= 1;
+    eeprom_write_bytes(4096, buf, 64);
+    eeprom_set_elide_mode(EEPROM_ELIDE_KNOWN);
+    printf("Unchanged body pages are not written --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+/*
+    This function opens a new device for a test, removing whatever image
+    an earlier run left at cfg->ll.path (see TEST_CONFIG).
+
+    @return: The device, or NULL if it cannot be opened
+*/
+struct eeprom_dev *test_open(const struct eeprom_config *cfg) {
+    remove(cfg->ll.path);
+    return eeprom_open(cfg);
+}
+
+/*
+    This function closes a device opened with test_open and removes its
+    image.
+*/
+void test_close(struct eeprom_dev *dev) {
+    const char *path = dev->ll->config.path;
+
+    eeprom_close(dev);
+    remove(path);
+}
+
+#define WEAR_TEST_HOT_WRITES 2000
+
+/*
+    The wear test hammers one page of a wear leveled device, checks that
+    the writes were spread over the spares at one metadata write per
+    move, and that the page map comes back after reopening the device.
+    Last it tears the metadata write of a move on a device whose
+    metadata pages hold several entries, and checks no other page lost
+    its place.
+*/
+void wear_test() {
+    struct eeprom_config cfg = TEST_CONFIG("wear_test.img", .wear = { .spares = 8, .threshold = 4 });
+    static char model[8192], got[8192];
+    char page[32];
+    struct eeprom_wear_info info;
+    struct eeprom_stats st;
+    int i, ok;
+
+    printf("----Wear leveling test----\n");
+    struct eeprom_dev *dev = test_open(&cfg);
+    memset(model, LL_ERASED_BYTE, sizeof(model));
+
+    eeprom_stats_reset();
+    for (i = 0; i < WEAR_TEST_HOT_WRITES; i++) {
+        memset(page, 'a' + i % 26, sizeof(page));
+        eeprom_dev_write_bytes(dev, 0, page, sizeof(page));
+    }
+    memcpy(model, page, sizeof(page));
+    eeprom_stats_snapshot(&st);
+    eeprom_dev_wear_info(dev, &info);
+    printf("Hot page: %llu moves, erase counts %u..%u\n",
+           (unsigned long long)info.moves, info.min_erase, info.max_erase);
+    ok = info.moves > 0 && info.max_erase < WEAR_TEST_HOT_WRITES / 4;
+    ok &= st.page_writes == WEAR_TEST_HOT_WRITES + info.moves;
+    printf("Writes spread, one extra page write per move --->%s\n", ok ? "PASS" : "FAIL");
+
+    srand(13);
+    for (i = 0; i < 300; i++) {
+        uint32_t offset = rand() % 8000;
+        int size = 1 + rand() % 150;
+        int j;
+        for (j = 0; j < size; j++) {
+            model[offset + j] = rand();
+        }
+        eeprom_dev_write_bytes(dev, offset, model + offset, size);
+    }
+    eeprom_dev_read_bytes(dev, 0, got, sizeof(got));
+    ok = memcmp(got, model, sizeof(got)) == 0;
+    eeprom_close(dev);
+
+    dev = eeprom_open(&cfg);
+    ok &= dev != NULL;
+    if (dev != NULL) {
+        eeprom_dev_read_bytes(dev, 0, got, sizeof(got));
+        ok &= memcmp(got, model, sizeof(got)) == 0;
+        eeprom_dev_wear_info(dev, &info);
+        ok &= info.max_erase > 0 && info.max_erase < WEAR_TEST_HOT_WRITES / 4;
+        test_close(dev);
+    }
+    printf("Page map rebuilt after reopen --->%s\n", ok ? "PASS" : "FAIL");
+
+    // 64-byte pages put three entries in every metadata page
+    cfg.geo = (struct eeprom_geometry){ 6, 8192 };
+    memset(model, LL_ERASED_BYTE, sizeof(model));
+    dev = test_open(&cfg);
+    for (i = 0; i < WEAR_TEST_HOT_WRITES; i++) {
+        memset(model + (i % 3) * 64, 'a' + i % 26, 64);
+        eeprom_dev_write_bytes(dev, (i % 3) * 64, model + (i % 3) * 64, 64);
+    }
+    // Let the data of the next move through and fail its metadata write
+    int ret = 0;
+    for (i = 0; i < 100 && ret == 0; i++) {
+        ll_dev_fail_after(dev->ll, 1);
+        memset(page, 'A' + i % 26, sizeof(page));
+        ret = eeprom_dev_write_bytes(dev, 0, page, sizeof(page));
+        if (ret == 0) {
+            memcpy(model, page, sizeof(page));
+        }
+    }
+    ll_dev_fail_after(dev->ll, -1);
+    ok = ret == -5;
+
+    // The copies not in use are what a torn write would have left
+    struct eeprom_wear *w = dev->wear;
+    for (i = 0; i < w->meta_pages; i++) {
+        crc_test_rot(cfg.ll.path, (long)(w->phys_pages + 2 * i + (w->meta_copy[i] ^ 1)) * 64 + 7);
+    }
+    eeprom_close(dev);
+
+    dev = eeprom_open(&cfg);
+    ok &= dev != NULL;
+    if (dev != NULL) {
+        eeprom_dev_read_bytes(dev, 0, got, sizeof(got));
+        // The failed write may or may not have reached page 0
+        ok &= memcmp(got + 64, model + 64, sizeof(got) - 64) == 0;
+        ok &= memcmp(got + 32, model + 32, 32) == 0;
+        ok &= memcmp(got, model, 32) == 0 || memcmp(got, page, 32) == 0;
+        test_close(dev);
+    }
+    printf("Torn metadata write keeps the other pages --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+#define TXN_TEST_THREADS 4
+#define TXN_TEST_COMMITS 8
+
+/*
+    This function commits two writes of c in one transaction: a Case 4
+    span over four pages and a short write further up.
+
+    @return: What eeprom_txn_commit returned
+*/
+int txn_test_commit(struct eeprom_dev *dev, char c) {
+    char buf[100];
+
+    memset(buf, c, sizeof(buf));
+    struct eeprom_txn *txn = eeprom_txn_begin(dev);
+    eeprom_txn_write(txn, 37, buf, 100);
+    eeprom_txn_write(txn, 600, buf, 10);
+    return eeprom_txn_commit(txn);
+}
+
+struct txn_test_arg {
+    struct eeprom_dev *dev;
+    int id;
+    int ok;
+};
+
+void *txn_test_thread(void *vargp) {
+    struct txn_test_arg *arg = vargp;
+    char buf[25];
+    int i;
+
+    // Every thread owns its own 200 bytes
+    for (i = 0; i < TXN_TEST_COMMITS; i++) {
+        struct eeprom_txn *txn = eeprom_txn_begin(arg->dev);
+        memset(buf, 'a' + arg->id, sizeof(buf));
+        eeprom_txn_write(txn, 4000 + arg->id * 200 + i * 25, buf, sizeof(buf));
+        arg->ok &= eeprom_txn_commit(txn) == 0;
+    }
+    return NULL;
+}
+
+/*
+    The transaction test cuts the power after every possible number of
+    page writes of a commit, reopens the device and checks that it holds
+    either all of the transaction or none of it. It then fails a commit
+    after its journal block is written and cuts the power in the commit
+    after it, and checks the first one is still applied in full on the
+    next open. Then several threads
+    commit at once, and their commits must share journal blocks.
+*/
+void txn_test() {
+    struct eeprom_config cfg = TEST_CONFIG("txn_test.img", .journal_pages = 16);
+    static char got[1024], big[1024];
+    struct txn_test_arg arg[TXN_TEST_THREADS];
+    pthread_t tid[TXN_TEST_THREADS];
+    struct eeprom_stats st;
+    int n, i, ok = 1, done = 0;
+
+    printf("----Transaction test----\n");
+    for (n = 0; !done; n++) {
+        struct eeprom_dev *dev = test_open(&cfg);
+        memset(got, 'o', sizeof(got));
+        eeprom_dev_write_bytes(dev, 0, got, sizeof(got));
+        ll_dev_fail_after(dev->ll, n);
+        done = txn_test_commit(dev, 'n') == 0;
+        eeprom_close(dev);
+
+        dev = eeprom_open(&cfg);
+        ok &= dev != NULL;
+        if (dev == NULL) {
+            break;
+        }
+        eeprom_dev_read_bytes(dev, 0, got, sizeof(got));
+        eeprom_close(dev);
+        char c = got[37];
+        ok &= c == 'n' || (c == 'o' && !done);
+        for (i = 0; i < sizeof(got); i++) {
+            int in_txn = (i >= 37 && i < 137) || (i >= 600 && i < 610);
+            ok &= got[i] == (in_txn ? c : 'o');
+        }
+    }
+    printf("Power lost after each of %d page writes, all or nothing --->%s\n",
+           n - 1, ok ? "PASS" : "FAIL");
+
+    // The first commit is cut half way through writing its pages home,
+    // the next one after each of its page writes
+    ok = 1;
+    done = 0;
+    for (n = 0; !done; n++) {
+        struct eeprom_dev *dev = test_open(&cfg);
+        memset(got, 'o', sizeof(got));
+        eeprom_dev_write_bytes(dev, 0, got, sizeof(got));
+        ll_dev_fail_after(dev->ll, 9);
+        ok &= txn_test_commit(dev, 'n') == -5;
+        ll_dev_fail_after(dev->ll, n);
+        memset(big, 'm', 10);
+        struct eeprom_txn *txn = eeprom_txn_begin(dev);
+        eeprom_txn_write(txn, 900, big, 10);
+        done = eeprom_txn_commit(txn) == 0;
+        eeprom_close(dev);
+
+        dev = eeprom_open(&cfg);
+        ok &= dev != NULL;
+        if (dev == NULL) {
+            break;
+        }
+        eeprom_dev_read_bytes(dev, 0, got, sizeof(got));
+        eeprom_close(dev);
+        char c = got[900];
+        ok &= c == 'm' || (c == 'o' && !done);
+        for (i = 0; i < sizeof(got); i++) {
+            int in_txn = (i >= 37 && i < 137) || (i >= 600 && i < 610);
+            ok &= got[i] == (in_txn ? 'n' : i >= 900 && i < 910 ? c : 'o');
+        }
+    }
+    printf("A commit that was not applied survives the next one --->%s\n", ok ? "PASS" : "FAIL");
+
+    cfg.ll.timing.page_write_ns = 200000;
+    struct eeprom_dev *dev = test_open(&cfg);
+    struct eeprom_txn *txn = eeprom_txn_begin(dev);
+    eeprom_txn_write(txn, 0, big, sizeof(big));
+    ok = eeprom_txn_commit(txn) == -6;
+
+    eeprom_stats_reset();
+    for (i = 0; i < TXN_TEST_THREADS; i++) {
+        arg[i] = (struct txn_test_arg){ dev, i, 1 };
+        pthread_create(&tid[i], NULL, txn_test_thread, &arg[i]);
+    }
+    for (i = 0; i < TXN_TEST_THREADS; i++) {
+        pthread_join(tid[i], NULL);
+        ok &= arg[i].ok;
+    }
+    eeprom_stats_snapshot(&st);
+    printf("%llu commits in %llu journal blocks\n",
+           (unsigned long long)st.txn_commits, (unsigned long long)st.journal_blocks);
+    eeprom_dev_read_bytes(dev, 4000, got, TXN_TEST_THREADS * 200);
+    for (i = 0; i < TXN_TEST_THREADS * 200; i++) {
+        ok &= got[i] == 'a' + i / 200;
+    }
+    ok &= st.txn_commits == TXN_TEST_THREADS * TXN_TEST_COMMITS;
+    ok &= st.journal_blocks < st.txn_commits;
+    test_close(dev);
+    printf("Concurrent commits are grouped --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+/*
+    The stream test writes and reads back the whole image in odd sized
+    chunks through a cursor, starting off a page boundary, and checks
+    that every page was transferred exactly once. Plain chunked reads
+    are shown for comparison.
+*/
+void stream_test() {
+    struct eeprom_config cfg = TEST_CONFIG("stream_test.img");
+    static const int chunks[] = { 1, 7, 13, 50, 100, 3, 64, 31, 200, 33 };
+    static char model[8192], got[8192];
+    struct eeprom_stats st;
+    uint32_t pos;
+    int i, n, ok;
+
+    printf("----Stream test----\n");
+    struct eeprom_dev *dev = test_open(&cfg);
+    for (i = 0; i < sizeof(model); i++) {
+        model[i] = i < 5 ? 0 : i * 7 + 3;
+    }
+
+    eeprom_stats_reset();
+    struct eeprom_stream *s = eeprom_stream_open(dev, 5, EEPROM_STREAM_WRITE);
+    for (pos = 5, i = 0; (n = eeprom_stream_write_next(s, model + pos, chunks[i % 10])) > 0; i++) {
+        pos += n;
+    }
+    ok = eeprom_stream_close(s) == 0 && pos == sizeof(model);
+    eeprom_stats_snapshot(&st);
+    ok &= st.page_writes == 256 && st.page_reads == 1;
+    printf("Write: %llu page writes, %llu page reads\n",
+           (unsigned long long)st.page_writes, (unsigned long long)st.page_reads);
+
+    eeprom_stats_reset();
+    s = eeprom_stream_open(dev, 5, EEPROM_STREAM_READ);
+    for (pos = 5, i = 0; (n = eeprom_stream_read_next(s, got + pos, chunks[i % 10])) > 0; i++) {
+        pos += n;
+    }
+    eeprom_stream_close(s);
+    eeprom_stats_snapshot(&st);
+    ok &= pos == sizeof(got) && memcmp(got + 5, model + 5, sizeof(got) - 5) == 0;
+    ok &= st.page_reads == 256;
+    printf("Read: %llu page reads", (unsigned long long)st.page_reads);
+
+    eeprom_stats_reset();
+    for (pos = 5, i = 0; pos < sizeof(got); pos += n, i++) {
+        n = chunks[i % 10] < sizeof(got) - pos ? chunks[i % 10] : sizeof(got) - pos;
+        eeprom_dev_read_bytes(dev, pos, got + pos, n);
+    }
+    eeprom_stats_snapshot(&st);
+    printf(", %llu without the stream\n", (unsigned long long)st.page_reads);
+
+    s = eeprom_stream_open(dev, 0, EEPROM_STREAM_READ);
+    ok &= eeprom_stream_write_next(s, model, 1) == -1;
+    eeprom_stream_close(s);
+    ok &= eeprom_stream_open(dev, 8192, EEPROM_STREAM_READ) == NULL;
+    test_close(dev);
+    printf("Every page transferred once --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+/*
+    This function reads size bytes every stride bytes from offset on,
+    with a short pause after every read for the caller's own work, and
+    compares them with model. Halfway through, bytes just ahead of the
+    reader are rewritten.
+
+    @return: 1 if every read matched
+*/
+int prefetch_test_scan(struct eeprom_dev *dev, char *model, uint32_t offset, int size, int stride) {
+    char got[256];
+    int ok = 1;
+
+    for (uint32_t pos = offset; pos + size <= 8192; pos += stride) {
+        if (pos >= 4096 && pos < 4096 + stride && pos + stride + size <= 8192) {
+            memset(model + pos + stride, '!', size);
+            eeprom_dev_write_bytes(dev, pos + stride, model + pos + stride, size);
+        }
+        eeprom_dev_read_bytes(dev, pos, got, size);
+        ok &= memcmp(got, model + pos, size) == 0;
+        usleep(500);
+    }
+    return ok;
+}
+
+/*
+    The read-ahead test scans a device sequentially and with a stride,
+    and checks that pages were served from read-ahead without reading
+    stale data, then checks that random reads do not trigger it.
+*/
+void prefetch_test() {
+    struct eeprom_config cfg = TEST_CONFIG("prefetch_test.img", .prefetch_depth = 8);
+    static char model[8192];
+    char got[64];
+    struct eeprom_stats st;
+    int i, ok;
+
+    printf("----Read-ahead test----\n");
+    struct eeprom_dev *dev = test_open(&cfg);
+    for (i = 0; i < sizeof(model); i++) {
+        model[i] = 'A' + i % 53;
+    }
+    eeprom_dev_write_bytes(dev, 0, model, sizeof(model));
+
+    eeprom_stats_reset();
+    ok = prefetch_test_scan(dev, model, 38, 97, 97);
+    eeprom_stats_snapshot(&st);
+    printf("Sequential: %llu pages read ahead, %llu hits, %llu wasted\n",
+           (unsigned long long)st.prefetch_pages, (unsigned long long)st.prefetch_hits,
+           (unsigned long long)st.prefetch_waste);
+    ok &= st.prefetch_hits > 128 && st.prefetch_waste <= cfg.prefetch_depth;
+
+    eeprom_stats_reset();
+    ok &= prefetch_test_scan(dev, model, 5, 16, 200);
+    eeprom_stats_snapshot(&st);
+    printf("Strided: %llu pages read ahead, %llu hits, %llu wasted\n",
+           (unsigned long long)st.prefetch_pages, (unsigned long long)st.prefetch_hits,
+           (unsigned long long)st.prefetch_waste);
+    ok &= st.prefetch_hits > 20 && st.prefetch_waste <= cfg.prefetch_depth;
+
+    eeprom_stats_reset();
+    srand(17);
+    for (i = 0; i < 100; i++) {
+        uint32_t offset = rand() % 8000;
+        eeprom_dev_read_bytes(dev, offset, got, sizeof(got));
+        ok &= memcmp(got, model + offset, sizeof(got)) == 0;
+    }
+    eeprom_stats_snapshot(&st);
+    printf("Random: %llu pages read ahead\n", (unsigned long long)st.prefetch_pages);
+    ok &= st.prefetch_pages == 0;
+
+    eeprom_dev_set_prefetch_depth(dev, 0);
+    ok &= eeprom_dev_get_prefetch_depth(dev) == 0;
+    test_close(dev);
+    printf("Sequential and strided reads are prefetched --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+struct snapshot_test_arg {
+    struct eeprom_dev *dev;
+    int running;            // Set while the snapshot is being taken
+    int writes;             // Writes completed while it was
+};
+
+void *snapshot_test_writer(void *vargp) {
+    struct snapshot_test_arg *arg = vargp;
+    char buf[40];
+    int i = 0, started = 0;
+
+    memset(buf, '#', sizeof(buf));
+    // Writes from before the snapshot started would be in it
+    while (!started && __atomic_load_n(&arg->running, __ATOMIC_ACQUIRE)) {
+        eeprom_lock(arg->dev, 0, arg->dev->geo.size, 0);
+        started = arg->dev->snapshot != NULL;
+        eeprom_unlock(arg->dev, 0, arg->dev->geo.size, 0);
+    }
+    while (__atomic_load_n(&arg->running, __ATOMIC_ACQUIRE)) {
+        // Pages all over the image, before and after the snapshot got there
+        eeprom_dev_write_bytes(arg->dev, (i++ * 1000 + 3) % 8000, buf, sizeof(buf));
+        if (__atomic_load_n(&arg->running, __ATOMIC_ACQUIRE)) {
+            arg->writes++;
+        }
+    }
+    return NULL;
+}
+
+/*
+    The snapshot test takes a snapshot of a slow device while another
+    thread keeps writing to it, and checks that the snapshot holds the
+    image as it was when it started and that the writer was not held up
+    for the whole copy. It then restores the snapshot, round-trips it
+    through a file, and programs a full image without reading anything.
+*/
+void snapshot_test() {
+    struct eeprom_config cfg = TEST_CONFIG("snapshot_test.img", .ll.timing = { .byte_ns = 2000 });
+    static char model[8192], snap[8192], got[8192];
+    struct snapshot_test_arg arg;
+    struct eeprom_stats st;
+    pthread_t tid;
+    int i, ok;
+
+    printf("----Snapshot test----\n");
+    struct eeprom_dev *dev = test_open(&cfg);
+    for (i = 0; i < sizeof(model); i++) {
+        model[i] = 'a' + i % 26;
+    }
+    eeprom_dev_program(dev, 0, model, sizeof(model));
+
+    arg = (struct snapshot_test_arg){ dev, 1, 0 };
+    pthread_create(&tid, NULL, snapshot_test_writer, &arg);
+    ok = eeprom_dev_snapshot(dev, snap, sizeof(snap)) == 0;
+    __atomic_store_n(&arg.running, 0, __ATOMIC_RELEASE);
+    pthread_join(tid, NULL);
+    ok &= memcmp(snap, model, sizeof(model)) == 0;
+    printf("%d writes completed while the snapshot was taken\n", arg.writes);
+    ok &= arg.writes > 0;
+    printf("Snapshot is consistent, writers keep going --->%s\n", ok ? "PASS" : "FAIL");
+
+    eeprom_dev_set_elide_mode(dev, EEPROM_ELIDE_READ);
+    eeprom_stats_reset();
+    ok = eeprom_dev_restore(dev, snap, sizeof(snap)) == 0;
+    eeprom_dev_read_bytes(dev, 0, got, sizeof(got));
+    ok &= memcmp(got, model, sizeof(model)) == 0;
+    eeprom_stats_snapshot(&st);
+    printf("Restore: %llu page writes, %llu elided\n",
+           (unsigned long long)st.page_writes, (unsigned long long)st.elided_writes);
+    ok &= st.page_writes < 256 && st.page_writes + st.elided_writes == 256;
+
+    eeprom_dev_write_bytes(dev, 100, "changed", 7);
+    ok &= eeprom_dev_snapshot_file(dev, "snapshot_test.bin") == 0;
+    eeprom_dev_restore(dev, snap, sizeof(snap));
+    ok &= eeprom_dev_restore_file(dev, "snapshot_test.bin") == 0;
+    eeprom_dev_read_bytes(dev, 100, got, 7);
+    ok &= memcmp(got, "changed", 7) == 0;
+    remove("snapshot_test.bin");
+    ok &= eeprom_dev_restore(dev, snap, 100) == -2;
+    printf("Restore from a buffer and a file --->%s\n", ok ? "PASS" : "FAIL");
+
+    memset(model, 'P', sizeof(model));
+    eeprom_stats_reset();
+    ok = eeprom_dev_program(dev, 0, model, sizeof(model)) == 0;
+    eeprom_stats_snapshot(&st);
+    ok &= st.page_reads == 0 && st.page_writes == 256;
+    eeprom_dev_read_bytes(dev, 0, got, sizeof(got));
+    ok &= memcmp(got, model, sizeof(model)) == 0;
+    ok &= eeprom_dev_program(dev, 16, model, 32) == -1;
+    ok &= eeprom_dev_program(dev, 0, model, 48) == -2;
+    test_close(dev);
+    printf("Bulk program writes every page without reading --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+/*
+    This function checks that every byte of a range reads back erased.
+*/
+int erase_test_blank(const char *buf, int len) {
+    for (int i = 0; i < len; i++) {
+        if ((unsigned char)buf[i] != LL_ERASED_BYTE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+    The erase test erases a range of a device with a write-back cache
+    and read-ahead, and checks the range reads back erased, dirty pages
+    in it are not flushed over the erase, and its neighbours are left
+    alone. It then resets a wear leveled device and checks the erase
+    survives reopening it.
+*/
+void erase_test() {
+    struct eeprom_config cfg = TEST_CONFIG("erase_test.img", .cache_mode = EEPROM_CACHE_WRITEBACK,
+                                           .prefetch_depth = 16);
+    static char model[8192], got[8192];
+    struct eeprom_stats st;
+    int i, ok;
+
+    printf("----Erase test----\n");
+    struct eeprom_dev *dev = test_open(&cfg);
+    memset(model, 'x', sizeof(model));
+    eeprom_dev_program(dev, 0, model, sizeof(model));
+    // Load read-ahead windows over the range, and dirty a page in it
+    for (i = 0; i < 1024; i += 64) {
+        eeprom_dev_read_bytes(dev, i, got, 64);
+    }
+    eeprom_dev_write_bytes(dev, 400, "dirty", 5);
+
+    eeprom_stats_reset();
+    ok = eeprom_dev_erase(dev, 10 * 32, 20 * 32) == 0;
+    eeprom_stats_snapshot(&st);
+    ok &= st.page_erases == 20 && st.page_writes == 0;
+    eeprom_dev_flush(dev);
+    eeprom_dev_set_cache_mode(dev, EEPROM_CACHE_OFF);
+    eeprom_dev_read_bytes(dev, 0, got, 1024);
+    ok &= erase_test_blank(got + 10 * 32, 20 * 32);
+    ok &= memcmp(got, model, 10 * 32) == 0 && memcmp(got + 30 * 32, model, 1024 - 30 * 32) == 0;
+    ok &= eeprom_dev_erase(dev, 16, 32) == -1;
+    ok &= eeprom_dev_erase(dev, 0, 48) == -2;
+    test_close(dev);
+    printf("Erasing a range leaves cache, read-ahead and neighbours right --->%s\n", ok ? "PASS" : "FAIL");
+
+    cfg.cache_mode = EEPROM_CACHE_OFF;
+    cfg.prefetch_depth = 0;
+    cfg.wear = (struct eeprom_wear_config){ .spares = 8, .threshold = 4 };
+    dev = test_open(&cfg);
+    for (i = 0; i < 100; i++) {
+        eeprom_dev_write_bytes(dev, 0, model, 32);
+    }
+    eeprom_stats_reset();
+    ok = eeprom_dev_reset(dev) == 0;
+    eeprom_stats_snapshot(&st);
+    printf("Reset: %llu pages erased, %llu page writes\n",
+           (unsigned long long)st.page_erases, (unsigned long long)st.page_writes);
+    ok &= st.page_erases == 256 && st.page_writes == 0;
+    eeprom_close(dev);
+    dev = eeprom_open(&cfg);
+    eeprom_dev_read_bytes(dev, 0, got, sizeof(got));
+    ok &= erase_test_blank(got, sizeof(got));
+    test_close(dev);
+    printf("Reset of a wear leveled device survives reopening --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+/*
+    This function flips one bit of a file behind the device's back.
+*/
+void crc_test_rot(const char *path, long pos) {
+    FILE *f = fopen(path, "r+b");
+    fseek(f, pos, SEEK_SET);
+    int c = fgetc(f);
+    fseek(f, pos, SEEK_SET);
+    fputc(c ^ 0x10, f);
+    fclose(f);
+}
+
+/*
+    The checksum test writes pages one at a time and checks the table
+    writes stay well below one per page. It then flips bits in the image
+    file and checks that reads and eeprom_dev_verify catch exactly those
+    pages. Last it cuts the power half way through a two page write and
+    opens the image it left behind, whose table on the image lags behind
+    the pages, and checks that no page that was written fails its check.
+*/
+void crc_test() {
+    struct eeprom_config cfg = TEST_CONFIG("crc_test.img", .crc = 1);
+    char page[32], got[64];
+    uint32_t bad[8];
+    struct eeprom_stats st;
+    int i, ok;
+
+    printf("----Checksum test----\n");
+    struct eeprom_dev *dev = test_open(&cfg);
+    eeprom_stats_reset();
+    for (i = 0; i < 64; i++) {
+        memset(page, 'a' + i % 26, sizeof(page));
+        eeprom_dev_write_bytes(dev, i * 32, page, 32);
+    }
+    eeprom_dev_sync(dev);
+    eeprom_stats_snapshot(&st);
+    printf("64 page writes cost %llu page writes\n", (unsigned long long)st.page_writes);
+    ok = st.page_writes <= 64 + 64 / 8;
+    ok &= eeprom_dev_verify(dev, bad, 8) == 0;
+    printf("Checksums are batched with the writes --->%s\n", ok ? "PASS" : "FAIL");
+
+    crc_test_rot(cfg.ll.path, 10 * 32 + 3);
+    crc_test_rot(cfg.ll.path, 200 * 32 + 31);
+    eeprom_stats_reset();
+    ok = eeprom_dev_read_bytes(dev, 10 * 32, got, 32) == -5;
+    ok &= eeprom_dev_read_bytes(dev, 11 * 32, got, 32) == 0;
+    ok &= eeprom_dev_verify(dev, bad, 8) == 2 && bad[0] == 10 && bad[1] == 200;
+    struct eeprom_iovec rv[2] = { { 11 * 32, 8, got }, { 10 * 32, 8, got + 8 } };
+    ok &= eeprom_dev_readv(dev, rv, 2) == -5;
+    eeprom_stats_snapshot(&st);
+    ok &= st.crc_errors == 4;
+    memset(page, 'z', sizeof(page));
+    eeprom_dev_write_bytes(dev, 10 * 32, page, 32);
+    eeprom_dev_write_bytes(dev, 200 * 32, page, 32);
+    ok &= eeprom_dev_read_bytes(dev, 10 * 32, got, 32) == 0;
+    ok &= eeprom_dev_verify(dev, bad, 8) == 0;
+    printf("Bit rot is caught by reads and verify --->%s\n", ok ? "PASS" : "FAIL");
+
+    // Power is lost after the first of two data pages. It stays off, so
+    // the image is looked at through a second device before the first
+    // one is closed. The entries of pages 10, 200 and 50 never reached
+    // the image.
+    memset(got, 'T', sizeof(got));
+    ll_dev_fail_after(dev->ll, 1);
+    ok = eeprom_dev_write_bytes(dev, 50 * 32, got, 64) == -5;
+    struct eeprom_dev *after = eeprom_open(&cfg);
+    ok &= after->crc->stale == 3;
+    ok &= eeprom_dev_verify(after, bad, 8) == 0;
+    ok &= eeprom_dev_read_bytes(after, 50 * 32, got, 32) == 0 && got[0] == 'T';
+    ok &= eeprom_dev_read_bytes(after, 51 * 32, got, 32) == 0 && got[0] == 'z';
+    ok &= eeprom_dev_read_bytes(after, 200 * 32, got, 32) == 0 && got[0] == 'z';
+    eeprom_close(after);
+    eeprom_close(dev);
+    printf("Pages written before a power loss pass their check --->%s\n", ok ? "PASS" : "FAIL");
+
+    // The table is clean after a close, so rot is caught again
+    dev = eeprom_open(&cfg);
+    ok = dev->crc->stale == 0;
+    crc_test_rot(cfg.ll.path, 30 * 32);
+    ok &= eeprom_dev_verify(dev, bad, 8) == 1 && bad[0] == 30;
+    test_close(dev);
+    printf("A clean close leaves nothing to rebuild --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+struct view_test_arg {
+    struct eeprom_dev *dev;
+    int written;
+};
+
+void *view_test_writer(void *vargp) {
+    struct view_test_arg *arg = vargp;
+    eeprom_dev_write_bytes(arg->dev, 40, "written", 7);
+    __atomic_store_n(&arg->written, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+    The view test takes views of a mapped image, of a write-back cache
+    and of an image that is not resident. It checks the first two point
+    into memory without reading a page, that a writer to the range waits
+    for the view to be released, and that the last one is a copy.
+*/
+void view_test() {
+    struct eeprom_config cfg = TEST_CONFIG("view_test.img", .lock_mode = EEPROM_LOCK_STRIPED);
+    static char model[8192];
+    struct view_test_arg arg;
+    struct eeprom_view v;
+    struct eeprom_stats st;
+    pthread_t tid;
+    int i, ok;
+
+    printf("----View test----\n");
+    cfg.ll.mode = LL_MODE_MMAP;
+    struct eeprom_dev *dev = test_open(&cfg);
+    for (i = 0; i < sizeof(model); i++) {
+        model[i] = 'a' + i % 26;
+    }
+    eeprom_dev_program(dev, 0, model, sizeof(model));
+
+    eeprom_stats_reset();
+    ok = eeprom_dev_view_acquire(dev, 20, 100, &v) == 0;
+    ok &= v.data == dev->ll->map + 20 && memcmp(v.data, model + 20, 100) == 0;
+    arg = (struct view_test_arg){ dev, 0 };
+    pthread_create(&tid, NULL, view_test_writer, &arg);
+    usleep(20000);
+    ok &= __atomic_load_n(&arg.written, __ATOMIC_ACQUIRE) == 0;
+    ok &= memcmp(v.data + 20, model + 40, 7) == 0;
+    eeprom_view_release(&v);
+    pthread_join(tid, NULL);
+    memcpy(model + 40, "written", 7);
+    eeprom_stats_snapshot(&st);
+    ok &= st.view_copies == 0;
+    printf("A view of the mapped image holds writers off --->%s\n", ok ? "PASS" : "FAIL");
+
+    eeprom_dev_set_cache_mode(dev, EEPROM_CACHE_WRITEBACK);
+    eeprom_dev_write_bytes(dev, 300, "dirty", 5);
+    memcpy(model + 300, "dirty", 5);
+    ok = eeprom_dev_view_acquire(dev, 290, 64, &v) == 0;
+    ok &= v.data == dev->cache.image + 290 && memcmp(v.data, model + 290, 64) == 0;
+    eeprom_view_release(&v);
+    eeprom_stats_reset();
+    ok &= eeprom_dev_view_acquire(dev, 290, 64, &v) == 0;
+    eeprom_view_release(&v);
+    eeprom_stats_snapshot(&st);
+    ok &= st.page_reads == 0 && st.view_copies == 0;
+    printf("A view of the cache sees dirty pages --->%s\n", ok ? "PASS" : "FAIL");
+    eeprom_close(dev);
+
+    cfg.ll.mode = LL_MODE_PREAD;
+    dev = eeprom_open(&cfg);
+    eeprom_stats_reset();
+    ok = eeprom_dev_view_acquire(dev, 5, 1000, &v) == 0;
+    ok &= v.copy != NULL && memcmp(v.data, model + 5, 1000) == 0;
+    eeprom_view_release(&v);
+    ok &= eeprom_dev_view_acquire(dev, 8000, 500, &v) == -3;
+    eeprom_stats_snapshot(&st);
+    ok &= st.view_copies == 1;
+    test_close(dev);
+    printf("A view of an image that is not resident is a copy --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+// Two records that share a page and cross stripe boundaries
+#define LOCK_TEST_A 100         // Bytes 100-199, stripes 0 and 1
+#define LOCK_TEST_B 200         // Bytes 200-499, stripes 1 to 3
+#define LOCK_TEST_WRITES 2000
+
+struct lock_test_arg {
+    struct eeprom_dev *dev;
+    int id;
+    int *writers;               // Writers still running
+    int torn;                   // Reads that saw half of a write
+};
+
+/*
+    This function returns 1 if the len bytes at p are all the same.
+*/
+int lock_test_uniform(const char *p, int len) {
+    for (int i = 1; i < len; i++) {
+        if (p[i] != p[0]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+    Lock test writer 0 rewrites record A and writer 1 record B,
+    LOCK_TEST_WRITES times each, every time with the next letter.
+*/
+void *lock_test_writer(void *vargp) {
+    struct lock_test_arg *arg = vargp;
+    uint32_t offset = arg->id == 0 ? LOCK_TEST_A : LOCK_TEST_B;
+    int size = arg->id == 0 ? LOCK_TEST_B - LOCK_TEST_A : 300;
+    char rec[300];
+    int j;
+    for (j = 0; j < LOCK_TEST_WRITES; j++) {
+        memset(rec, 'a' + j % 26, size);
+        eeprom_dev_write_bytes(arg->dev, offset, rec, size);
+    }
+    __atomic_fetch_sub(arg->writers, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+    Lock test reader 2 reads record A, reader 3 both records with one
+    read, until the writers are done. Every record must hold one letter.
+*/
+void *lock_test_reader(void *vargp) {
+    struct lock_test_arg *arg = vargp;
+    char got[400];
+    while (__atomic_load_n(arg->writers, __ATOMIC_ACQUIRE) > 0) {
+        if (arg->id == 2) {
+            eeprom_dev_read_bytes(arg->dev, LOCK_TEST_A, got, 100);
+            arg->torn += !lock_test_uniform(got, 100);
+        } else {
+            eeprom_dev_read_bytes(arg->dev, LOCK_TEST_A, got, 400);
+            arg->torn += !lock_test_uniform(got, 100) || !lock_test_uniform(got + 100, 300);
+        }
+    }
+    return NULL;
+}
+
+/*
+    The lock test runs two writers and two readers on one device under
+    EEPROM_LOCK_GLOBAL, EEPROM_LOCK_RW and EEPROM_LOCK_STRIPED. The
+    records written share a page and span several stripes, and no read
+    may see half of a write, nor may one writer undo the other's bytes
+    of the shared page. How reads scale with the thread count in each
+    mode is measured by eeprombench -l.
+*/
+void lock_test() {
+    const char *names[] = { "global", "rw", "striped" };
+    enum eeprom_lock_mode modes[] = { EEPROM_LOCK_GLOBAL, EEPROM_LOCK_RW, EEPROM_LOCK_STRIPED };
+    struct eeprom_config cfg = TEST_CONFIG("lock_test.img");
+    struct lock_test_arg arg[4];
+    pthread_t tid[4];
+    char got[400];
+    int m, i, writers, ok;
+
+    printf("----Lock test----\n");
+    for (m = 0; m < 3; m++) {
+        cfg.lock_mode = modes[m];
+        struct eeprom_dev *dev = test_open(&cfg);
+        writers = 2;
+        for (i = 0; i < 4; i++) {
+            arg[i] = (struct lock_test_arg){ dev, i, &writers, 0 };
+            pthread_create(&tid[i], NULL, i < 2 ? lock_test_writer : lock_test_reader, &arg[i]);
+        }
+        for (i = 0; i < 4; i++) {
+            pthread_join(tid[i], NULL);
+        }
+        eeprom_dev_read_bytes(dev, LOCK_TEST_A, got, 400);
+        ok = arg[2].torn == 0 && arg[3].torn == 0;
+        ok &= lock_test_uniform(got, 100) && lock_test_uniform(got + 100, 300);
+        ok &= got[0] == 'a' + (LOCK_TEST_WRITES - 1) % 26 && got[100] == got[0];
+        test_close(dev);
+        printf("Lock mode:%s, writes are never seen half done --->%s\n", names[m], ok ? "PASS" : "FAIL");
+    }
+    printf("\n");
+}
+
+struct seq_test_arg {
+    struct eeprom_dev *dev;
+    int running;
+    int torn;
+};
+
+/*
+    The seq test writer fills two 32 byte records with one letter at a
+    time, the second one crossing a page boundary, until the readers are
+    done.
+*/
+void *seq_test_writer(void *vargp) {
+    struct seq_test_arg *arg = vargp;
+    char rec[32];
+    int j;
+    for (j = 0; __atomic_load_n(&arg->running, __ATOMIC_ACQUIRE); j++) {
+        memset(rec, 'a' + j % 26, sizeof(rec));
+        eeprom_dev_write_bytes(arg->dev, 0, rec, 32);
+        eeprom_dev_write_bytes(arg->dev, 100, rec, 32);
+    }
+    return NULL;
+}
+
+/*
+    Each seq test reader reads the records 20000 times and counts the
+    reads that saw more than one letter.
+*/
+void *seq_test_reader(void *vargp) {
+    struct seq_test_arg *arg = vargp;
+    char rec[32];
+    int i, j;
+    for (j = 0; j < 20000; j++) {
+        eeprom_dev_read_bytes(arg->dev, j % 2 ? 100 : 0, rec, 32);
+        for (i = 1; i < 32; i++) {
+            if (rec[i] != rec[0]) {
+                __atomic_fetch_add(&arg->torn, 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+    The seq test checks EEPROM_LOCK_SEQ. Reads of cached records must be
+    served without a lock, and readers racing with a writer must never
+    see half of a record. With the cache off every read locks.
+*/
+void seq_test() {
+    struct eeprom_config cfg = TEST_CONFIG("seq_test.img", .lock_mode = EEPROM_LOCK_SEQ);
+    struct seq_test_arg arg;
+    struct eeprom_stats st;
+    pthread_t tid[4];
+    char rec[32];
+    int i, ok;
+
+    printf("----Seq test----\n");
+    cfg.ll.mode = LL_MODE_MMAP;
+    struct eeprom_dev *dev = test_open(&cfg);
+    memset(rec, 'a', sizeof(rec));
+    eeprom_dev_write_bytes(dev, 0, rec, 32);
+    eeprom_dev_write_bytes(dev, 100, rec, 32);
+
+    eeprom_stats_reset();
+    eeprom_dev_read_bytes(dev, 100, rec, 32);
+    eeprom_stats_snapshot(&st);
+    ok = st.seq_reads == 0 && rec[31] == 'a';
+    printf("Reads lock while the cache is off --->%s\n", ok ? "PASS" : "FAIL");
+
+    eeprom_dev_set_cache_mode(dev, EEPROM_CACHE_WRITETHROUGH);
+    eeprom_dev_read_bytes(dev, 0, rec, 32);
+    eeprom_dev_read_bytes(dev, 100, rec, 32);
+    eeprom_stats_reset();
+    arg = (struct seq_test_arg){ dev, 1, 0 };
+    pthread_create(&tid[0], NULL, seq_test_writer, &arg);
+    for (i = 1; i < 4; i++) {
+        pthread_create(&tid[i], NULL, seq_test_reader, &arg);
+    }
+    for (i = 1; i < 4; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    __atomic_store_n(&arg.running, 0, __ATOMIC_RELEASE);
+    pthread_join(tid[0], NULL);
+    eeprom_stats_snapshot(&st);
+    ok = arg.torn == 0 && st.seq_reads > 0;
+    printf("Lock-free reads never see a torn record --->%s\n", ok ? "PASS" : "FAIL");
+
+    test_close(dev);
+    printf("\n");
+}
+
+/*
+    The key-value test keeps a store in the first 2 KB of a device. It
+    checks puts, deletes and that a get reads one page, that compaction
+    keeps the latest values across a reopen, that a background compaction
+    that fails is retried by the next put, and that a record torn by a
+    power loss is dropped without losing the others.
+*/
+void kv_test() {
+    struct eeprom_config cfg = TEST_CONFIG("kv_test.img");
+    struct eeprom_stats st;
+    struct eeprom_kv *kv;
+    char val[32], got[32];
+    uint32_t gen;
+    int j, ok, failed;
+
+    printf("----Key-value test----\n");
+    struct eeprom_dev *dev = test_open(&cfg);
+    kv = eeprom_kv_open(dev, 0, 2048);
+    ok = kv != NULL;
+    ok &= eeprom_kv_put(kv, "name", "eeprom", 6) == 0;
+    ok &= eeprom_kv_put(kv, "id", "7", 1) == 0;
+    ok &= eeprom_kv_put(kv, "id", "8", 1) == 0;
+    ok &= eeprom_kv_delete(kv, "name") == 0;
+    ok &= eeprom_kv_get(kv, "name", got, sizeof(got)) == -4;
+    ok &= eeprom_kv_delete(kv, "name") == -4;
+    eeprom_stats_reset();
+    ok &= eeprom_kv_get(kv, "id", got, sizeof(got)) == 1 && got[0] == '8';
+    eeprom_stats_snapshot(&st);
+    ok &= st.page_reads == 1;
+    printf("Put, delete and a get of one page --->%s\n", ok ? "PASS" : "FAIL");
+
+    // Every update takes two pages, so the log fills many times
+    for (j = 0; j < 200; j++) {
+        snprintf(val, sizeof(val), "count %014d", j);
+        ok &= eeprom_kv_put(kv, "counter", val, 20) == 0;
+    }
+    // A compaction may still be running on the helper thread
+    pthread_mutex_lock(&kv->lock);
+    ok &= kv->gen > 1;
+    pthread_mutex_unlock(&kv->lock);
+    eeprom_kv_close(kv);
+    eeprom_close(dev);
+    dev = eeprom_open(&cfg);
+    kv = eeprom_kv_open(dev, 0, 2048);
+    ok &= kv->count == 2;
+    ok &= eeprom_kv_get(kv, "counter", got, sizeof(got)) == 20 && memcmp(got, val, 20) == 0;
+    ok &= eeprom_kv_get(kv, "id", got, sizeof(got)) == 1 && got[0] == '8';
+    ok &= eeprom_kv_get(kv, "name", got, sizeof(got)) == -4;
+    printf("Compaction keeps the latest values across a reopen --->%s\n", ok ? "PASS" : "FAIL");
+
+    // Power is lost after the two pages of every record, so the first
+    // compaction started in the background fails, and the next put
+    // compacts again
+    ok = 1;
+    failed = 0;
+    for (j = 0; j < 200 && !failed; j++) {
+        ll_dev_fail_after(dev->ll, 2);
+        ok &= eeprom_kv_put(kv, "counter", val, 20) == 0;
+        pthread_mutex_lock(&kv->lock);
+        while (kv->compacting) {
+            pthread_cond_wait(&kv->compacted, &kv->lock);
+        }
+        failed = kv->compact_failed;
+        gen = kv->gen;
+        pthread_mutex_unlock(&kv->lock);
+    }
+    ll_dev_fail_after(dev->ll, -1);
+    ok &= failed && eeprom_kv_put(kv, "counter", val, 20) == 0;
+    pthread_mutex_lock(&kv->lock);
+    ok &= !kv->compact_failed && kv->gen == gen + 1;
+    pthread_mutex_unlock(&kv->lock);
+    ok &= eeprom_kv_get(kv, "counter", got, sizeof(got)) == 20 && memcmp(got, val, 20) == 0;
+    printf("A failed background compaction is retried --->%s\n", ok ? "PASS" : "FAIL");
+
+    // Power is lost after the first page of a two page record
+    ll_dev_fail_after(dev->ll, 1);
+    ok = eeprom_kv_put(kv, "torn", "0123456789abcdefghij", 20) == -5;
+    ll_dev_fail_after(dev->ll, -1);
+    eeprom_kv_close(kv);
+    eeprom_close(dev);
+    dev = eeprom_open(&cfg);
+    kv = eeprom_kv_open(dev, 0, 2048);
+    ok &= eeprom_kv_get(kv, "torn", got, sizeof(got)) == -4;
+    ok &= eeprom_kv_get(kv, "counter", got, sizeof(got)) == 20 && memcmp(got, val, 20) == 0;
+    ok &= eeprom_kv_put(kv, "id", "9", 1) == 0;
+    eeprom_kv_close(kv);
+    kv = eeprom_kv_open(dev, 0, 2048);
+    ok &= eeprom_kv_get(kv, "id", got, sizeof(got)) == 1 && got[0] == '9';
+    eeprom_kv_close(kv);
+    test_close(dev);
+    printf("A torn record is dropped --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+/*
+    The server test serves a device on a socket to two clients. It checks
+    that one client reads what the other wrote, that 64 pipelined
+    requests are served in order in fewer rounds and device calls than
+    requests, that an invalid request or a read that fails on the device
+    fails without dropping its client, and that a client of a stopped
+    server stays broken.
+*/
+void server_test() {
+    struct eeprom_config cfg = TEST_CONFIG("server_test.img", .crc = 1);
+    struct eeprom_stats st;
+    char got[65], slots[32][8], expect[8];
+    int i, ok;
+
+    printf("----Server test----\n");
+    struct eeprom_dev *dev = test_open(&cfg);
+    struct eeprom_server *srv = eeprom_server_start(dev, "server_test.sock");
+    struct eeprom_client *a = eeprom_client_open("server_test.sock");
+    struct eeprom_client *b = eeprom_client_open("server_test.sock");
+    ok = srv != NULL && a != NULL && b != NULL;
+    ok &= eeprom_client_write(a, 100, 12, "hello server") == 0;
+    ok &= eeprom_client_read(b, 100, 12, got) == 0 && strcmp(got, "hello server") == 0;
+    printf("A client reads what another one wrote --->%s\n", ok ? "PASS" : "FAIL");
+
+    // Each read follows the write of its slot
+    eeprom_stats_reset();
+    for (i = 0; i < 32; i++) {
+        snprintf(expect, sizeof(expect), "slot%03d", i);
+        ok &= eeprom_client_send_write(a, 256 + i * 8, 8, expect) == 0;
+    }
+    for (i = 0; i < 32; i++) {
+        ok &= eeprom_client_send_read(a, 256 + i * 8, 8, slots[i]) == 0;
+    }
+    for (i = 0; i < 64; i++) {
+        ok &= eeprom_client_complete(a) == 0;
+    }
+    for (i = 0; i < 32; i++) {
+        snprintf(expect, sizeof(expect), "slot%03d", i);
+        ok &= memcmp(slots[i], expect, 8) == 0;
+    }
+    ok &= eeprom_client_complete(a) == -4;
+    eeprom_stats_snapshot(&st);
+    ok &= st.server_requests == 64 && st.server_batches < 64 && st.vector_calls < 64;
+    printf("Pipelined requests are batched --->%s\n", ok ? "PASS" : "FAIL");
+
+    ok = eeprom_client_read_bytes(b, 9000, got, 4) == eeprom_dev_param_check(dev, 9000, 4);
+    ok &= eeprom_client_write(b, 8190, 4, "abcd") == -3;
+    ok &= eeprom_client_read(b, 256, 7, got) == 0 && strcmp(got, "slot000") == 0;
+    printf("Invalid requests fail alone --->%s\n", ok ? "PASS" : "FAIL");
+
+    // Page 40 fails its checksum
+    crc_test_rot(cfg.ll.path, 40 * 32 + 5);
+    memset(slots[0], '?', 8);
+    memset(slots[1], '?', 8);
+    ok = eeprom_client_send_read(b, 40 * 32, 8, slots[0]) == 0;
+    ok &= eeprom_client_send_read(b, 40 * 32 + 16, 8, slots[1]) == 0;
+    ok &= eeprom_client_complete(b) == -5 && eeprom_client_complete(b) == -5;
+    ok &= memcmp(slots[0], "????????", 8) == 0 && memcmp(slots[1], "????????", 8) == 0;
+    ok &= eeprom_client_read(b, 256, 7, got) == 0 && strcmp(got, "slot000") == 0;
+    printf("A failed read returns no data --->%s\n", ok ? "PASS" : "FAIL");
+
+    eeprom_server_stop(srv);
+    ok = eeprom_client_read(a, 100, 5, got) == -5;
+    ok &= eeprom_client_send_read(a, 100, 5, got) == -5;
+    eeprom_client_close(a);
+    eeprom_client_close(b);
+    test_close(dev);
+    printf("A stopped server fails the requests --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+int async_done;
+
+void async_test_callback(struct eeprom_aio *aio) {
+    __atomic_fetch_add(&async_done, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    The async test queues writes and reads that overlap each other and
+    checks that every read sees the writes submitted before it, whatever
+    the worker merged or reordered.
+*/
+void async_test() {
+    struct eeprom_dev *dev = eeprom_default();
+    char expect[65], before[64], after[64];
+    char x[20], y[10], z[16];
+    int i, ok = 1;
+
+    printf("----Async queue test----\n");
+    eeprom_read(2000, 64, expect);
+    memset(x, 'X', sizeof(x));
+    memset(y, 'Y', sizeof(y));
+    memset(z, 'Z', sizeof(z));
+    struct eeprom_aio aio[6] = {
+        { EEPROM_AIO_WRITE, 2000, 20, x, async_test_callback },
+        { EEPROM_AIO_WRITE, 2040, 16, z, async_test_callback },   // Merged with the first
+        { EEPROM_AIO_READ, 2000, 64, before, async_test_callback },
+        { EEPROM_AIO_WRITE, 2010, 10, y, async_test_callback },   // Must not pass the read
+        { EEPROM_AIO_READ, 2000, 64, after },                     // Polled instead
+        { EEPROM_AIO_READ, 8190, 10, after },                     // Out of bound
+    };
+    async_done = 0;
+    for (i = 0; i < 5; i++) {
+        ok &= eeprom_aio_submit(dev, &aio[i]) == 0;
+    }
+    ok &= eeprom_aio_submit(dev, &aio[5]) == -3;
+    while (eeprom_aio_poll(&aio[4]) == EEPROM_AIO_PENDING) {
+        // The caller is free to do something else here
+    }
+    for (i = 0; i < 4; i++) {
+        ok &= eeprom_aio_wait(dev, &aio[i]) == 0;
+    }
+    ok &= aio[4].result == 0;
+
+    memcpy(expect, x, 20);
+    memcpy(expect+40, z, 16);
+    ok &= memcmp(before, expect, 64) == 0;
+    memcpy(expect+10, y, 10);
+    ok &= memcmp(after, expect, 64) == 0;
+    // Callbacks run after the results are visible, give them a moment
+    for (i = 0; i < 1000 && __atomic_load_n(&async_done, __ATOMIC_RELAXED) != 4; i++) {
+        usleep(1000);
+    }
+    ok &= async_done == 4;
+    printf("Async reads see earlier writes --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+
+/*
+    This function returns the time elapsed since start in microseconds.
+*/
+long elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+    The backend test opens a short image file with both backends and
+    checks that the bytes it is extended with read back as
+    LL_ERASED_BYTE either way, and that a path too long to keep is
+    rejected instead of opening another file.
+*/
+void backend_test() {
+    struct ll_config cfg = { .path = "backend_test.img", .size = 8192, .page_size = 32 };
+    char page[32], path[300];
+    int m, i, ok = 1;
+
+    printf("----Backend test----\n");
+    for (m = 0; m < 2; m++) {
+        FILE *f = fopen(cfg.path, "wb");
+        fputs("short image", f);
+        fclose(f);
+        cfg.mode = m == 0 ? LL_MODE_PREAD : LL_MODE_MMAP;
+        struct ll_dev *ll = ll_dev_open(&cfg);
+        ok &= ll != NULL && ll_dev_read_pages(ll, 0, 1, page) == 0 && memcmp(page, "short image", 11) == 0;
+        for (i = 11; i < 32; i++) {
+            ok &= (unsigned char)page[i] == LL_ERASED_BYTE;
+        }
+        ok &= ll_dev_read_pages(ll, 8192 - 32, 1, page) == 0 && (unsigned char)page[31] == LL_ERASED_BYTE;
+        ll_dev_close(ll);
+        remove(cfg.path);
+    }
+    printf("A short image reads erased bytes in both modes --->%s\n", ok ? "PASS" : "FAIL");
+
+    memset(path, 'p', sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
+    cfg.path = path;
+    ok = ll_dev_open(&cfg) == NULL;
+    printf("A path that does not fit is rejected --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+/*
+    The bus test opens a device on a simulated I2C bus and checks that a
+    read of five pages is one sequential read, that a write crossing a
+    page is two write bursts without reading either page, and that a
+    second write burst polls while the first write cycle runs. It then
+    counts the same write on SPI, where every burst needs a WREN.
+*/
+void bus_test() {
+    struct eeprom_config cfg = TEST_CONFIG("bus_test.img", .ll.bus = LL_BUS_I2C);
+    struct ll_timing slow = { .byte_ns = 1000, .page_write_ns = 20000000, .busy = 1 };
+    static char model[8192];
+    struct eeprom_stats st;
+    char got[128];
+    int i, ok;
+
+    printf("----Bus test----\n");
+    struct eeprom_dev *dev = test_open(&cfg);
+    for (i = 0; i < sizeof(model); i++) {
+        model[i] = 'a' + i % 26;
+    }
+    eeprom_dev_program(dev, 0, model, sizeof(model));
+
+    eeprom_stats_reset();
+    ok = eeprom_dev_read_bytes(dev, 20, got, 100) == 0 && memcmp(got, model + 20, 100) == 0;
+    eeprom_stats_snapshot(&st);
+    // Device address, two address bytes, device address again
+    ok &= st.bus_transactions == 1 && st.bus_bytes == 100 + 4;
+    printf("A span is one sequential read --->%s\n", ok ? "PASS" : "FAIL");
+
+    eeprom_stats_reset();
+    ok = eeprom_dev_write_bytes(dev, 60, "0123456789", 10) == 0;
+    eeprom_stats_snapshot(&st);
+    ok &= st.bus_transactions == 2 && st.bus_bytes == 10 + 2 * 3 && st.page_reads == 0 && st.rmw == 0;
+    memcpy(model + 60, "0123456789", 10);
+    ok &= eeprom_dev_read_bytes(dev, 0, got, 128) == 0 && memcmp(got, model, 128) == 0;
+    printf("A partial write is one burst per page --->%s\n", ok ? "PASS" : "FAIL");
+
+    ll_dev_set_timing(dev->ll, &slow);
+    eeprom_stats_reset();
+    ok = eeprom_dev_write_bytes(dev, 256, model, 64) == 0;
+    eeprom_stats_snapshot(&st);
+    ok &= st.bus_polls > 0 && st.bus_transactions == 2 + st.bus_polls;
+    ll_dev_set_timing(dev->ll, NULL);
+    printf("Write bursts poll for the write cycle --->%s\n", ok ? "PASS" : "FAIL");
+    eeprom_close(dev);
+
+    cfg.ll.bus = LL_BUS_SPI;
+    dev = eeprom_open(&cfg);
+    eeprom_stats_reset();
+    ok = eeprom_dev_write_bytes(dev, 60, "9876543210", 10) == 0;
+    eeprom_stats_snapshot(&st);
+    // WREN, then WRITE and two address bytes, per page
+    ok &= st.bus_transactions == 4 && st.bus_bytes == 10 + 2 * 4;
+    test_close(dev);
+    printf("SPI writes enable every burst --->%s\n\n", ok ? "PASS" : "FAIL");
+}
+
+/*
+    The timing test opens a device with a slow bus and a 2 ms write
+    cycle, and checks that a write and the read right after it take at
+    least as long as the model says, once with the writer waiting out
+    the write cycle and once with the reader polling for it.
+*/
+void timing_test() {
+    struct eeprom_config cfg = TEST_CONFIG("timing_test.img",
+                                           .ll.timing = { .byte_ns = 1000, .page_write_ns = 2000000 });
+    char buf[65];
+    struct timespec t;
+    long write_us[2], read_us[2];
+    int busy;
+
+    printf("----Timing model test----\n");
+    for (busy = 0; busy < 2; busy++) {
+        memset(buf, 'T', 64);
+        buf[64] = '\0';
+        cfg.ll.timing.busy = busy;
+        struct eeprom_dev *dev = test_open(&cfg);
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        eeprom_dev_write(dev, 0, 64, buf);      // 2 pages
+        write_us[busy] = elapsed_us(&t);
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        eeprom_dev_read(dev, 0, 32, buf);
+        read_us[busy] = elapsed_us(&t);
+        test_close(dev);
+    }
+    printf("Write %ldus, read %ldus (writer waits)\n", write_us[0], read_us[0]);
+    printf("Write %ldus, read %ldus (reader polls)\n", write_us[1], read_us[1]);
+    printf("Write cycle is charged --->%s\n\n",
+           write_us[0] >= 4064 && read_us[0] >= 32 &&
+           write_us[1] >= 64 && write_us[1] + read_us[1] >= 4096 ? "PASS" : "FAIL");
+}
+
+
+#define GEOMETRY_TEST_OPS 2000
+
+// One device of the geometry test
+struct geometry_test_arg {
+    struct eeprom_geometry geo;
+    enum eeprom_cache_mode cache_mode;
+    char path[64];
+    int ok;
+};
+
+/*
+    Each geometry test thread opens its own device, runs random
+    eeprom_dev_write/eeprom_dev_read/eeprom_dev_writev calls against it
+    and compares the results with a copy of the image kept in memory.
+*/
+void *geometry_test_thread(void *vargp) {
+    struct geometry_test_arg *arg = vargp;
+    struct eeprom_geometry geo = arg->geo;
+    char *model = malloc(geo.size);
+    char buf[1024];
+    unsigned int seed = geo.size + geo.page_shift;
+    int ok = 1;
+    int i, k;
+
+    memset(model, LL_ERASED_BYTE, geo.size);    // A new image reads back erased
+    remove(arg->path);
+    struct eeprom_config config = {
+        .geo = geo,
+        .ll = { .path = arg->path, .mode = LL_MODE_MMAP },
+        .cache_mode = arg->cache_mode,
+    };
+    struct eeprom_dev *dev = eeprom_open(&config);
+    if (dev == NULL) {
+        arg->ok = 0;
+        free(model);
+        return NULL;
+    }
+    for (i = 0; i < GEOMETRY_TEST_OPS && ok; i++) {
+        uint32_t offset = rand_r(&seed) % geo.size;
+        int size = 1 + rand_r(&seed) % 600;
+        if (offset + size > geo.size) {
+            size = geo.size - offset;
+        }
+        if (i % 2 == 0) {
+            for (k = 0; k < size; k++) {
+                buf[k] = 'a' + rand_r(&seed) % 26;
+            }
+            buf[size] = '\0';
+            ok = eeprom_dev_write(dev, offset, size, buf) == 0;
+            memcpy(model + offset, buf, size);
+        } else {
+            ok = eeprom_dev_read(dev, offset, size, buf) == 0 && memcmp(buf, model + offset, size) == 0;
+        }
+    }
+    // Two segments on neighbouring pages and one past them
+    struct eeprom_iovec wv[3] = {
+        { geo.size/2 - 3, 10, buf },
+        { geo.size/2 + 7, 40, buf + 10 },
+        { geo.size - 5, 5, buf + 50 },
+    };
+    eeprom_dev_writev(dev, wv, 3);
+    for (k = 0; k < 3; k++) {
+        memcpy(model + wv[k].offset, wv[k].buf, wv[k].size);
+    }
+    // Read everything back without the cache
+    eeprom_dev_set_cache_mode(dev, EEPROM_CACHE_OFF);
+    for (i = 0; i < geo.size && ok; i += 512) {
+        ok = eeprom_dev_read(dev, i, 512, buf) == 0 && memcmp(buf, model + i, 512) == 0;
+    }
+    eeprom_close(dev);
+    remove(arg->path);
+    free(model);
+    arg->ok = ok;
+    return NULL;
+}
+
+/*
+    This test opens one device for every supported geometry, each on its
+    own image file, and tests them all at the same time from separate
+    threads. Every other device runs with the write-back cache. It then
+    checks that eeprom_configure keeps the default device when the new
+    image cannot be opened.
+*/
+void geometry_test() {
+    struct geometry_test_arg arg[64];
+    pthread_t tid[64];
+    struct eeprom_geometry geo;
+    int failed = 0;
+    int n = 0;
+    int i;
+
+    printf("----geometry test----\n");
+    for (geo.page_shift = EEPROM_MIN_PAGE_SHIFT; geo.page_shift <= EEPROM_MAX_PAGE_SHIFT; geo.page_shift++) {
+        for (geo.size = EEPROM_MIN_SIZE; geo.size <= EEPROM_MAX_SIZE; geo.size *= 2) {
+            arg[n].geo = geo;
+            arg[n].cache_mode = n % 2 ? EEPROM_CACHE_WRITEBACK : EEPROM_CACHE_OFF;
+            snprintf(arg[n].path, sizeof(arg[n].path), "geometry_test_%d_%u.img", 1 << geo.page_shift, geo.size);
+            pthread_create(&tid[n], NULL, geometry_test_thread, &arg[n]);
+            n++;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(tid[i], NULL);
+        if (!arg[i].ok) {
+            printf("Page:%d, Size:%u --->FAIL\n", 1 << arg[i].geo.page_shift, arg[i].geo.size);
+            failed++;
+        }
+    }
+    printf("All %d geometries --->%s\n", n, failed == 0 ? "PASS" : "FAIL");
+
+    struct eeprom_dev *dev = eeprom_default();
+    struct ll_config missing = { .path = "no_such_dir/geometry_test.img", .mode = LL_MODE_PREAD };
+    char out[5];
+    int ok = eeprom_configure(&dev->geo, &missing) == -1 && eeprom_default() == dev;
+    ok &= eeprom_read(0, 4, out) == 0;
+    printf("A failed eeprom_configure keeps the default device --->%s\n\n", ok ? "PASS" : "FAIL");
+}
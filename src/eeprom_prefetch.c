@@ -0,0 +1,420 @@
+/*
+    @file   eeprom_prefetch.c
+
+    @brief  This file contains the read-ahead prefetcher. It sits between
+            the page cache and the checksum layer, watches the reads
+            of every thread, and when they go through the device in order
+            or with a fixed stride, loads the next pages on the async
+            worker before they are asked for.
+
+    @author     Frank Lee
+*/
+
+#include "../include/eeprom.h"
+#include "../include/eeprom_prefetch.h"
+
+// The reads of the calling thread so far
+static __thread struct prefetch_stream pf_stream;
+
+
+/*
+    This function empties a window. Pages it loaded that nobody read are
+    counted as waste. The caller holds pf->lock.
+*/
+static void window_drop(struct prefetch_window *w) {
+    if (w->state == PREFETCH_READY) {
+        int unused = 0;
+        for (int i = 0; i < w->pages; i++) {
+            unused += !w->used[i];
+        }
+        stats_add(STAT_PREFETCH_WASTE, unused);
+    }
+    w->state = PREFETCH_EMPTY;
+}
+
+/*
+    This function turns read-ahead on for a device.
+
+    @param *dev: The device
+    @param depth: Pages loaded ahead of a sequential or strided reader,
+                  at most the pages of the device
+*/
+void prefetch_open(struct eeprom_dev *dev, int depth) {
+    struct eeprom_prefetch *pf = calloc(1, sizeof(*pf));
+    int page_size = geometry_page_size(&dev->geo);
+
+    if (depth > geometry_num_pages(&dev->geo)) {
+        depth = geometry_num_pages(&dev->geo);
+    }
+    pf->depth = depth;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->idle, NULL);
+    for (int i = 0; i < EEPROM_PREFETCH_WINDOWS; i++) {
+        pf->win[i].pf = pf;
+        pf->win[i].used = malloc(depth);
+        pf->win[i].buf = malloc((size_t)depth * page_size);
+    }
+    dev->prefetch = pf;
+}
+
+/*
+    This function stops new windows from being queued and waits for the
+    ones on the async worker. The worker needs the device lock to load
+    them, so the caller must not hold it.
+*/
+static void prefetch_quiesce(struct eeprom_prefetch *pf) {
+    int i, loading;
+
+    pthread_mutex_lock(&pf->lock);
+    pf->depth = 0;
+    do {
+        for (i = 0, loading = 0; i < EEPROM_PREFETCH_WINDOWS; i++) {
+            loading |= pf->win[i].state == PREFETCH_LOADING;
+        }
+        if (loading) {
+            pthread_cond_wait(&pf->idle, &pf->lock);
+        }
+    } while (loading);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+    This function frees the read-ahead state of a device. It must have
+    been quiesced, or the async worker stopped, and no other thread may
+    be reading from the device.
+
+    @param *dev: The device
+*/
+void prefetch_close(struct eeprom_dev *dev) {
+    struct eeprom_prefetch *pf = dev->prefetch;
+    int i;
+
+    if (pf == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pf->lock);
+    for (i = 0; i < EEPROM_PREFETCH_WINDOWS; i++) {
+        window_drop(&pf->win[i]);
+        free(pf->win[i].used);
+        free(pf->win[i].buf);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    pthread_cond_destroy(&pf->idle);
+    pthread_mutex_destroy(&pf->lock);
+    free(pf);
+    dev->prefetch = NULL;
+}
+
+/*
+    This function is called by the async worker when a window finished
+    loading. A window that was written to in the meantime may hold old
+    data and is dropped.
+*/
+static void prefetch_done(struct eeprom_aio *aio) {
+    struct prefetch_window *w = aio->arg;
+    struct eeprom_prefetch *pf = w->pf;
+
+    pthread_mutex_lock(&pf->lock);
+    if (aio->result == 0 && !w->stale) {
+        w->state = PREFETCH_READY;
+        w->touched = ++pf->tick;
+    } else {
+        w->state = PREFETCH_EMPTY;
+        stats_add(STAT_PREFETCH_WASTE, w->pages);
+    }
+    pthread_cond_broadcast(&pf->idle);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+    This function returns the window holding or loading page, or NULL.
+    The caller holds pf->lock.
+*/
+static struct prefetch_window *window_find(struct eeprom_prefetch *pf, uint32_t page, int ready) {
+    for (int i = 0; i < EEPROM_PREFETCH_WINDOWS; i++) {
+        struct prefetch_window *w = &pf->win[i];
+        if (w->state != PREFETCH_EMPTY && (!ready || w->state == PREFETCH_READY) &&
+            page >= w->first && page < w->first + w->pages) {
+            return w;
+        }
+    }
+    return NULL;
+}
+
+/*
+    This function copies page from a ready window into buf.
+
+    @return: 1 if a window held the page, 0 otherwise
+*/
+static int prefetch_copy(struct eeprom_dev *dev, uint32_t page, char *buf) {
+    struct eeprom_prefetch *pf = dev->prefetch;
+    const int shift = dev->geo.page_shift;
+
+    pthread_mutex_lock(&pf->lock);
+    struct prefetch_window *w = window_find(pf, page, 1);
+    if (w != NULL) {
+        memcpy(buf, w->buf + ((size_t)(page - w->first) << shift), (size_t)1 << shift);
+        w->used[page - w->first] = 1;
+        w->touched = ++pf->tick;
+        stats_add(STAT_PREFETCH_HITS, 1);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return w != NULL;
+}
+
+/*
+    This function reads num_page consecutive pages. Pages that were read
+    ahead are copied from their window, runs of the others are read with
+    one crc_read_pages call each. Without read-ahead it is
+    crc_read_pages.
+
+    @param *dev: The device
+    @param offset: Offset of the first page
+    @param num_page: Number of pages to read
+    @param *buf: The buffer to store num_page pages
+
+    @return: 0 for success, otherwise the crc_read_pages error
+*/
+int prefetch_read_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, char *buf) {
+    const int shift = dev->geo.page_shift;
+    uint32_t first = offset >> shift;
+    int i, run = 0;
+
+    if (dev->prefetch == NULL) {
+        return crc_read_pages(dev, offset, num_page, buf);
+    }
+    for (i = 0; i <= num_page; i++) {
+        if (i < num_page && !prefetch_copy(dev, first + i, buf + ((size_t)i << shift))) {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            int ret = crc_read_pages(dev, (first + i - run) << shift, run,
+                                     buf + ((size_t)(i - run) << shift));
+            if (ret != 0) {
+                return ret;
+            }
+            run = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+    This function keeps the windows in step with num_page pages that
+    were just written or erased: a ready window gets the new data, and
+    one still loading is dropped when it completes.
+
+    @param *dev: The device
+    @param first: First page changed
+    @param num_page: Number of pages changed
+    @param *buf: Their new data, or NULL if they were erased
+    @param ret: Result of the write or erase
+*/
+static void prefetch_update(struct eeprom_dev *dev, uint32_t first, int num_page, const char *buf, int ret) {
+    struct eeprom_prefetch *pf = dev->prefetch;
+    const int shift = dev->geo.page_shift;
+
+    pthread_mutex_lock(&pf->lock);
+    for (int i = 0; i < EEPROM_PREFETCH_WINDOWS; i++) {
+        struct prefetch_window *w = &pf->win[i];
+        uint32_t lo = first > w->first ? first : w->first;
+        uint32_t hi = first + num_page < w->first + w->pages ? first + num_page : w->first + w->pages;
+        if (w->state == PREFETCH_EMPTY || lo >= hi) {
+            continue;
+        }
+        if (w->state == PREFETCH_LOADING) {
+            w->stale = 1;
+        } else if (ret != 0) {
+            // Unknown what made it to the image
+            window_drop(w);
+        } else if (buf == NULL) {
+            memset(w->buf + ((size_t)(lo - w->first) << shift), LL_ERASED_BYTE, (size_t)(hi - lo) << shift);
+        } else {
+            memcpy(w->buf + ((size_t)(lo - w->first) << shift), buf + ((size_t)(lo - first) << shift),
+                   (size_t)(hi - lo) << shift);
+        }
+    }
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+    This function writes num_page consecutive pages with
+    crc_write_pages and keeps the windows in step (see prefetch_update).
+
+    @param *dev: The device
+    @param offset: Offset of the first page
+    @param num_page: Number of pages to write
+    @param *buf: The buffer holding num_page pages
+
+    @return: 0 for success, otherwise the crc_write_pages error
+*/
+int prefetch_write_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, const char *buf) {
+    int ret = crc_write_pages(dev, offset, num_page, buf);
+
+    if (dev->prefetch != NULL) {
+        prefetch_update(dev, offset >> dev->geo.page_shift, num_page, buf, ret);
+    }
+    return ret;
+}
+
+/*
+    This function erases num_page consecutive pages with
+    crc_erase_pages and keeps the windows in step (see prefetch_update).
+
+    @param *dev: The device
+    @param offset: Offset of the first page
+    @param num_page: Number of pages to erase
+
+    @return: 0 for success, otherwise the crc_erase_pages error
+*/
+int prefetch_erase_pages(struct eeprom_dev *dev, uint32_t offset, int num_page) {
+    int ret = crc_erase_pages(dev, offset, num_page);
+
+    if (dev->prefetch != NULL) {
+        prefetch_update(dev, offset >> dev->geo.page_shift, num_page, NULL, ret);
+    }
+    return ret;
+}
+
+/*
+    This function queues the read of the pages from page on that the
+    windows do not hold yet, unless they already hold enough of them.
+    When no window is empty, the least recently used ready one is
+    reused, unless the reader is still headed into it.
+
+    @param *dev: The device
+    @param page: First page the reader is expected to need
+    @param want: Pages wanted from page on, 0 for depth pages ahead of
+                 a sequential reader, which is topped up once less than
+                 half of that is left
+*/
+static void prefetch_issue(struct eeprom_dev *dev, uint32_t page, int want) {
+    struct eeprom_prefetch *pf = dev->prefetch;
+    const uint32_t num_pages = geometry_num_pages(&dev->geo);
+    struct prefetch_window *w, *pick = NULL;
+    uint32_t ahead = page;
+    int i;
+
+    pthread_mutex_lock(&pf->lock);
+    // Follow the windows that are already lined up
+    while ((w = window_find(pf, ahead, 0)) != NULL) {
+        ahead = w->first + w->pages;
+    }
+    uint32_t enough = want > 0 ? want : (pf->depth + 1) / 2;
+    uint32_t count = want > 0 ? page + want - ahead : pf->depth;
+    if (pf->depth == 0 || ahead >= num_pages || ahead - page >= enough) {
+        pthread_mutex_unlock(&pf->lock);
+        return;
+    }
+    if (count > (uint32_t)pf->depth) {
+        count = pf->depth;
+    }
+    if (count > num_pages - ahead) {
+        count = num_pages - ahead;
+    }
+    for (i = 0; i < EEPROM_PREFETCH_WINDOWS; i++) {
+        w = &pf->win[i];
+        if (w->state == PREFETCH_EMPTY) {
+            pick = w;
+            break;
+        }
+        if (w->state == PREFETCH_READY && (w->first + w->pages <= page || w->first >= ahead) &&
+            (pick == NULL || w->touched < pick->touched)) {
+            pick = w;
+        }
+    }
+    if (pick != NULL) {
+        window_drop(pick);
+        pick->first = ahead;
+        pick->pages = count;
+        pick->stale = 0;
+        memset(pick->used, 0, pick->pages);
+        pick->state = PREFETCH_LOADING;
+        pick->aio = (struct eeprom_aio){ EEPROM_AIO_READ, ahead << dev->geo.page_shift,
+                                         pick->pages << dev->geo.page_shift, pick->buf,
+                                         prefetch_done, pick };
+        // Submitted under pf->lock, so prefetch_close sees it loading
+        if (eeprom_aio_submit(dev, &pick->aio) == 0) {
+            stats_add(STAT_PREFETCH_PAGES, pick->pages);
+        } else {
+            pick->state = PREFETCH_EMPTY;
+        }
+    }
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+    This function is told about every eeprom_read of the calling thread
+    while it holds the lock for the read. A read that starts where the
+    previous one ended is sequential, and one that is as far from the
+    previous one as that was from the one before is strided. Either way
+    the pages from where the next read is expected are prefetched: depth
+    pages at a time while the reads are contiguous or close together,
+    only the pages of the next read when a stride skips whole pages.
+
+    @param *dev: The device, with read-ahead on
+    @param offset: Offset of the read
+    @param size: Size of the read
+*/
+void prefetch_note(struct eeprom_dev *dev, uint32_t offset, int size) {
+    struct prefetch_stream *st = &pf_stream;
+    const int shift = dev->geo.page_shift;
+    uint32_t next;
+    int want = 0;
+
+    if (st->dev != dev) {
+        *st = (struct prefetch_stream){ dev, offset, offset + size, 0 };
+        return;
+    }
+    if (offset == st->last_end) {
+        next = offset + size;
+    } else if (offset > st->last_off && offset - st->last_off == st->stride) {
+        next = offset + st->stride;
+        if (st->stride >= (uint32_t)size + (1u << shift)) {
+            want = ((next + size - 1) >> shift) - (next >> shift) + 1;
+        }
+    } else {
+        next = UINT32_MAX;
+    }
+    st->stride = offset > st->last_off ? offset - st->last_off : 0;
+    st->last_off = offset;
+    st->last_end = offset + size;
+    if (next < dev->geo.size) {
+        prefetch_issue(dev, next >> shift, want);
+    }
+}
+
+/*
+    This function sets how many pages are read ahead of a sequential or
+    strided reader. 0 turns read-ahead off. Windows that are loading are
+    waited for, and the whole device is locked while the windows are
+    replaced.
+
+    @param *dev: The device
+    @param depth: Pages to read ahead
+*/
+void eeprom_dev_set_prefetch_depth(struct eeprom_dev *dev, int depth) {
+    struct eeprom_prefetch *pf = dev->prefetch;
+
+    if (pf != NULL) {
+        prefetch_quiesce(pf);
+    }
+    eeprom_lock(dev, 0, dev->geo.size, 1);
+    prefetch_close(dev);
+    if (depth > 0) {
+        prefetch_open(dev, depth);
+    }
+    eeprom_unlock(dev, 0, dev->geo.size, 1);
+}
+
+/*
+    This function returns the read-ahead depth of a device, 0 when off.
+*/
+int eeprom_dev_get_prefetch_depth(struct eeprom_dev *dev) {
+    return dev->prefetch != NULL ? dev->prefetch->depth : 0;
+}
+
+void eeprom_set_prefetch_depth(int depth) {
+    eeprom_dev_set_prefetch_depth(eeprom_default(), depth);
+}
@@ -0,0 +1,355 @@
+/*
+    @file   eeprom_server.c
+
+    @brief  This file contains the service that lets several processes
+            share one device. A thread owns the device and serves
+            requests from clients (see eeprom_client.c) over a Unix domain
+            socket. Clients pipeline many requests, and every round the
+            server takes all complete requests of all clients and runs
+            them as eeprom_dev_readv/eeprom_dev_writev batches.
+
+    @author     Frank Lee
+*/
+
+#include "../include/eeprom.h"
+#include "../include/eeprom_server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// One request of a round, see server_batch
+struct server_req {
+    struct eeprom_server_conn *conn;
+    struct eeprom_server_req h;
+    size_t data;                // Write data, offset in conn->in
+    size_t resp;                // Response header, offset in conn->out
+};
+
+
+/*
+    This function makes room for len more bytes in a connection buffer.
+*/
+static void server_reserve(char **buf, size_t *cap, size_t used, size_t len) {
+    if (used + len > *cap) {
+        *cap = (used + len) * 2;
+        *buf = realloc(*buf, *cap);
+    }
+}
+
+/*
+    This function appends a response header to a connection, followed by
+    room for size bytes of data.
+
+    @return: Offset of the header in conn->out
+*/
+static size_t server_respond(struct eeprom_server_conn *conn, uint32_t id, int status, int size) {
+    struct eeprom_server_resp r = { id, status, size };
+    size_t at = conn->out_len;
+
+    server_reserve(&conn->out, &conn->out_cap, conn->out_len, sizeof(r) + size);
+    memcpy(conn->out + at, &r, sizeof(r));
+    conn->out_len += sizeof(r) + size;
+    return at;
+}
+
+/*
+    This function takes the complete requests of a connection out of its
+    input buffer and sets conn->in_done past them. Requests that fail
+    eeprom_param_check are answered right away, the others are added to
+    reqs, with a response header and room for the data they read.
+
+    @return: Number of requests added
+*/
+static int server_parse(struct eeprom_server *srv, struct eeprom_server_conn *conn,
+                        struct server_req **reqs, int *cap, int n) {
+    int added = 0;
+
+    conn->in_done = 0;
+    conn->out_round = conn->out_len;
+    while (conn->in_len - conn->in_done >= sizeof(struct eeprom_server_req)) {
+        struct eeprom_server_req h;
+        memcpy(&h, conn->in + conn->in_done, sizeof(h));
+        if ((h.op != EEPROM_OP_READ && h.op != EEPROM_OP_WRITE) || h.size < 0 ||
+            h.size > (int32_t)srv->dev->geo.size) {
+            // No telling where the next request starts
+            server_respond(conn, h.id, -2, 0);
+            conn->closing = 1;
+            conn->in_done = conn->in_len;
+            break;
+        }
+        size_t len = sizeof(h) + (h.op == EEPROM_OP_WRITE ? h.size : 0);
+        if (conn->in_len - conn->in_done < len) {
+            break;
+        }
+
+        int check = eeprom_dev_param_check(srv->dev, h.offset, h.size);
+        if (check != 0) {
+            server_respond(conn, h.id, check, 0);
+        } else {
+            if (n + added == *cap) {
+                *cap = *cap * 2 + 16;
+                *reqs = realloc(*reqs, *cap * sizeof(**reqs));
+            }
+            size_t resp = server_respond(conn, h.id, 0, h.op == EEPROM_OP_READ ? h.size : 0);
+            (*reqs)[n + added] = (struct server_req){ conn, h, conn->in_done + sizeof(h), resp };
+            added++;
+        }
+        conn->in_done += len;
+    }
+    return added;
+}
+
+/*
+    This function drops the data of the failed responses of the current
+    round of a connection. A read that failed has nothing to return, so
+    its response goes out with size 0 instead of the bytes that were set
+    aside for it.
+*/
+static void server_drop_failed(struct eeprom_server_conn *conn) {
+    size_t from = conn->out_round, to = conn->out_round;
+
+    while (from < conn->out_len) {
+        struct eeprom_server_resp r;
+        memcpy(&r, conn->out + from, sizeof(r));
+        size_t len = sizeof(r) + r.size;
+        if (r.status != 0 && r.size > 0) {
+            r.size = 0;
+        }
+        memcpy(conn->out + to, &r, sizeof(r));
+        if (r.size > 0 && to != from) {
+            memmove(conn->out + to + sizeof(r), conn->out + from + sizeof(r), r.size);
+        }
+        from += len;
+        to += sizeof(r) + r.size;
+    }
+    conn->out_len = to;
+}
+
+/*
+    This function serves every complete request received so far, from
+    all clients, as one round. Consecutive requests of the same kind go
+    to the device as one eeprom_dev_readv or eeprom_dev_writev call,
+    which locks the pages once and reads or writes each of them once.
+    Overlapping writes are applied in order and runs are served in
+    order, so every client sees its requests run in the order it sent
+    them. Every request of a run that fails gets its error and no data.
+*/
+static void server_batch(struct eeprom_server *srv) {
+    struct server_req *reqs = NULL;
+    struct eeprom_iovec *iov;
+    int cap = 0, n = 0;
+    int c, i, j, k;
+
+    for (c = 0; c < srv->num_conns; c++) {
+        n += server_parse(srv, &srv->conns[c], &reqs, &cap, n);
+    }
+
+    // The output buffers do not move any more, point into them
+    iov = malloc((n > 0 ? n : 1) * sizeof(*iov));
+    for (i = 0; i < n; i = j) {
+        for (j = i; j < n && reqs[j].h.op == reqs[i].h.op; j++) {
+            struct server_req *r = &reqs[j];
+            char *buf = r->h.op == EEPROM_OP_READ ? r->conn->out + r->resp + sizeof(struct eeprom_server_resp)
+                                                  : r->conn->in + r->data;
+            iov[j - i] = (struct eeprom_iovec){ r->h.offset, r->h.size, buf };
+        }
+        int ret = reqs[i].h.op == EEPROM_OP_READ ? eeprom_dev_readv(srv->dev, iov, j - i)
+                                                 : eeprom_dev_writev(srv->dev, iov, j - i);
+        for (k = i; k < j; k++) {
+            struct eeprom_server_resp r;
+            memcpy(&r, reqs[k].conn->out + reqs[k].resp, sizeof(r));
+            r.status = ret;
+            memcpy(reqs[k].conn->out + reqs[k].resp, &r, sizeof(r));
+        }
+    }
+    if (n > 0) {
+        stats_add(STAT_SERVER_REQUESTS, n);
+        stats_add(STAT_SERVER_BATCHES, 1);
+    }
+    free(iov);
+    free(reqs);
+
+    // Keep only the bytes of incomplete requests
+    for (c = 0; c < srv->num_conns; c++) {
+        struct eeprom_server_conn *conn = &srv->conns[c];
+        server_drop_failed(conn);
+        if (conn->in_done > 0) {
+            memmove(conn->in, conn->in + conn->in_done, conn->in_len - conn->in_done);
+            conn->in_len -= conn->in_done;
+            conn->in_done = 0;
+        }
+    }
+}
+
+/*
+    This function reads whatever a client sent. End of file or an error
+    closes the connection once its responses are out.
+*/
+static void server_receive(struct eeprom_server_conn *conn) {
+    for (;;) {
+        server_reserve(&conn->in, &conn->in_cap, conn->in_len, 4096);
+        ssize_t got = read(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+        if (got > 0) {
+            conn->in_len += got;
+            continue;
+        }
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got == 0 || errno != EAGAIN) {
+            conn->closing = 1;
+        }
+        return;
+    }
+}
+
+/*
+    This function sends as many pending responses as the socket takes.
+
+    @return: 0, or -1 if the client is gone
+*/
+static int server_send(struct eeprom_server_conn *conn) {
+    while (conn->out_off < conn->out_len) {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if (sent < 0) {
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        conn->out_off += sent;
+    }
+    conn->out_off = conn->out_len = 0;
+    return 0;
+}
+
+/*
+    This function adds the clients waiting on the listening socket.
+*/
+static void server_accept(struct eeprom_server *srv) {
+    int fd;
+
+    while ((fd = accept(srv->listen_fd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        if (srv->num_conns == srv->cap_conns) {
+            srv->cap_conns = srv->cap_conns * 2 + 8;
+            srv->conns = realloc(srv->conns, srv->cap_conns * sizeof(*srv->conns));
+        }
+        srv->conns[srv->num_conns++] = (struct eeprom_server_conn){ .fd = fd };
+    }
+}
+
+/*
+    This function is the server thread: it waits for clients to send
+    requests or take responses, serves a round, and sends the responses
+    right away, until eeprom_server_stop wakes it.
+*/
+static void *server_thread(void *vargp) {
+    struct eeprom_server *srv = vargp;
+    struct pollfd *pfd = NULL;
+    int c;
+
+    for (;;) {
+        pfd = realloc(pfd, (srv->num_conns + 2) * sizeof(*pfd));
+        pfd[0] = (struct pollfd){ srv->wake[0], POLLIN };
+        pfd[1] = (struct pollfd){ srv->listen_fd, POLLIN };
+        for (c = 0; c < srv->num_conns; c++) {
+            struct eeprom_server_conn *conn = &srv->conns[c];
+            pfd[c + 2] = (struct pollfd){ conn->fd, (conn->closing ? 0 : POLLIN) |
+                                                   (conn->out_off < conn->out_len ? POLLOUT : 0) };
+        }
+        if (poll(pfd, srv->num_conns + 2, -1) < 0) {
+            continue;
+        }
+        if (pfd[0].revents != 0) {
+            break;
+        }
+        for (c = 0; c < srv->num_conns; c++) {
+            if (pfd[c + 2].revents & (POLLIN | POLLHUP | POLLERR)) {
+                server_receive(&srv->conns[c]);
+            }
+        }
+        server_batch(srv);
+
+        for (c = srv->num_conns - 1; c >= 0; c--) {
+            struct eeprom_server_conn *conn = &srv->conns[c];
+            if (server_send(conn) != 0 || (conn->closing && conn->out_off == conn->out_len)) {
+                close(conn->fd);
+                free(conn->in);
+                free(conn->out);
+                srv->conns[c] = srv->conns[--srv->num_conns];
+            }
+        }
+        // New clients last, their slots are not in pfd yet
+        if (pfd[1].revents != 0) {
+            server_accept(srv);
+        }
+    }
+    free(pfd);
+    return NULL;
+}
+
+/*
+    This function starts serving a device on a Unix domain socket. A
+    socket file left at path is replaced. The device must stay open
+    until eeprom_server_stop, and the process should only access it
+    through the server (or a client of it) meanwhile.
+
+    @param *dev: The device
+    @param *path: Where the socket is created, EEPROM_SERVER_PATH for
+                  the daemon
+
+    @return: The server, or NULL for failure to create the socket
+*/
+struct eeprom_server *eeprom_server_start(struct eeprom_dev *dev, const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("ERROR: Socket path is too long!\n");
+        return NULL;
+    }
+    struct eeprom_server *srv = calloc(1, sizeof(*srv));
+    srv->dev = dev;
+    snprintf(srv->path, sizeof(srv->path), "%s", path);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    unlink(path);
+    srv->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (srv->listen_fd < 0 || fcntl(srv->listen_fd, F_SETFL, O_NONBLOCK) != 0 || bind(srv->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(srv->listen_fd, SOMAXCONN) != 0 || pipe(srv->wake) != 0) {
+        printf("ERROR: Cannot serve on %s (%d)\n", path, errno);
+        if (srv->listen_fd >= 0) {
+            close(srv->listen_fd);
+        }
+        free(srv);
+        return NULL;
+    }
+    pthread_create(&srv->thread, NULL, server_thread, srv);
+    return srv;
+}
+
+/*
+    This function stops a server, dropping its clients, and removes the
+    socket file. Requests that were served are on the device.
+
+    @param *srv: The server
+*/
+void eeprom_server_stop(struct eeprom_server *srv) {
+    int c;
+
+    if (write(srv->wake[1], "", 1) != 1) {
+        printf("ERROR: Cannot wake the server!\n");
+    }
+    pthread_join(srv->thread, NULL);
+    for (c = 0; c < srv->num_conns; c++) {
+        close(srv->conns[c].fd);
+        free(srv->conns[c].in);
+        free(srv->conns[c].out);
+    }
+    close(srv->listen_fd);
+    close(srv->wake[0]);
+    close(srv->wake[1]);
+    unlink(srv->path);
+    free(srv->conns);
+    free(srv);
+}
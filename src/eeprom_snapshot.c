@@ -0,0 +1,262 @@
+/*
+    @file   eeprom_snapshot.c
+
+    @brief  This file contains snapshots and restores of the whole image,
+            and the bulk program path for factory provisioning. A
+            snapshot is copy-on-write: it reads the image a chunk at a
+            time, and a write to a page it has not copied yet first saves
+            the page into the snapshot.
+
+    @author     Frank Lee
+*/
+
+#include "../include/eeprom.h"
+#include "../include/eeprom_snapshot.h"
+
+
+/*
+    This function marks a page as copied.
+
+    @return: 1 if the caller gets to copy it, 0 if it was copied already
+*/
+static int snapshot_claim(struct eeprom_snapshot *s, int page) {
+    uint32_t bit = 1u << (page % 32);
+    return !(__atomic_fetch_or(&s->copied[page/32], bit, __ATOMIC_RELAXED) & bit);
+}
+
+/*
+    This function copies the pages of a run that nobody copied yet into
+    the snapshot, with one cache_read_pages call per run of them. The
+    caller holds the lock for the pages.
+*/
+static void snapshot_copy(struct eeprom_dev *dev, struct eeprom_snapshot *s, int first, int num_page) {
+    const int shift = dev->geo.page_shift;
+    int i, run = 0;
+
+    for (i = 0; i <= num_page; i++) {
+        if (i < num_page && snapshot_claim(s, first + i)) {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            uint32_t pos = (uint32_t)(first + i - run) << shift;
+            if (cache_read_pages(dev, pos, run, s->buf + pos) != 0) {
+                __atomic_store_n(&s->failed, 1, __ATOMIC_RELAXED);
+            }
+            run = 0;
+        }
+    }
+}
+
+/*
+    This function is called before num_page pages are changed while a
+    snapshot is being taken, and saves the pages the snapshot has not
+    copied yet. A page that cannot be read fails the snapshot, not the
+    write. The caller holds the write lock for the pages.
+
+    @param *dev: The device
+    @param offset: Offset of the first page
+    @param num_page: Number of pages about to be written
+*/
+void snapshot_preserve(struct eeprom_dev *dev, uint32_t offset, int num_page) {
+    struct eeprom_snapshot *s = dev->snapshot;
+
+    if (s != NULL) {
+        snapshot_copy(dev, s, offset >> dev->geo.page_shift, num_page);
+    }
+}
+
+/*
+    This function copies the whole image of a device into buf as it was
+    when the call started. The image is read EEPROM_SNAPSHOT_CHUNK pages
+    per transfer under the read lock for those pages only, so writers
+    only wait for the chunk they write to. A write to a page that was
+    not copied yet saves the old page into buf first. One snapshot is
+    taken at a time per device.
+
+    @param *dev: The device
+    @param *buf: Where the image is stored, geo.size bytes
+    @param len: Size of buf
+
+    @return: 0 for success
+    @return: -2 for a buffer smaller than the image
+    @return: -5 for failure to access the device
+*/
+int eeprom_dev_snapshot(struct eeprom_dev *dev, void *buf, size_t len) {
+    const int pages = geometry_num_pages(&dev->geo);
+    const int shift = dev->geo.page_shift;
+    struct eeprom_snapshot s = { buf };
+    int first;
+
+    if (len < dev->geo.size) {
+        printf("ERROR: Invalid size value!\n");
+        return -2;
+    }
+    s.copied = calloc((pages + 31) / 32, sizeof(uint32_t));
+
+    pthread_mutex_lock(&dev->snapshot_lock);
+    // No write is half way through while the snapshot is installed
+    eeprom_lock(dev, 0, dev->geo.size, 1);
+    dev->snapshot = &s;
+    eeprom_unlock(dev, 0, dev->geo.size, 1);
+
+    for (first = 0; first < pages; first += EEPROM_SNAPSHOT_CHUNK) {
+        int n = pages - first < EEPROM_SNAPSHOT_CHUNK ? pages - first : EEPROM_SNAPSHOT_CHUNK;
+        eeprom_lock(dev, (uint32_t)first << shift, n << shift, 0);
+        snapshot_copy(dev, &s, first, n);
+        eeprom_unlock(dev, (uint32_t)first << shift, n << shift, 0);
+    }
+
+    eeprom_lock(dev, 0, dev->geo.size, 1);
+    dev->snapshot = NULL;
+    eeprom_unlock(dev, 0, dev->geo.size, 1);
+    pthread_mutex_unlock(&dev->snapshot_lock);
+
+    free(s.copied);
+    return s.failed ? -5 : 0;
+}
+
+/*
+    This function puts a snapshot back. Pages that already hold the
+    snapshot's data are skipped (see eeprom_dev_set_elide_mode), and
+    runs of the others are written with one transfer each. The whole
+    device is write locked, so readers never see half of a restore.
+
+    @param *dev: The device
+    @param *buf: The image, geo.size bytes
+    @param len: Size of buf
+
+    @return: 0 for success
+    @return: -2 for a buffer smaller than the image
+    @return: -5 for failure to access the device
+*/
+int eeprom_dev_restore(struct eeprom_dev *dev, const void *buf, size_t len) {
+    int ret;
+
+    if (len < dev->geo.size) {
+        printf("ERROR: Invalid size value!\n");
+        return -2;
+    }
+    eeprom_lock(dev, 0, dev->geo.size, 1);
+    ret = cache_write_pages(dev, 0, geometry_num_pages(&dev->geo), buf);
+    eeprom_unlock(dev, 0, dev->geo.size, 1);
+    return ret != 0 ? -5 : 0;
+}
+
+/*
+    This function takes a snapshot of a device into a file, see
+    eeprom_dev_snapshot.
+
+    @param *dev: The device
+    @param *path: The file, created or truncated
+
+    @return: 0 for success, -5 for failure to access the device or the
+             file
+*/
+int eeprom_dev_snapshot_file(struct eeprom_dev *dev, const char *path) {
+    char *buf = malloc(dev->geo.size);
+    int ret = eeprom_dev_snapshot(dev, buf, dev->geo.size);
+
+    if (ret == 0) {
+        FILE *f = fopen(path, "wb");
+        if (f == NULL || fwrite(buf, 1, dev->geo.size, f) != dev->geo.size) {
+            printf("ERROR: Cannot write %s!\n", path);
+            ret = -5;
+        }
+        if (f != NULL && fclose(f) != 0) {
+            ret = -5;
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+/*
+    This function restores a device from a file written by
+    eeprom_dev_snapshot_file, see eeprom_dev_restore.
+
+    @param *dev: The device
+    @param *path: The file, at least geo.size bytes
+
+    @return: 0 for success, -2 for a file smaller than the image, -5 for
+             failure to access the device or the file
+*/
+int eeprom_dev_restore_file(struct eeprom_dev *dev, const char *path) {
+    char *buf = malloc(dev->geo.size);
+    FILE *f = fopen(path, "rb");
+    int ret;
+
+    if (f == NULL) {
+        printf("ERROR: Cannot read %s!\n", path);
+        free(buf);
+        return -5;
+    }
+    size_t got = fread(buf, 1, dev->geo.size, f);
+    fclose(f);
+    ret = eeprom_dev_restore(dev, buf, got);
+    free(buf);
+    return ret;
+}
+
+/*
+    This function is the bulk program path for factory provisioning.
+    Whole pages are written straight to the image with one transfer,
+    without reading or comparing them first, and the image is synced
+    before it returns.
+
+    @param *dev: The device
+    @param offset: Where to start, a multiple of the page size
+    @param *buf: The data
+    @param len: Size of the data, a multiple of the page size
+
+    @return: 0 for success
+    @return: -1 for invalid or unaligned offset
+    @return: -2 for invalid size or a size that is not whole pages
+    @return: -3 for index out of bound
+    @return: -5 for failure to access the device
+*/
+int eeprom_dev_program(struct eeprom_dev *dev, uint32_t offset, const void *buf, size_t len) {
+    const uint32_t mask = geometry_page_size(&dev->geo) - 1;
+    int ret;
+
+    ret = eeprom_dev_param_check(dev, offset, len > INT_MAX ? -1 : (int)len);
+    if (ret != 0) {
+        return ret;
+    }
+    if ((offset & mask) != 0) {
+        printf("ERROR: Offset is not page aligned!\n");
+        return -1;
+    }
+    if ((len & mask) != 0) {
+        printf("ERROR: Size is not whole pages!\n");
+        return -2;
+    }
+    stats_add(STAT_BYTES_WRITTEN, len);
+    eeprom_lock(dev, offset, len, 1);
+    ret = cache_write_through_pages(dev, offset, len >> dev->geo.page_shift, buf);
+    eeprom_unlock(dev, offset, len, 1);
+    if (ret == 0) {
+        ret = ll_dev_sync(dev->ll);
+    }
+    return ret != 0 ? -5 : 0;
+}
+
+int eeprom_snapshot(void *buf, size_t len) {
+    return eeprom_dev_snapshot(eeprom_default(), buf, len);
+}
+
+int eeprom_restore(const void *buf, size_t len) {
+    return eeprom_dev_restore(eeprom_default(), buf, len);
+}
+
+int eeprom_snapshot_file(const char *path) {
+    return eeprom_dev_snapshot_file(eeprom_default(), path);
+}
+
+int eeprom_restore_file(const char *path) {
+    return eeprom_dev_restore_file(eeprom_default(), path);
+}
+
+int eeprom_program(uint32_t offset, const void *buf, size_t len) {
+    return eeprom_dev_program(eeprom_default(), offset, buf, len);
+}
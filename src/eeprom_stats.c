@@ -0,0 +1,242 @@
+/*
+    @file   eeprom_stats.c
+    
+    @brief  This file contains the instrumentation counters and the
+            operation trace. Every thread counts into its own slot, and
+            the slots are only added up when a snapshot is taken.
+
+    @author     Frank Lee
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/eeprom_stats.h"
+
+_Static_assert(sizeof(struct eeprom_stats) == STAT_COUNT * sizeof(uint64_t),
+               "struct eeprom_stats must match enum eeprom_stat");
+
+// Counters of one thread
+struct stats_slot {
+    uint64_t c[STAT_COUNT];
+    uint32_t id;
+    uint64_t lock_start;        // When the current lock was requested
+    uint64_t lock_acquired;     // When it was granted, 0 if not timed
+    struct stats_slot *next;
+};
+
+int eeprom_stats_flags;
+__thread uint64_t *stats_counters;
+static __thread struct stats_slot *stats_self;
+
+// Every live slot, plus the totals of threads that have exited
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_slot *stats_slots;
+static uint64_t stats_retired[STAT_COUNT];
+static uint64_t stats_baseline[STAT_COUNT];
+static uint32_t stats_next_id;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static struct eeprom_trace_rec trace[EEPROM_TRACE_SIZE];
+static uint64_t trace_next;
+
+
+/*
+    This function folds the slot of an exiting thread into the retired
+    totals and frees it.
+*/
+static void stats_thread_exit(void *vslot) {
+    struct stats_slot *slot = vslot;
+    struct stats_slot **p;
+    int i;
+    
+    pthread_mutex_lock(&stats_lock);
+    for (i = 0; i < STAT_COUNT; i++) {
+        stats_retired[i] += slot->c[i];
+    }
+    for (p = &stats_slots; *p != NULL; p = &(*p)->next) {
+        if (*p == slot) {
+            *p = slot->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    free(slot);
+}
+
+static void stats_key_init() {
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+/*
+    This function gives the calling thread its slot. It is called by the
+    first stats_add of every thread.
+    
+    @return: The counters of the calling thread
+*/
+uint64_t *stats_register() {
+    struct stats_slot *slot = calloc(1, sizeof(*slot));
+    
+    pthread_once(&stats_key_once, stats_key_init);
+    pthread_setspecific(stats_key, slot);
+    pthread_mutex_lock(&stats_lock);
+    slot->id = stats_next_id++;
+    slot->next = stats_slots;
+    stats_slots = slot;
+    pthread_mutex_unlock(&stats_lock);
+    stats_self = slot;
+    stats_counters = slot->c;
+    return slot->c;
+}
+
+/*
+    This function returns the monotonic clock in nanoseconds.
+*/
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+    This function is called by eeprom_lock once the locks are held, when
+    EEPROM_STATS_LOCK_TIMING is set.
+    
+    @param wait_start: When eeprom_lock was entered
+*/
+void stats_lock_acquired(uint64_t wait_start) {
+    uint64_t now = stats_now();
+    
+    stats_add(STAT_LOCK_ACQUIRES, 1);
+    stats_add(STAT_LOCK_WAIT_NS, now - wait_start);
+    stats_self->lock_start = wait_start;
+    stats_self->lock_acquired = now;
+}
+
+/*
+    This function is called by eeprom_unlock before the locks are
+    released. It adds the hold time and, with EEPROM_STATS_TRACE set,
+    records the operation in the trace.
+    
+    @param offset: Offset of the locked access
+    @param size: Size of the locked access
+    @param write: 1 if locked for writing, 0 if locked for reading
+*/
+void stats_lock_released(uint32_t offset, int size, int write) {
+    struct stats_slot *slot = stats_self;
+    
+    // The flags may have been turned on while the lock was held
+    if (slot == NULL || slot->lock_acquired == 0) {
+        return;
+    }
+    uint64_t now = stats_now();
+    stats_add(STAT_LOCK_HOLD_NS, now - slot->lock_acquired);
+    if (eeprom_stats_flags & EEPROM_STATS_TRACE) {
+        uint64_t i = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+        struct eeprom_trace_rec *rec = &trace[i & (EEPROM_TRACE_SIZE - 1)];
+        rec->start_ns = slot->lock_start;
+        rec->wait_ns = slot->lock_acquired - slot->lock_start;
+        rec->hold_ns = now - slot->lock_acquired;
+        rec->offset = offset;
+        rec->size = size;
+        rec->thread = slot->id;
+        rec->write = write;
+    }
+    slot->lock_acquired = 0;
+}
+
+/*
+    This function turns the optional parts of the instrumentation on or
+    off. The counters themselves are always kept.
+    
+    @param flags: EEPROM_STATS_LOCK_TIMING and/or EEPROM_STATS_TRACE.
+                  EEPROM_STATS_TRACE implies EEPROM_STATS_LOCK_TIMING.
+*/
+void eeprom_stats_set_flags(int flags) {
+    __atomic_store_n(&eeprom_stats_flags, flags, __ATOMIC_RELAXED);
+}
+
+/*
+    This function adds the counters of every thread up into out.
+    Counters of running threads may be a few operations behind.
+    
+    @param *out: Where the totals since the last reset are stored
+*/
+void eeprom_stats_snapshot(struct eeprom_stats *out) {
+    uint64_t sum[STAT_COUNT];
+    struct stats_slot *slot;
+    int i;
+    
+    pthread_mutex_lock(&stats_lock);
+    memcpy(sum, stats_retired, sizeof(sum));
+    for (slot = stats_slots; slot != NULL; slot = slot->next) {
+        for (i = 0; i < STAT_COUNT; i++) {
+            sum[i] += __atomic_load_n(&slot->c[i], __ATOMIC_RELAXED);
+        }
+    }
+    for (i = 0; i < STAT_COUNT; i++) {
+        sum[i] -= stats_baseline[i];
+    }
+    pthread_mutex_unlock(&stats_lock);
+    memcpy(out, sum, sizeof(sum));
+}
+
+/*
+    This function starts the counters and the trace over. The counters
+    of other threads are not touched; the current totals become the
+    baseline later snapshots are taken against.
+*/
+void eeprom_stats_reset() {
+    struct eeprom_stats now;
+    
+    eeprom_stats_snapshot(&now);
+    pthread_mutex_lock(&stats_lock);
+    for (int i = 0; i < STAT_COUNT; i++) {
+        stats_baseline[i] += ((uint64_t *)&now)[i];
+    }
+    pthread_mutex_unlock(&stats_lock);
+    __atomic_store_n(&trace_next, 0, __ATOMIC_RELAXED);
+}
+
+/*
+    This function copies the most recent trace records, oldest first.
+    Records written while it runs may be torn, so read the trace while
+    the device is quiet.
+    
+    @param *out: Where the records are stored
+    @param max: Size of out
+    
+    @return: Number of records stored
+*/
+int eeprom_trace_read(struct eeprom_trace_rec *out, int max) {
+    uint64_t next = __atomic_load_n(&trace_next, __ATOMIC_RELAXED);
+    uint64_t n = next < EEPROM_TRACE_SIZE ? next : EEPROM_TRACE_SIZE;
+    
+    if (n > max) {
+        n = max;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        out[i] = trace[(next - n + i) & (EEPROM_TRACE_SIZE - 1)];
+    }
+    return n;
+}
+
+/*
+    This function prints the trace as CSV, oldest record first.
+    
+    @param *f: Where to print it
+*/
+void eeprom_trace_dump(FILE *f) {
+    struct eeprom_trace_rec *recs = malloc(sizeof(*recs) * EEPROM_TRACE_SIZE);
+    int n = eeprom_trace_read(recs, EEPROM_TRACE_SIZE);
+    
+    fprintf(f, "start_ns,thread,write,offset,size,wait_ns,hold_ns\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(f, "%llu,%u,%d,%u,%d,%u,%u\n", (unsigned long long)recs[i].start_ns,
+                recs[i].thread, recs[i].write, recs[i].offset, recs[i].size,
+                recs[i].wait_ns, recs[i].hold_ns);
+    }
+    free(recs);
+}
@@ -0,0 +1,274 @@
+/*
+    @file   eeprom_stream.c
+
+    @brief  This file contains the streaming cursor for sequential
+            transfers, like dumping or flashing the whole image. Every
+            page is read or written once no matter how the caller chunks
+            the transfer, and a read stream prefetches the next page on
+            the async worker while the caller consumes the current one.
+
+    @author     Frank Lee
+*/
+
+#include "../include/eeprom.h"
+#include "../include/eeprom_stream.h"
+
+
+/*
+    This function opens a cursor at offset. A read stream starts
+    prefetching the page at offset right away.
+
+    @param *dev: The device, which must stay open until the stream is
+                 closed
+    @param offset: Where the first read or write goes
+    @param mode: EEPROM_STREAM_READ or EEPROM_STREAM_WRITE
+
+    @return: The stream, or NULL for an offset outside of the device
+*/
+struct eeprom_stream *eeprom_stream_open(struct eeprom_dev *dev, uint32_t offset,
+                                         enum eeprom_stream_mode mode) {
+    int page_size = geometry_page_size(&dev->geo);
+
+    if (offset >= dev->geo.size) {
+        printf("ERROR: Invalid offset!\n");
+        return NULL;
+    }
+    struct eeprom_stream *s = calloc(1, sizeof(*s));
+    s->dev = dev;
+    s->mode = mode;
+    s->pos = offset;
+    s->page = UINT32_MAX;
+    s->cur = malloc(page_size);
+    if (mode == EEPROM_STREAM_READ) {
+        s->next = malloc(page_size);
+        s->prefetch = (struct eeprom_aio){ EEPROM_AIO_READ, offset & ~(page_size - 1), page_size, s->next };
+        s->prefetching = eeprom_aio_submit(dev, &s->prefetch) == 0;
+    }
+    return s;
+}
+
+/*
+    This function makes cur hold the page at page_off, taking it from
+    the prefetch if that is the one in flight, and prefetches the page
+    after it.
+
+    @return: 0 for success, otherwise the read error
+*/
+static int stream_fetch(struct eeprom_stream *s, uint32_t page_off) {
+    struct eeprom_dev *dev = s->dev;
+    int page_size = geometry_page_size(&dev->geo);
+    int ret;
+
+    if (s->prefetching) {
+        ret = eeprom_aio_wait(dev, &s->prefetch);
+        s->prefetching = 0;
+        if (s->prefetch.offset == page_off && ret == 0) {
+            char *tmp = s->cur;
+            s->cur = s->next;
+            s->next = tmp;
+            s->page = page_off;
+        }
+    }
+    if (s->page != page_off) {
+        s->page = UINT32_MAX;
+        ret = eeprom_dev_read_bytes(dev, page_off, s->cur, page_size);
+        if (ret != 0) {
+            return ret;
+        }
+        s->page = page_off;
+    }
+    if (page_off + page_size < dev->geo.size) {
+        s->prefetch = (struct eeprom_aio){ EEPROM_AIO_READ, page_off + page_size, page_size, s->next };
+        s->prefetching = eeprom_aio_submit(dev, &s->prefetch) == 0;
+    }
+    return 0;
+}
+
+/*
+    This function reads the next len bytes of a read stream. Bytes of a
+    page already read are served from the stream. Whole pages the caller
+    asks for past the prefetched one are read with one transfer. A page
+    is read when it is prefetched, so a write made to it later by
+    somebody else may not be seen.
+
+    @param *s: A stream opened with EEPROM_STREAM_READ
+    @param *buf: Where the bytes are stored. No '\0' is added.
+    @param len: Number of bytes wanted
+
+    @return: Number of bytes read, which is less than len only at the end
+             of the device (0 once it is reached)
+    @return: -1 for a write stream, otherwise the read error if nothing
+             was read
+*/
+int eeprom_stream_read_next(struct eeprom_stream *s, void *buf, size_t len) {
+    struct eeprom_dev *dev = s->dev;
+    const uint32_t page_size = geometry_page_size(&dev->geo);
+    char *out = buf;
+    int done = 0;
+
+    if (s->mode != EEPROM_STREAM_READ) {
+        printf("ERROR: Not a read stream!\n");
+        return -1;
+    }
+    if (len > dev->geo.size - s->pos) {
+        len = dev->geo.size - s->pos;
+    }
+    while (len > 0) {
+        uint32_t page_off = s->pos & ~(page_size - 1);
+        int ret;
+
+        if (s->pos == page_off && len >= page_size && s->page != page_off) {
+            // Whole pages go straight into buf, the first one from the
+            // prefetch if it is in flight
+            uint32_t n = len & ~(size_t)(page_size - 1);
+            if (s->prefetching && s->prefetch.offset == page_off) {
+                ret = eeprom_aio_wait(dev, &s->prefetch);
+                s->prefetching = 0;
+                if (ret == 0) {
+                    memcpy(out, s->next, page_size);
+                    n = page_size;
+                }
+            } else {
+                ret = eeprom_dev_read_bytes(dev, s->pos, out, n);
+            }
+            if (ret != 0) {
+                return done > 0 ? done : ret;
+            }
+            out += n;
+            s->pos += n;
+            done += n;
+            len -= n;
+            continue;
+        }
+        if (s->page != page_off) {
+            ret = stream_fetch(s, page_off);
+            if (ret != 0) {
+                return done > 0 ? done : ret;
+            }
+        }
+        uint32_t n = page_off + page_size - s->pos;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(out, s->cur + (s->pos - page_off), n);
+        out += n;
+        s->pos += n;
+        done += n;
+        len -= n;
+    }
+    // Have the page the next call starts in on its way
+    uint32_t page_off = s->pos & ~(page_size - 1);
+    if (!s->prefetching && s->page != page_off && s->pos < dev->geo.size) {
+        s->prefetch = (struct eeprom_aio){ EEPROM_AIO_READ, page_off, page_size, s->next };
+        s->prefetching = eeprom_aio_submit(dev, &s->prefetch) == 0;
+    }
+    return done;
+}
+
+/*
+    This function writes the bytes of the buffered page given by the
+    caller. A whole page is written without reading it first.
+
+    @return: 0 for success, otherwise the eeprom_dev_write_bytes error
+*/
+static int stream_flush(struct eeprom_stream *s) {
+    int ret = 0;
+
+    if (s->hi > s->lo) {
+        ret = eeprom_dev_write_bytes(s->dev, s->page + s->lo, s->cur + s->lo, s->hi - s->lo);
+    }
+    s->lo = s->hi = 0;
+    s->page = UINT32_MAX;
+    return ret;
+}
+
+/*
+    This function writes the next len bytes of a write stream. Bytes are
+    collected in the stream and written back once their page is full, so
+    every page is written once however the caller chunks the data.
+    Whole pages are written with one transfer straight from buf.
+
+    @param *s: A stream opened with EEPROM_STREAM_WRITE
+    @param *buf: The bytes to write
+    @param len: Number of bytes
+
+    @return: Number of bytes taken, which is less than len only at the
+             end of the device (0 once it is reached)
+    @return: -1 for a read stream, otherwise the write error if nothing
+             was taken
+*/
+int eeprom_stream_write_next(struct eeprom_stream *s, const void *buf, size_t len) {
+    struct eeprom_dev *dev = s->dev;
+    const uint32_t page_size = geometry_page_size(&dev->geo);
+    const char *in = buf;
+    int done = 0;
+
+    if (s->mode != EEPROM_STREAM_WRITE) {
+        printf("ERROR: Not a write stream!\n");
+        return -1;
+    }
+    if (len > dev->geo.size - s->pos) {
+        len = dev->geo.size - s->pos;
+    }
+    while (len > 0) {
+        uint32_t page_off = s->pos & ~(page_size - 1);
+        int ret;
+
+        if (s->pos == page_off && len >= page_size && s->page == UINT32_MAX) {
+            uint32_t n = len & ~(size_t)(page_size - 1);
+            ret = eeprom_dev_write_bytes(dev, s->pos, in, n);
+            if (ret != 0) {
+                return done > 0 ? done : ret;
+            }
+            in += n;
+            s->pos += n;
+            done += n;
+            len -= n;
+            continue;
+        }
+        if (s->page != page_off) {
+            s->page = page_off;
+            s->lo = s->hi = s->pos - page_off;
+        }
+        uint32_t n = page_off + page_size - s->pos;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(s->cur + s->hi, in, n);
+        s->hi += n;
+        in += n;
+        s->pos += n;
+        done += n;
+        len -= n;
+        if (s->hi == page_size) {
+            ret = stream_flush(s);
+            if (ret != 0) {
+                return done > 0 ? done : ret;
+            }
+        }
+    }
+    return done;
+}
+
+/*
+    This function writes back the last partial page of a write stream,
+    waits for the prefetch of a read stream and frees the stream.
+
+    @param *s: The stream
+
+    @return: 0 for success, otherwise the write error of the last page
+*/
+int eeprom_stream_close(struct eeprom_stream *s) {
+    int ret = 0;
+
+    if (s->mode == EEPROM_STREAM_WRITE) {
+        ret = stream_flush(s);
+    }
+    if (s->prefetching) {
+        eeprom_aio_wait(s->dev, &s->prefetch);
+    }
+    free(s->cur);
+    free(s->next);
+    free(s);
+    return ret;
+}
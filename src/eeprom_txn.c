@@ -0,0 +1,478 @@
+/*
+    @file   eeprom_txn.c
+
+    @brief  This file contains multi-page transactions. A commit is first
+            written to a journal at the end of the image, so it is either
+            applied completely or not at all, even if power is lost in
+            the middle of it.
+
+    @author     Frank Lee
+*/
+
+#include "../include/eeprom.h"
+#include "../include/eeprom_txn.h"
+
+
+/*
+    This function returns the FNV-1a hash of len bytes, continuing from
+    hash.
+*/
+static uint32_t journal_hash(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len-- > 0) {
+        hash = (hash ^ *p++) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+    This function returns the checksum stored in the header of a block
+    with npages pages whose index and data pages are in body.
+*/
+static uint32_t journal_check(const struct journal_header *h, const char *body, size_t len) {
+    uint32_t hash = journal_hash(2166136261u, &h->seq, sizeof(h->seq));
+    hash = journal_hash(hash, &h->npages, sizeof(h->npages));
+    return journal_hash(hash, body, len);
+}
+
+/*
+    This function returns the number of index pages of a block holding
+    npages pages. An index page holds one page number per 4 bytes.
+*/
+static int journal_index_pages(struct eeprom_dev *dev, int npages) {
+    int per_page = geometry_page_size(&dev->geo) / sizeof(uint32_t);
+    return (npages + per_page - 1) / per_page;
+}
+
+/*
+    This function writes the header page of the journal.
+
+    @return: 0 for success, otherwise the ll_dev_write_pages error
+*/
+static int journal_write_header(struct eeprom_dev *dev, const struct journal_header *h) {
+    int page_size = geometry_page_size(&dev->geo);
+    char page[EEPROM_MAX_PAGE_SIZE];
+
+    memset(page, EOF, page_size);
+    memcpy(page, h, sizeof(*h));
+    return ll_dev_write_pages(dev->ll, dev->journal->start, 1, page);
+}
+
+/*
+    This function finishes a commit that was interrupted after its
+    journal block was written: the pages of the block are written to
+    their homes again and the block is marked applied. A block whose
+    checksum does not match is ignored, since its header is only written
+    after the rest of it. A clean journal costs a single page read. It
+    runs on open, and before the next block is written when a commit
+    failed to apply its own block; the caller then holds the write lock
+    of the whole device.
+
+    @param *dev: The device
+
+    @return: 0 for success, -5 for failure to access the device
+*/
+static int journal_recover(struct eeprom_dev *dev) {
+    struct eeprom_journal *j = dev->journal;
+    const int shift = dev->geo.page_shift;
+    const int page_size = 1 << shift;
+    char page[EEPROM_MAX_PAGE_SIZE];
+    struct journal_header h;
+    int i;
+
+    if (ll_dev_read_pages(dev->ll, j->start, 1, page) != 0) {
+        return -5;
+    }
+    memcpy(&h, page, sizeof(h));
+    if (h.magic != EEPROM_JOURNAL_MAGIC) {
+        return 0;                           // Never used
+    }
+    j->seq = h.seq;
+    if (h.state != JOURNAL_COMMITTED) {
+        return 0;
+    }
+
+    int nidx = journal_index_pages(dev, h.npages);
+    if (h.npages == 0 || 1 + nidx + (int)h.npages > j->pages) {
+        printf("ERROR: Journal header is corrupt!\n");
+        return 0;
+    }
+    size_t len = (size_t)(nidx + h.npages) << shift;
+    char *body = malloc(len);
+    int ret = ll_dev_read_pages(dev->ll, j->start + page_size, nidx + h.npages, body);
+    if (ret == 0 && journal_check(&h, body, len) != h.check) {
+        printf("ERROR: Journal block is corrupt, not applied!\n");
+        free(body);
+        return 0;
+    }
+    const uint32_t *index = (const uint32_t *)body;
+    const char *data = body + ((size_t)nidx << shift);
+    for (i = 0; i < h.npages && ret == 0; i++) {
+        if (index[i] >= geometry_num_pages(&dev->geo)) {
+            continue;
+        }
+        ret = cache_write_through_pages(dev, index[i] << shift, 1, data + ((size_t)i << shift));
+    }
+    if (ret == 0) {
+        h.state = JOURNAL_APPLIED;
+        ret = journal_write_header(dev, &h);
+    }
+    free(body);
+    return ret != 0 ? -5 : 0;
+}
+
+/*
+    This function sets up the journal of a device and finishes a commit
+    that was interrupted by a power loss.
+
+    @param *dev: The device, with the cache still off
+    @param start: Offset of the journal in the image
+    @param pages: Pages of the journal, at least 3
+
+    @return: 0 for success, -5 for failure to access the device
+*/
+int journal_open(struct eeprom_dev *dev, uint32_t start, int pages) {
+    struct eeprom_journal *j = calloc(1, sizeof(*j));
+
+    j->start = start;
+    j->pages = pages;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->done, NULL);
+    dev->journal = j;
+    if (journal_recover(dev) != 0) {
+        printf("ERROR: Cannot recover the journal!\n");
+        journal_close(dev);
+        return -5;
+    }
+    return 0;
+}
+
+/*
+    This function frees the journal of a device. No commit may be in
+    progress.
+
+    @param *dev: The device
+*/
+void journal_close(struct eeprom_dev *dev) {
+    struct eeprom_journal *j = dev->journal;
+
+    if (j == NULL) {
+        return;
+    }
+    pthread_cond_destroy(&j->done);
+    pthread_mutex_destroy(&j->lock);
+    free(j);
+    dev->journal = NULL;
+}
+
+/*
+    This function starts a transaction. Its writes are kept in RAM until
+    eeprom_txn_commit.
+
+    @param *dev: A device opened with journal_pages set
+
+    @return: The transaction, or NULL if the device has no journal
+*/
+struct eeprom_txn *eeprom_txn_begin(struct eeprom_dev *dev) {
+    if (dev->journal == NULL) {
+        printf("ERROR: Device has no journal!\n");
+        return NULL;
+    }
+    struct eeprom_txn *txn = calloc(1, sizeof(*txn));
+    txn->dev = dev;
+    return txn;
+}
+
+/*
+    This function adds a write to a transaction. The data is copied, so
+    buf can be reused right away. Nothing reaches the device before
+    eeprom_txn_commit; writes are applied in the order they were added.
+
+    @param *txn: The transaction
+    @param offset: Amount of offset from the beginning of EEPROM
+    @param *buf: Pointer to the len bytes to be written
+    @param len: Size of the write
+
+    @return: 0 for success
+    @return: -1 for invalid offset
+    @return: -2 for invalid size
+    @return: -3 for index out of bound
+*/
+int eeprom_txn_write(struct eeprom_txn *txn, uint32_t offset, const void *buf, size_t len) {
+    struct eeprom_dev *dev = txn->dev;
+    const int shift = dev->geo.page_shift;
+
+    int param_check = eeprom_dev_param_check(dev, offset, len > INT_MAX ? -1 : (int)len);
+    if (param_check != 0) {
+        return param_check;
+    }
+    if (txn->nseg == txn->cap) {
+        txn->cap = txn->cap > 0 ? txn->cap * 2 : 4;
+        txn->seg = realloc(txn->seg, sizeof(*txn->seg) * txn->cap);
+    }
+    struct txn_seg *seg = &txn->seg[txn->nseg++];
+    seg->offset = offset;
+    seg->size = len;
+    seg->buf = malloc(len);
+    memcpy(seg->buf, buf, len);
+    txn->pages += ((offset + len - 1) >> shift) - (offset >> shift) + 1;
+    return 0;
+}
+
+/*
+    This function drops a transaction without writing anything.
+
+    @param *txn: The transaction
+*/
+void eeprom_txn_abort(struct eeprom_txn *txn) {
+    for (int i = 0; i < txn->nseg; i++) {
+        free(txn->seg[i].buf);
+    }
+    free(txn->seg);
+    free(txn);
+}
+
+static int page_compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+    This function writes one journal block holding every page touched by
+    a group of transactions, then applies it:
+    1. The touched pages are read and the writes of every transaction
+       are applied in commit order. Pages that end up unchanged are
+       dropped.
+    2. The index and data pages of the block are written in one
+       transfer, then the header page marked JOURNAL_COMMITTED. From
+       that point on the group survives a power loss.
+    3. The pages are written to their homes, and the header is marked
+       JOURNAL_APPLIED.
+    The pages are write locked for the whole time. If step 3 fails, the
+    block stays committed on the image and is applied with
+    journal_recover before the next block overwrites it, so a power loss
+    in that block's header write cannot leave the old header over a new
+    body. Until it has been applied no new block is written.
+
+    @param *dev: The device
+    @param *group: Transactions linked by next, in commit order
+
+    @return: 0 for success, -5 for failure to access the device
+*/
+static int journal_commit_group(struct eeprom_dev *dev, struct eeprom_txn *group) {
+    struct eeprom_journal *j = dev->journal;
+    const int shift = dev->geo.page_shift;
+    const size_t page_size = (size_t)1 << shift;
+    struct eeprom_txn *t;
+    uint32_t lo = UINT32_MAX, hi = 0;
+    uint32_t *pages;
+    int n = 0, bound = 0, i, k, ret = 0;
+
+    for (t = group; t != NULL; t = t->next) {
+        bound += t->pages;
+        for (i = 0; i < t->nseg; i++) {
+            if (t->seg[i].offset < lo) {
+                lo = t->seg[i].offset;
+            }
+            if (t->seg[i].offset + t->seg[i].size > hi) {
+                hi = t->seg[i].offset + t->seg[i].size;
+            }
+        }
+    }
+    if (bound == 0) {
+        return 0;
+    }
+
+    // Sorted list of the touched pages
+    pages = malloc(sizeof(*pages) * bound);
+    for (t = group; t != NULL; t = t->next) {
+        for (i = 0; i < t->nseg; i++) {
+            uint32_t p;
+            for (p = t->seg[i].offset >> shift; p <= (t->seg[i].offset + t->seg[i].size - 1) >> shift; p++) {
+                pages[n++] = p;
+            }
+        }
+    }
+    qsort(pages, n, sizeof(*pages), page_compare);
+    for (i = 1, k = 1; i < n; i++) {
+        if (pages[i] != pages[k-1]) {
+            pages[k++] = pages[i];
+        }
+    }
+    n = k;
+
+    if (j->unapplied) {
+        eeprom_lock(dev, 0, dev->geo.size, 1);
+        ret = journal_recover(dev);
+        eeprom_unlock(dev, 0, dev->geo.size, 1);
+        if (ret != 0) {
+            free(pages);
+            return -5;
+        }
+        j->unapplied = 0;
+    }
+
+    eeprom_lock(dev, lo, hi - lo, 1);
+    int nidx = journal_index_pages(dev, n);
+    char *body = malloc((size_t)(nidx + n) << shift);
+    char *data = body + ((size_t)nidx << shift);
+    char *old = malloc((size_t)n << shift);
+
+    // 1. New contents of the touched pages
+    for (i = 0; i < n; i = k) {
+        for (k = i + 1; k < n && pages[k] == pages[k-1] + 1; k++) {
+        }
+        ret |= cache_read_pages(dev, pages[i] << shift, k - i, data + ((size_t)i << shift));
+    }
+    memcpy(old, data, (size_t)n << shift);
+    for (t = group; t != NULL; t = t->next) {
+        for (i = 0; i < t->nseg; i++) {
+            const struct txn_seg *s = &t->seg[i];
+            uint32_t pos = s->offset;
+            while (pos < s->offset + s->size) {
+                uint32_t p = pos >> shift;
+                uint32_t *at = bsearch(&p, pages, n, sizeof(*pages), page_compare);
+                uint32_t in_page = pos & (page_size - 1);
+                uint32_t len = page_size - in_page;
+                if (len > s->offset + s->size - pos) {
+                    len = s->offset + s->size - pos;
+                }
+                memcpy(data + ((size_t)(at - pages) << shift) + in_page, s->buf + (pos - s->offset), len);
+                pos += len;
+            }
+        }
+    }
+    if (dev->elide_mode != EEPROM_ELIDE_OFF) {
+        for (i = 0, k = 0; i < n; i++) {
+            if (memcmp(old + ((size_t)i << shift), data + ((size_t)i << shift), page_size) == 0) {
+                stats_add(STAT_ELIDED_WRITES, 1);
+                continue;
+            }
+            pages[k] = pages[i];
+            memmove(data + ((size_t)k << shift), data + ((size_t)i << shift), page_size);
+            k++;
+        }
+        n = k;
+        // The index may have shrunk, move the data up behind it
+        int shrunk = journal_index_pages(dev, n);
+        memmove(body + ((size_t)shrunk << shift), data, (size_t)n << shift);
+        nidx = shrunk;
+        data = body + ((size_t)nidx << shift);
+    }
+
+    if (ret == 0 && n > 0) {
+        // 2. Journal block, header last
+        struct journal_header h = { EEPROM_JOURNAL_MAGIC, JOURNAL_COMMITTED, j->seq + 1, n, 0 };
+        memset(body, EOF, (size_t)nidx << shift);
+        memcpy(body, pages, sizeof(*pages) * n);
+        size_t len = (size_t)(nidx + n) << shift;
+        h.check = journal_check(&h, body, len);
+        ret = ll_dev_write_pages(dev->ll, j->start + page_size, nidx + n, body);
+        if (ret == 0) {
+            j->unapplied = 1;
+            ret = journal_write_header(dev, &h);
+        }
+        if (ret == 0) {
+            j->seq++;
+            stats_add(STAT_JOURNAL_BLOCKS, 1);
+        }
+
+        // 3. Pages to their homes
+        for (i = 0; i < n && ret == 0; i = k) {
+            for (k = i + 1; k < n && pages[k] == pages[k-1] + 1; k++) {
+            }
+            ret = cache_write_through_pages(dev, pages[i] << shift, k - i, data + ((size_t)i << shift));
+        }
+        if (ret == 0) {
+            h.state = JOURNAL_APPLIED;
+            ret = journal_write_header(dev, &h);
+        }
+        if (ret == 0) {
+            j->unapplied = 0;
+        }
+    }
+    eeprom_unlock(dev, lo, hi - lo, 1);
+
+    free(old);
+    free(body);
+    free(pages);
+    return ret != 0 ? -5 : 0;
+}
+
+/*
+    This function commits a transaction: all of its writes reach the
+    device, or after a power loss and the next eeprom_open, none of them
+    do. Commits from several threads that arrive while a journal block
+    is being written wait for it, and the first of them then writes one
+    block for all of them, so they share the cost of the journal header.
+    The transaction is freed.
+
+    @param *txn: The transaction
+
+    @return: 0 for success
+    @return: -5 for failure to access the device
+    @return: -6 if the transaction does not fit in the journal
+*/
+int eeprom_txn_commit(struct eeprom_txn *txn) {
+    struct eeprom_dev *dev = txn->dev;
+    struct eeprom_journal *j = dev->journal;
+    int ret;
+
+    if (txn->nseg == 0) {
+        eeprom_txn_abort(txn);
+        return 0;
+    }
+    if (1 + journal_index_pages(dev, txn->pages) + txn->pages > j->pages) {
+        printf("ERROR: Transaction does not fit in the journal!\n");
+        eeprom_txn_abort(txn);
+        return -6;
+    }
+    stats_add(STAT_TXN_COMMITS, 1);
+
+    pthread_mutex_lock(&j->lock);
+    if (j->tail != NULL) {
+        j->tail->next = txn;
+    } else {
+        j->head = txn;
+    }
+    j->tail = txn;
+    while (!txn->done) {
+        if (j->busy) {
+            pthread_cond_wait(&j->done, &j->lock);
+            continue;
+        }
+        // Take every queued commit that fits into one block
+        struct eeprom_txn *group = j->head, *last = j->head;
+        int pages = last->pages;
+        while (last->next != NULL) {
+            int more = pages + last->next->pages;
+            if (1 + journal_index_pages(dev, more) + more > j->pages) {
+                break;
+            }
+            pages = more;
+            last = last->next;
+        }
+        j->head = last->next;
+        if (j->head == NULL) {
+            j->tail = NULL;
+        }
+        last->next = NULL;
+        j->busy = 1;
+        pthread_mutex_unlock(&j->lock);
+
+        int result = journal_commit_group(dev, group);
+
+        pthread_mutex_lock(&j->lock);
+        for (struct eeprom_txn *t = group; t != NULL; t = t->next) {
+            t->result = result;
+            t->done = 1;
+        }
+        j->busy = 0;
+        pthread_cond_broadcast(&j->done);
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    ret = txn->result;
+    eeprom_txn_abort(txn);
+    return ret;
+}
@@ -0,0 +1,123 @@
+/*
+    @file   eeprom_view.c
+
+    @brief  This file contains zero-copy reads. A view points straight
+            into the RAM copy of the page cache or the mapped image, and
+            holds the read lock of its pages until it is released.
+
+    @author     Frank Lee
+*/
+
+#include "../include/eeprom.h"
+#include "../include/eeprom_view.h"
+
+
+/*
+    This function returns where the pages of a range live in memory, or
+    NULL if they are not resident. The caller holds the lock for them.
+
+    @param *dev: The device
+    @param first: Offset of the first page of the range
+    @param num_page: Number of pages of the range
+    @param *ret: Where an error loading or checking the pages is stored
+*/
+static const char *view_resident(struct eeprom_dev *dev, uint32_t first, int num_page, int *ret) {
+    *ret = 0;
+    if (dev->cache.mode != EEPROM_CACHE_OFF) {
+        // Dirty pages of a write-back cache only live here
+        *ret = cache_load_pages(dev, first, num_page);
+        return dev->cache.image;
+    }
+    if (dev->ll->map != NULL && dev->wear == NULL && dev->ll->config.timing.byte_ns == 0 &&
+        dev->ll->config.bus == LL_BUS_NONE) {
+        // Logical pages are where the image has them, and no simulated
+        // bus stands between the caller and the image
+        *ret = crc_check_pages(dev, first >> dev->geo.page_shift, num_page, dev->ll->map + first);
+        return dev->ll->map;
+    }
+    return NULL;
+}
+
+/*
+    This function gives read-only access to len bytes of a device without
+    copying them. When the range is resident (held by the page cache, or
+    in an image mapped with LL_MODE_MMAP without wear leveling, a
+    simulated bus or a bus timing model), the view points into it and
+    the read lock of the range (see eeprom_lock) is held until
+    eeprom_view_release, so writers to it wait. Otherwise the bytes are
+    read into a copy the view owns, and nothing is held.
+    The calling thread must not wait for the lock it holds through the
+    view, which depends on the lock mode:
+    - EEPROM_LOCK_GLOBAL and EEPROM_LOCK_SEQ: the device mutex, so the
+      thread must not access the device at all
+    - EEPROM_LOCK_RW: the device wide lock, so it must not write anywhere
+    - EEPROM_LOCK_STRIPED: the stripes of the range, so it must not write
+      to any page of them
+
+    @param *dev: The device
+    @param offset: Amount of offset from the beginning of EEPROM
+    @param len: Size of the view
+    @param *view: The view to fill in
+
+    @return: 0 for success
+    @return: -1 for invalid offset
+    @return: -2 for invalid size
+    @return: -3 for index out of bound
+    @return: -5 for failure to access the device
+*/
+int eeprom_dev_view_acquire(struct eeprom_dev *dev, uint32_t offset, size_t len, struct eeprom_view *view) {
+    const int shift = dev->geo.page_shift;
+    int ret = eeprom_dev_param_check(dev, offset, len > INT_MAX ? -1 : (int)len);
+
+    if (ret != 0) {
+        return ret;
+    }
+    *view = (struct eeprom_view){ NULL, len, dev, offset, NULL };
+
+    uint32_t first = offset >> shift << shift;
+    int num_page = (int)((offset + len - first + (1u << shift) - 1) >> shift);
+    eeprom_lock(dev, offset, (int)len, 0);
+    const char *base = view_resident(dev, first, num_page, &ret);
+    if (base != NULL && ret == 0) {
+        stats_add(STAT_BYTES_READ, len);
+        view->data = base + offset;
+        return 0;
+    }
+    eeprom_unlock(dev, offset, (int)len, 0);
+    if (base != NULL) {
+        return -5;
+    }
+
+    stats_add(STAT_VIEW_COPIES, 1);
+    view->copy = malloc(len);
+    ret = eeprom_dev_read_bytes(dev, offset, view->copy, len);
+    if (ret != 0) {
+        free(view->copy);
+        view->copy = NULL;
+        return ret;
+    }
+    view->data = view->copy;
+    return 0;
+}
+
+/*
+    This function ends a view, letting writers to its range go on.
+
+    @param *view: A view filled in by eeprom_dev_view_acquire
+*/
+void eeprom_view_release(struct eeprom_view *view) {
+    if (view->data == NULL) {
+        return;
+    }
+    if (view->copy != NULL) {
+        free(view->copy);
+    } else {
+        eeprom_unlock(view->dev, view->offset, (int)view->len, 0);
+    }
+    view->data = NULL;
+    view->copy = NULL;
+}
+
+int eeprom_view_acquire(uint32_t offset, size_t len, struct eeprom_view *view) {
+    return eeprom_dev_view_acquire(eeprom_default(), offset, len, view);
+}
@@ -0,0 +1,448 @@
+/*
+    @file   eeprom_wear.c
+
+    @brief  This file contains the wear leveling layer. It sits between
+            the page cache and the image, maps logical pages to physical
+            pages and moves pages that are written a lot onto spare
+            physical pages.
+
+    @author     Frank Lee
+*/
+
+#include "../include/eeprom.h"
+#include "../include/eeprom_wear.h"
+
+
+/*
+    This function returns the number of entries a metadata page holds,
+    one slot being taken by its footer.
+*/
+static int wear_per_meta(int page_size) {
+    return page_size / (int)sizeof(struct wear_entry) - 1;
+}
+
+/*
+    This function returns the number of metadata pages needed for
+    phys_pages data pages, not counting their second copies.
+*/
+static int wear_meta_pages(int phys_pages, int page_size) {
+    return (phys_pages + wear_per_meta(page_size) - 1) / wear_per_meta(page_size);
+}
+
+/*
+    This function returns the size of the image a device with the given
+    geometry and wear leveling configuration needs: the logical pages,
+    the spares and both copies of the metadata pages.
+
+    @param *geo: Geometry of the device
+    @param *cfg: Wear leveling configuration
+
+    @return: Image size in bytes
+*/
+uint32_t wear_image_size(const struct eeprom_geometry *geo, const struct eeprom_wear_config *cfg) {
+    int page_size = geometry_page_size(geo);
+    int phys = geometry_num_pages(geo) + cfg->spares;
+    return (uint32_t)(phys + 2 * wear_meta_pages(phys, page_size)) * page_size;
+}
+
+/*
+    This function checks whether a metadata entry was written by
+    wear_move, as opposed to being zero filled or torn.
+*/
+static int wear_entry_valid(const struct eeprom_wear *w, const struct wear_entry *e) {
+    return e->seq != 0 && e->logical < w->logical_pages &&
+           e->check == (e->seq ^ e->erase ^ e->logical ^ EEPROM_WEAR_MAGIC);
+}
+
+/*
+    This function checks whether a copy of metadata page m was written
+    in full, and returns its footer.
+*/
+static int wear_copy_valid(const char *copy, int page_size, int m, struct wear_footer *f) {
+    memcpy(f, copy + page_size - sizeof(*f), sizeof(*f));
+    return f->mpage == (uint32_t)m &&
+           f->check == eeprom_crc32(EEPROM_WEAR_MAGIC, copy, page_size - sizeof(f->check));
+}
+
+/*
+    This function writes metadata page m from the RAM copy of the
+    entries, into the copy that is not in use, and makes it the one in
+    use once it was written. The caller holds w->lock.
+
+    @return: 0 for success, otherwise the ll_dev_write_pages error
+*/
+static int wear_write_meta(struct eeprom_dev *dev, int m) {
+    struct eeprom_wear *w = dev->wear;
+    const int shift = dev->geo.page_shift;
+    const int page_size = 1 << shift;
+    struct wear_footer f = { w->seq + 1, m, 0, 0 };
+    char page[EEPROM_MAX_PAGE_SIZE];
+    int first = m * w->per_meta;
+    int num = w->phys_pages - first < w->per_meta ? w->phys_pages - first : w->per_meta;
+    int copy = w->meta_copy[m] ^ 1;
+
+    memset(page, 0, page_size);
+    memcpy(page, &w->meta[first], sizeof(*w->meta) * num);
+    memcpy(page + page_size - sizeof(f), &f, sizeof(f));
+    f.check = eeprom_crc32(EEPROM_WEAR_MAGIC, page, page_size - sizeof(f.check));
+    memcpy(page + page_size - sizeof(f.check), &f.check, sizeof(f.check));
+    int ret = ll_dev_write_pages(dev->ll, (uint32_t)(w->phys_pages + 2 * m + copy) << shift, 1, page);
+    if (ret == 0) {
+        w->meta_copy[m] = copy;
+    }
+    return ret;
+}
+
+/*
+    This function sets up wear leveling on a device whose image is
+    already open, and rebuilds the page map from the metadata with a
+    single read of the metadata pages. Of the two copies of a metadata
+    page, the one with a valid footer and the highest seq is used.
+    Every logical page starts out on the physical page with the same
+    number. A logical page that moved has a metadata entry on every
+    physical page it moved to, and the one with the highest seq is its
+    current home. Erase counts are only stored when a page moves, so
+    writes made in place since then are estimated: a page left behind by
+    a move took threshold writes since it got its logical page. The
+    number of spares must stay the same for an image.
+
+    @param *dev: The device, with dev->ll sized by wear_image_size
+    @param *cfg: Wear leveling configuration
+
+    @return: 0 for success, -1 if the metadata could not be read
+*/
+int wear_open(struct eeprom_dev *dev, const struct eeprom_wear_config *cfg) {
+    struct eeprom_wear *w = calloc(1, sizeof(*w));
+    int page_size = geometry_page_size(&dev->geo);
+    uint32_t *best;
+    int p, l;
+
+    w->logical_pages = geometry_num_pages(&dev->geo);
+    w->phys_pages = w->logical_pages + cfg->spares;
+    w->meta_pages = wear_meta_pages(w->phys_pages, page_size);
+    w->per_meta = wear_per_meta(page_size);
+    w->threshold = cfg->threshold > 0 ? cfg->threshold : EEPROM_WEAR_THRESHOLD;
+    w->l2p = malloc(sizeof(*w->l2p) * w->logical_pages);
+    w->p2l = malloc(sizeof(*w->p2l) * w->phys_pages);
+    w->erase = calloc(w->phys_pages, sizeof(*w->erase));
+    w->since = calloc(w->phys_pages, sizeof(*w->since));
+    w->spare = malloc(sizeof(*w->spare) * cfg->spares);
+    w->meta = calloc(w->phys_pages, sizeof(*w->meta));
+    w->meta_copy = malloc(w->meta_pages);
+    pthread_mutex_init(&w->lock, NULL);
+    dev->wear = w;
+
+    char *region = malloc((size_t)2 * w->meta_pages * page_size);
+    if (ll_dev_read_pages(dev->ll, (uint32_t)w->phys_pages * page_size, 2 * w->meta_pages,
+                          region) != 0) {
+        printf("ERROR: Cannot read the wear leveling metadata!\n");
+        free(region);
+        wear_close(dev);
+        return -1;
+    }
+    for (int m = 0; m < w->meta_pages; m++) {
+        const char *copy[2] = { region + (size_t)2 * m * page_size,
+                                region + (size_t)(2 * m + 1) * page_size };
+        struct wear_footer f[2];
+        int valid0 = wear_copy_valid(copy[0], page_size, m, &f[0]);
+        int valid1 = wear_copy_valid(copy[1], page_size, m, &f[1]);
+        int first = m * w->per_meta;
+        int num = w->phys_pages - first < w->per_meta ? w->phys_pages - first : w->per_meta;
+
+        // A page never written has no valid copy and no entries
+        w->meta_copy[m] = valid1 && (!valid0 || f[1].seq > f[0].seq);
+        if (valid0 || valid1) {
+            memcpy(&w->meta[first], copy[w->meta_copy[m]], sizeof(*w->meta) * num);
+        }
+    }
+    free(region);
+
+    // Highest seq seen for every logical page, 0 for the identity mapping
+    best = calloc(w->logical_pages, sizeof(*best));
+    for (l = 0; l < w->logical_pages; l++) {
+        w->l2p[l] = l;
+    }
+    for (p = 0; p < w->phys_pages; p++) {
+        const struct wear_entry *e = &w->meta[p];
+        if (wear_entry_valid(w, e)) {
+            if (e->seq > best[e->logical]) {
+                best[e->logical] = e->seq;
+                w->l2p[e->logical] = p;
+            }
+            if (e->seq > w->seq) {
+                w->seq = e->seq;
+            }
+        }
+    }
+    for (p = 0; p < w->phys_pages; p++) {
+        w->p2l[p] = -1;
+    }
+    for (l = 0; l < w->logical_pages; l++) {
+        if (w->p2l[w->l2p[l]] >= 0) {
+            printf("ERROR: Wear leveling metadata is inconsistent!\n");
+            free(best);
+            wear_close(dev);
+            return -1;
+        }
+        w->p2l[w->l2p[l]] = l;
+    }
+    for (p = 0; p < w->phys_pages; p++) {
+        int moved_in = wear_entry_valid(w, &w->meta[p]);
+        if (moved_in) {
+            w->erase[p] = w->meta[p].erase;
+        }
+        if (w->p2l[p] < 0) {
+            // Left behind by a move, or a spare that was never used. The
+            // write that moved a page in counts towards its threshold.
+            if (moved_in) {
+                w->erase[p] += w->threshold - 1;
+            } else if (p < w->logical_pages) {
+                w->erase[p] += w->threshold;
+            }
+            w->spare[w->num_spares++] = p;
+        }
+    }
+    free(best);
+    return 0;
+}
+
+/*
+    This function frees the wear leveling state of a device.
+
+    @param *dev: The device
+*/
+void wear_close(struct eeprom_dev *dev) {
+    struct eeprom_wear *w = dev->wear;
+
+    if (w == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&w->lock);
+    free(w->l2p);
+    free(w->p2l);
+    free(w->erase);
+    free(w->since);
+    free(w->spare);
+    free(w->meta);
+    free(w->meta_copy);
+    free(w);
+    dev->wear = NULL;
+}
+
+/*
+    This function reads num_page consecutive logical pages. Pages that
+    are also consecutive on the image are read with one transfer.
+    Without wear leveling it is ll_dev_read_pages.
+
+    @param *dev: The device
+    @param offset: Offset of the first logical page
+    @param num_page: Number of pages to read
+    @param *buf: The buffer to store num_page pages
+
+    @return: 0 for success, otherwise the ll_dev_read_pages error
+*/
+int wear_read_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, char *buf) {
+    struct eeprom_wear *w = dev->wear;
+    const int shift = dev->geo.page_shift;
+    int first = offset >> shift;
+    int i, run;
+
+    if (w == NULL) {
+        return ll_dev_read_pages(dev->ll, offset, num_page, buf);
+    }
+    for (i = 0; i < num_page; i += run) {
+        uint32_t phys = __atomic_load_n(&w->l2p[first + i], __ATOMIC_RELAXED);
+        for (run = 1; i + run < num_page &&
+             __atomic_load_n(&w->l2p[first + i + run], __ATOMIC_RELAXED) == phys + run; run++) {
+        }
+        int ret = ll_dev_read_pages(dev->ll, phys << shift, run, buf + ((size_t)i << shift));
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+    This function moves logical page l onto the least worn spare while
+    writing it. It costs the data write plus one metadata page write
+    (see wear_write_meta). The caller holds w->lock.
+
+    @return: 0 for success, 1 if no spare is less worn than the current
+             page, otherwise the ll_dev_write_pages error
+*/
+static int wear_move(struct eeprom_dev *dev, int l, const char *page) {
+    struct eeprom_wear *w = dev->wear;
+    const int shift = dev->geo.page_shift;
+    int old = w->l2p[l];
+    int s, best = -1;
+
+    for (s = 0; s < w->num_spares; s++) {
+        if (best < 0 || w->erase[w->spare[s]] < w->erase[w->spare[best]]) {
+            best = s;
+        }
+    }
+    if (best < 0 || w->erase[w->spare[best]] >= w->erase[old]) {
+        return 1;
+    }
+    int to = w->spare[best];
+    int ret = ll_dev_write_pages(dev->ll, to << shift, 1, page);
+    if (ret != 0) {
+        return ret;
+    }
+
+    struct wear_entry prev = w->meta[to];
+    w->meta[to] = (struct wear_entry){ w->seq + 1, w->erase[to] + 1, l, 0 };
+    w->meta[to].check = w->meta[to].seq ^ w->meta[to].erase ^ l ^ EEPROM_WEAR_MAGIC;
+    ret = wear_write_meta(dev, to / w->per_meta);
+
+    // The new home only counts once its entry is written
+    if (ret != 0) {
+        w->meta[to] = prev;
+    } else {
+        w->seq++;
+        w->erase[to]++;
+        w->since[to] = 1;
+        w->spare[best] = old;
+        w->p2l[old] = -1;
+        w->p2l[to] = l;
+        __atomic_store_n(&w->l2p[l], to, __ATOMIC_RELAXED);
+        w->moves++;
+        stats_add(STAT_WEAR_MOVES, 1);
+    }
+    return ret;
+}
+
+/*
+    This function writes num_page consecutive logical pages. A page is
+    written in place until its physical page has taken threshold writes
+    since it got the logical page; the next write moves it to the least
+    worn spare (see wear_move). Pages written in place that are also
+    consecutive on the image are written with one transfer, so the common
+    path costs no extra page I/O. Without wear leveling it is
+    ll_dev_write_pages.
+
+    @param *dev: The device
+    @param offset: Offset of the first logical page
+    @param num_page: Number of pages to write
+    @param *buf: The buffer holding num_page pages
+
+    @return: 0 for success, otherwise the ll_dev_write_pages error
+*/
+int wear_write_pages(struct eeprom_dev *dev, uint32_t offset, int num_page, const char *buf) {
+    struct eeprom_wear *w = dev->wear;
+    const int shift = dev->geo.page_shift;
+    int first = offset >> shift;
+    int run_start = 0, run = 0;
+    int i, ret = 0;
+
+    if (w == NULL) {
+        return ll_dev_write_pages(dev->ll, offset, num_page, buf);
+    }
+    pthread_mutex_lock(&w->lock);
+    for (i = 0; i <= num_page && ret == 0; i++) {
+        int phys = i < num_page ? w->l2p[first + i] : -1;
+        int moved = 0;
+
+        if (phys >= 0 && w->since[phys] >= w->threshold) {
+            moved = wear_move(dev, first + i, buf + ((size_t)i << shift));
+            if (moved == 1) {
+                // Nowhere better to go, stay for another round
+                w->since[phys] = 0;
+                moved = 0;
+            } else {
+                ret = moved;
+                moved = 1;
+            }
+        }
+        // Flush the in-place run when it cannot grow
+        if (run > 0 && (moved || phys != (int)w->l2p[first + run_start] + run)) {
+            int p0 = w->l2p[first + run_start];
+            int err = ll_dev_write_pages(dev->ll, p0 << shift, run, buf + ((size_t)run_start << shift));
+            if (ret == 0) {
+                ret = err;
+            }
+            run = 0;
+        }
+        if (phys >= 0 && !moved) {
+            if (run == 0) {
+                run_start = i;
+            }
+            run++;
+            w->erase[phys]++;
+            w->since[phys]++;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+/*
+    This function erases num_page consecutive logical pages where they
+    currently live. Pages that are also consecutive on the image are
+    erased with one ll_dev_erase, and pages keep their homes, so the
+    metadata needs no update. An erase wears a page like a write does.
+    Without wear leveling it is ll_dev_erase.
+
+    @param *dev: The device
+    @param offset: Offset of the first logical page
+    @param num_page: Number of pages to erase
+
+    @return: 0 for success, otherwise the ll_dev_erase error
+*/
+int wear_erase_pages(struct eeprom_dev *dev, uint32_t offset, int num_page) {
+    struct eeprom_wear *w = dev->wear;
+    const int shift = dev->geo.page_shift;
+    int first = offset >> shift;
+    int i, run, ret = 0;
+
+    if (w == NULL) {
+        return ll_dev_erase(dev->ll, offset, num_page);
+    }
+    pthread_mutex_lock(&w->lock);
+    for (i = 0; i < num_page && ret == 0; i += run) {
+        uint32_t phys = w->l2p[first + i];
+        for (run = 1; i + run < num_page && w->l2p[first + i + run] == phys + run; run++) {
+        }
+        ret = ll_dev_erase(dev->ll, phys << shift, run);
+        for (int p = phys; p < phys + run; p++) {
+            w->erase[p]++;
+            w->since[p]++;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+/*
+    This function reports how evenly the physical pages of a device are
+    worn.
+
+    @param *dev: The device
+    @param *out: Where the erase count range and number of moves are
+                 stored
+
+    @return: 0 for success, -1 if wear leveling is off
+*/
+int eeprom_dev_wear_info(struct eeprom_dev *dev, struct eeprom_wear_info *out) {
+    struct eeprom_wear *w = dev->wear;
+    int p;
+
+    if (w == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&w->lock);
+    out->min_erase = UINT32_MAX;
+    out->max_erase = 0;
+    for (p = 0; p < w->phys_pages; p++) {
+        if (w->erase[p] < out->min_erase) {
+            out->min_erase = w->erase[p];
+        }
+        if (w->erase[p] > out->max_erase) {
+            out->max_erase = w->erase[p];
+        }
+    }
+    out->moves = w->moves;
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
@@ -1,6 +1,6 @@
 /*
     @file   ll_func.c
-    
+
     @brief  This file contains low level functions to be called by eeprom.c
 
     @author     Frank Lee
@@ -8,85 +8,689 @@
 
 
 #include "../include/ll_func.h"
+#include "../include/eeprom_stats.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Image used by ll_read/ll_write and the other functions without a handle
+static struct ll_dev *ll_default;
+
+static pthread_once_t ll_default_once = PTHREAD_ONCE_INIT;
 
 /*
-    This function is supposed to mimic the behavior of a low level
-    read function using File IO. The function reads 32 bytes from the
-    file test.txt with the beginning index equaling to offset.
-    The parameter offset must be a multiple of 32.
-    
-    @param offset: Amount of offset from the beginning of the file
-    @param *buf: The buffer to store the read bytes
-    
-    @return: 0 for success. -1 for failure to open the file
+    This function opens the default image if nobody called ll_open
+    before the first page access.
 */
-int ll_read(uint32_t offset, char *buf) {
-    FILE *fp;
+static void ll_open_default() {
+    if (ll_default == NULL) {
+        ll_open(NULL);
+    }
+}
+
+/*
+    This function makes sure the default backing store is open.
+
+    @return: The default image, or NULL if it could not be opened
+*/
+static struct ll_dev *ll_default_dev() {
+    pthread_once(&ll_default_once, ll_open_default);
+    return ll_default;
+}
+
+/*
+    This function returns the monotonic clock in nanoseconds.
+*/
+static uint64_t ll_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+    This function sleeps until the monotonic clock reaches deadline.
+*/
+static void ll_sleep_until(uint64_t deadline) {
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000ull,
+        .tv_nsec = deadline % 1000000000ull,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+// Commands of the simulated bus, see ll_bus_command
+enum ll_bus_cmd {
+    LL_CMD_READ,        // Sequential read, any length
+    LL_CMD_WRITE,       // Page write burst, up to one page
+    LL_CMD_ERASE,       // Erase command
+    LL_CMD_POLL         // One ACK poll or status read
+};
+
+/*
+    This function returns how many address bytes the part takes.
+*/
+static int ll_bus_addr_bytes(const struct ll_dev *ll) {
+    return ll->config.size <= 256 ? 1 : ll->config.size <= 65536 ? 2 : 3;
+}
+
+/*
+    This function counts the transactions of one command on the bus of
+    an image and returns how many bytes it puts on the wire:
+    - LL_BUS_I2C: a read is the device address, the word address, a
+      repeated start with the device address and the data. A write is
+      the device address, the word address and the data. A poll is the
+      device address, until the part ACKs it. There is no erase
+      command, the caller writes erased pages instead.
+    - LL_BUS_SPI: a read is READ, the address and the data. A write or
+      an erase is a WREN transaction, then WRITE (or PE) and the
+      address, plus the data for a write. A poll is RDSR and the status.
+    - LL_BUS_NONE: only the data, nothing is counted.
+
+    @param *ll: The image
+    @param cmd: The command
+    @param len: Data bytes
+
+    @return: Bytes on the wire
+*/
+static size_t ll_bus_command(struct ll_dev *ll, enum ll_bus_cmd cmd, size_t len) {
+    const int a = ll_bus_addr_bytes(ll);
+    size_t bytes = len;
+    int trans = 1;
+
+    switch (ll->config.bus) {
+    case LL_BUS_NONE:
+        return len;
+    case LL_BUS_I2C:
+        bytes += cmd == LL_CMD_READ ? 2 + a : cmd == LL_CMD_POLL ? 1 : 1 + a;
+        break;
+    case LL_BUS_SPI:
+        if (cmd == LL_CMD_WRITE || cmd == LL_CMD_ERASE) {
+            bytes += 1;
+            trans++;
+        }
+        bytes += cmd == LL_CMD_POLL ? 2 : 1 + a;
+        break;
+    }
+    stats_add(STAT_BUS_TRANSACTIONS, trans);
+    stats_add(STAT_BUS_BYTES, bytes);
+    if (cmd == LL_CMD_POLL) {
+        stats_add(STAT_BUS_POLLS, 1);
+    }
+    return bytes;
+}
+
+/*
+    This function charges one transfer to the timing model and sleeps
+    until the part would have completed it. The bus carries one transfer
+    at a time, and no transfer starts before the write cycle of an
+    earlier write is over, which is what polling for an ACK amounts to.
+    A write then starts a write cycle of page_write_ns per page.
+    With a bus and busy = 1, the polls sent while waiting for the write
+    cycle are counted, one per poll transfer time.
+
+    @param *ll: The image being accessed
+    @param len: Bytes transferred
+    @param num_page: Pages written, 0 for a read
+*/
+static void ll_timing_charge(struct ll_dev *ll, size_t len, int num_page) {
+    const struct ll_timing *t = &ll->config.timing;
+    if (t->byte_ns == 0 && t->page_write_ns == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&ll->timing_lock);
+    uint64_t start = ll_now();
+    if (start < ll->bus_free) {
+        start = ll->bus_free;
+    }
+    if (start < ll->ready) {
+        if (t->busy && ll->config.bus != LL_BUS_NONE) {
+            size_t poll = ll_bus_command(ll, LL_CMD_POLL, 0);
+            uint64_t poll_ns = poll * t->byte_ns;
+            uint64_t polls = poll_ns > 0 ? (ll->ready - start + poll_ns - 1) / poll_ns : 1;
+            // The last poll is the one that gets through
+            while (polls-- > 1) {
+                ll_bus_command(ll, LL_CMD_POLL, 0);
+            }
+        }
+        start = ll->ready;
+    }
+    uint64_t end = start + (uint64_t)len * t->byte_ns;
+    ll->bus_free = end;
+    if (num_page > 0) {
+        ll->ready = end + (uint64_t)num_page * t->page_write_ns;
+        if (!t->busy) {
+            end = ll->ready;
+        }
+    }
+    pthread_mutex_unlock(&ll->timing_lock);
+    ll_sleep_until(end);
+}
+
+/*
+    This function changes the timing model of an open image. Passing
+    NULL turns it off.
+
+    @param *ll: The image
+    @param *timing: The new timing, or NULL
+*/
+void ll_dev_set_timing(struct ll_dev *ll, const struct ll_timing *timing) {
+    pthread_mutex_lock(&ll->timing_lock);
+    if (timing != NULL) {
+        ll->config.timing = *timing;
+    } else {
+        memset(&ll->config.timing, 0, sizeof(ll->config.timing));
+    }
+    pthread_mutex_unlock(&ll->timing_lock);
+}
+
+/*
+    This function extends a file shorter than size to size bytes of
+    LL_ERASED_BYTE, so the new bytes read the same in every mode.
+
+    @return: 0 for success, -1 for failure to write the file
+*/
+static int ll_extend(int fd, uint32_t size) {
+    char fill[4096];
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    memset(fill, LL_ERASED_BYTE, sizeof(fill));
+    for (off_t pos = st.st_size; pos < size; ) {
+        size_t n = size - pos < sizeof(fill) ? size - pos : sizeof(fill);
+        ssize_t done = pwrite(fd, fill, n, pos);
+        if (done < 0) {
+            return -1;
+        }
+        pos += done;
+    }
+    return 0;
+}
+
+/*
+    This function opens the image file described by config and keeps it
+    open until ll_dev_close. Passing NULL opens LL_DEFAULT_PATH with
+    LL_DEFAULT_SIZE bytes in LL_MODE_MMAP. The file is created if it
+    does not exist, and extended to config->size with erased bytes if it
+    is shorter (a mapping cannot be accessed past the end of the file).
+
+    @param *config: Backing store configuration, or NULL for defaults
+
+    @return: The open image, or NULL if the path does not fit in
+             ll_dev.path, or if the file could not be opened, sized or
+             mapped
+*/
+struct ll_dev *ll_dev_open(const struct ll_config *config) {
+    struct ll_config defaults = {
+        .path = LL_DEFAULT_PATH,
+        .size = LL_DEFAULT_SIZE,
+        .page_size = LL_DEFAULT_PAGE_SIZE,
+        .mode = LL_MODE_MMAP,
+        .sync = LL_SYNC_NONE,
+    };
+    if (config == NULL) {
+        config = &defaults;
+    }
+
+    // A truncated copy of the path would name another file
+    if (strlen(config->path) >= sizeof(((struct ll_dev *)NULL)->path)) {
+        printf("ERROR: Image path is too long!\n");
+        return NULL;
+    }
     errno = 0;
-    fp = fopen("/home/vm349/Desktop/eeprom/test.txt", "r");
-    if (fp == NULL) {
-        printf("Null fp %d\n", errno);
+    int fd = open(config->path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("ERROR: Cannot open %s (%d)\n", config->path, errno);
+        return NULL;
+    }
+    if (ll_extend(fd, config->size) != 0) {
+        printf("ERROR: Cannot size %s (%d)\n", config->path, errno);
+        close(fd);
+        return NULL;
+    }
+
+    char *map = NULL;
+    if (config->mode == LL_MODE_MMAP) {
+        map = mmap(NULL, config->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            printf("ERROR: Cannot map %s (%d)\n", config->path, errno);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    struct ll_dev *ll = calloc(1, sizeof(*ll));
+    ll->fd = fd;
+    ll->map = map;
+    ll->config = *config;
+    // Keep our own copy of the path, the caller's string may go away
+    snprintf(ll->path, sizeof(ll->path), "%s", config->path);
+    ll->config.path = ll->path;
+    if (ll->config.page_size == 0) {
+        ll->config.page_size = LL_DEFAULT_PAGE_SIZE;
+    }
+    pthread_mutex_init(&ll->timing_lock, NULL);
+    return ll;
+}
+
+/*
+    This function flushes and closes an image opened by ll_dev_open.
+
+    @param *ll: The image to close
+*/
+void ll_dev_close(struct ll_dev *ll) {
+    if (ll == NULL) {
+        return;
+    }
+    ll_dev_sync(ll);
+    if (ll->map != NULL) {
+        munmap(ll->map, ll->config.size);
+    }
+    close(ll->fd);
+    pthread_mutex_destroy(&ll->timing_lock);
+    free(ll);
+}
+
+/*
+    This function pushes every written page of an image to stable
+    storage.
+
+    @param *ll: The image to sync
+
+    @return: 0 for success. -1 for failure
+*/
+int ll_dev_sync(struct ll_dev *ll) {
+    if (ll->map != NULL) {
+        return msync(ll->map, ll->config.size, MS_SYNC) == 0 ? 0 : -1;
+    }
+    return fdatasync(ll->fd) == 0 ? 0 : -1;
+}
+
+/*
+    This function copies len bytes of the image into buf.
+*/
+static int ll_load(struct ll_dev *ll, uint32_t offset, size_t len, char *buf) {
+    if (ll->map != NULL) {
+        memcpy(buf, ll->map + offset, len);
+        return 0;
+    }
+
+    ssize_t n = pread(ll->fd, buf, len, offset);
+    if (n < 0) {
         return -1;
     }
-    
-    // This function moves the current pointer to the offset
-    fseek(fp, offset, SEEK_SET);
-    
-    // Using fgetc to store value and not fgets as fgets appends a NULL
-    // character at the end, which would always limit the size of buf 
-    // to 32
+    // Bytes past the end of a file shortened since it was opened read
+    // back as EOF (LL_ERASED_BYTE), same as fgetc did
+    if (n < len) {
+        memset(buf + n, EOF, len - n);
+    }
+    return 0;
+}
+
+/*
+    This function pushes len bytes just written at offset to stable
+    storage with LL_SYNC_WRITE, and does nothing otherwise.
+
+    @return: 0 for success. -1 if msync or fdatasync failed
+*/
+static int ll_sync_range(struct ll_dev *ll, uint32_t offset, size_t len) {
+    if (ll->config.sync != LL_SYNC_WRITE) {
+        return 0;
+    }
+    if (ll->map != NULL) {
+        // msync wants a page aligned address
+        long pg = sysconf(_SC_PAGESIZE);
+        uint32_t start = offset - (offset % pg);
+        return msync(ll->map + start, offset + len - start, MS_SYNC) == 0 ? 0 : -1;
+    }
+    return fdatasync(ll->fd) == 0 ? 0 : -1;
+}
+
+/*
+    This function copies len bytes from buf into the image.
+*/
+static int ll_store(struct ll_dev *ll, uint32_t offset, size_t len, const char *buf) {
+    if (ll->map != NULL) {
+        memcpy(ll->map + offset, buf, len);
+    } else if (pwrite(ll->fd, buf, len, offset) != len) {
+        return -1;
+    }
+    return ll_sync_range(ll, offset, len);
+}
+
+/*
+    This function reads num_page consecutive pages starting at offset
+    in one transfer. The parameter offset must be a multiple of the
+    page size.
+
+    @param *ll: The image to read from
+    @param offset: Amount of offset from the beginning of the image
+    @param num_page: Number of pages to read
+    @param *buf: The buffer to store num_page pages
+
+    @return: 0 for success. -1 for failure to read the file
+    @return: -2 for offset out of bound
+*/
+int ll_dev_read_pages(struct ll_dev *ll, uint32_t offset, int num_page, char *buf) {
+    size_t len = (size_t)num_page * ll->config.page_size;
+    if (num_page <= 0 || offset + len > ll->config.size) {
+        return -2;
+    }
+    ll_timing_charge(ll, ll_bus_command(ll, LL_CMD_READ, len), 0);
+    stats_add(STAT_PAGE_READS, num_page);
+    return ll_load(ll, offset, len, buf);
+}
+
+/*
+    This function reads len bytes starting at any offset with one
+    sequential read command, which runs across page boundaries. It is
+    what the span engine uses on a bus (see ll_config.bus), so an access
+    costs one transaction and no bytes it does not want.
+
+    @param *ll: The image to read from
+    @param offset: Amount of offset from the beginning of the image
+    @param len: Bytes to read
+    @param *buf: The buffer to store len bytes
+
+    @return: 0 for success. -1 for failure to read the file
+    @return: -2 for offset out of bound
+*/
+int ll_dev_read_bytes(struct ll_dev *ll, uint32_t offset, size_t len, char *buf) {
+    if (len == 0 || offset + len > ll->config.size) {
+        return -2;
+    }
+    ll_timing_charge(ll, ll_bus_command(ll, LL_CMD_READ, len), 0);
+    return ll_load(ll, offset, len, buf);
+}
+
+/*
+    This function does the transfer of ll_dev_write_pages once the
+    parameters are checked. On a bus every page is its own write burst
+    with its own write cycle.
+*/
+static int ll_dev_program(struct ll_dev *ll, uint32_t offset, int num_page, const char *buf) {
+    size_t len = (size_t)num_page * ll->config.page_size;
     int i;
-    for (i = 0; i < 32; i++) {
-        buf[i] = fgetc(fp);
+
+    if (ll->config.bus == LL_BUS_NONE) {
+        ll_timing_charge(ll, len, num_page);
+    } else {
+        for (i = 0; i < num_page; i++) {
+            ll_timing_charge(ll, ll_bus_command(ll, LL_CMD_WRITE, ll->config.page_size), 1);
+        }
     }
+    stats_add(STAT_PAGE_WRITES, num_page);
+    return ll_store(ll, offset, len, buf);
+}
 
-    fclose(fp);
+/*
+    This function writes num_page consecutive pages starting at offset
+    in one transfer. The parameter offset must be a multiple of the
+    page size.
+
+    @param *ll: The image to write to
+    @param offset: Amount of offset from the beginning of the image
+    @param num_page: Number of pages to write
+    @param *buf: The buffer holding num_page pages
+
+    @return: 0 for success. -1 for failure to write the file, or for a
+             simulated power loss (see ll_dev_fail_after)
+    @return: -2 for offset out of bound
+*/
+int ll_dev_write_pages(struct ll_dev *ll, uint32_t offset, int num_page, const char *buf) {
+    size_t len = (size_t)num_page * ll->config.page_size;
+    if (num_page <= 0 || offset + len > ll->config.size) {
+        return -2;
+    }
+    if (ll->fail_armed) {
+        int left = __atomic_load_n(&ll->fail_pages_left, __ATOMIC_RELAXED);
+        while (left > 0 && !__atomic_compare_exchange_n(&ll->fail_pages_left, &left,
+                                                       left - (num_page < left ? num_page : left),
+                                                       0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+        if (num_page > left) {
+            // Power is lost in the middle of the transfer, the pages
+            // before that point made it to the image
+            if (left > 0) {
+                ll_dev_program(ll, offset, left, buf);
+            }
+            return -1;
+        }
+    }
+    return ll_dev_program(ll, offset, num_page, buf);
+}
+
+/*
+    This function writes len bytes starting at any offset with one write
+    burst per page they touch, so a partial page is written without
+    reading it first. It is what the span engine uses on a bus (see
+    ll_config.bus). Every burst is a page write to ll_dev_fail_after.
+
+    @param *ll: The image to write to
+    @param offset: Amount of offset from the beginning of the image
+    @param len: Bytes to write
+    @param *buf: The buffer holding len bytes
+
+    @return: 0 for success. -1 for failure to write the file, or for a
+             simulated power loss (see ll_dev_fail_after)
+    @return: -2 for offset out of bound
+*/
+int ll_dev_write_bytes(struct ll_dev *ll, uint32_t offset, size_t len, const char *buf) {
+    const uint32_t page_size = ll->config.page_size;
+    size_t done = 0;
+
+    if (len == 0 || offset + len > ll->config.size) {
+        return -2;
+    }
+    while (done < len) {
+        // A burst wraps around within its page, so it stops at the end
+        size_t n = page_size - (offset + done) % page_size;
+        if (n > len - done) {
+            n = len - done;
+        }
+        if (ll->fail_armed) {
+            int left = __atomic_load_n(&ll->fail_pages_left, __ATOMIC_RELAXED);
+            while (left > 0 && !__atomic_compare_exchange_n(&ll->fail_pages_left, &left, left - 1,
+                                                           0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+            if (left == 0) {
+                return -1;
+            }
+        }
+        ll_timing_charge(ll, ll_bus_command(ll, LL_CMD_WRITE, n), 1);
+        stats_add(STAT_PAGE_WRITES, 1);
+        if (ll_store(ll, offset + done, n, buf + done) != 0) {
+            return -1;
+        }
+        done += n;
+    }
     return 0;
 }
 
 /*
-    This function is supposed to mimic the behavior of a low level
-    write function using File IO. The function writes 32 bytes into
-    file test.txt with the beginning index equaling to offset. 
-    The parameter offset must be a multiple of 32.
-    
-    @param offset: Amount of offset from the beginning of the file
-    @param *buf: The buffer to write bytes into the file
-    
-    @return: 0 for success. -1 for failure to open the file
+    This function erases num_page consecutive pages starting at offset,
+    so every byte reads back as LL_ERASED_BYTE. The part is charged one
+    erase command and one write cycle per page (a write burst on
+    LL_BUS_I2C, which has no erase command), while the image is filled
+    with a single memset or pwrite instead of a write per page. The
+    parameter offset must be a multiple of the page size.
+
+    @param *ll: The image to erase
+    @param offset: Amount of offset from the beginning of the image
+    @param num_page: Number of pages to erase
+
+    @return: 0 for success. -1 for failure to write the file, or for a
+             simulated power loss (see ll_dev_fail_after)
+    @return: -2 for offset out of bound
 */
-int ll_write(uint32_t offset, char *buf) {
-    FILE *fp;
-    errno = 0;
-    fp = fopen("/home/vm349/Desktop/eeprom/test.txt", "r+");
-    if (fp == NULL) {
-        printf("Null fp %d\n", errno);
+int ll_dev_erase(struct ll_dev *ll, uint32_t offset, int num_page) {
+    size_t len = (size_t)num_page * ll->config.page_size;
+    int ret = 0;
+
+    if (num_page <= 0 || offset + len > ll->config.size) {
+        return -2;
+    }
+    if (ll->fail_armed && __atomic_load_n(&ll->fail_pages_left, __ATOMIC_RELAXED) == 0) {
         return -1;
     }
-    
-    // This function moves the current pointer to the offset
-    fseek(fp, offset, SEEK_SET);
-    
-    int i;
-    for (i = 0; i < 32; i++) {
-        fputc(buf[i], fp);
+    for (int i = 0; i < num_page; i++) {
+        if (ll->config.bus == LL_BUS_I2C) {
+            // No erase command, the page is written with erased bytes
+            ll_timing_charge(ll, ll_bus_command(ll, LL_CMD_WRITE, ll->config.page_size), 1);
+        } else if (ll->config.bus == LL_BUS_SPI) {
+            ll_timing_charge(ll, ll_bus_command(ll, LL_CMD_ERASE, 0), 1);
+        } else {
+            // Command and address bytes, then the write cycle
+            ll_timing_charge(ll, 4, 1);
+        }
+    }
+    stats_add(STAT_PAGE_ERASES, num_page);
+
+    if (ll->map != NULL) {
+        memset(ll->map + offset, LL_ERASED_BYTE, len);
+        return ll_sync_range(ll, offset, len);
     }
 
-    fclose(fp);
+    char *fill = malloc(len);
+    memset(fill, LL_ERASED_BYTE, len);
+    if (pwrite(ll->fd, fill, len, offset) != len) {
+        ret = -1;
+    } else {
+        ret = ll_sync_range(ll, offset, len);
+    }
+    free(fill);
+    return ret;
+}
+
+/*
+    This function simulates a power loss for crash tests: the next pages
+    page writes reach the image, then every write fails without touching
+    it. A multi-page transfer crossing that point is torn, its first
+    pages are written and the rest are not.
+
+    @param *ll: The image
+    @param pages: Page writes to let through, negative to turn the
+                  simulation off
+*/
+void ll_dev_fail_after(struct ll_dev *ll, int pages) {
+    __atomic_store_n(&ll->fail_pages_left, pages < 0 ? 0 : pages, __ATOMIC_RELAXED);
+    ll->fail_armed = pages >= 0;
+}
+
+/*
+    This function opens the image used by the functions without a
+    handle (ll_read, ll_write, ...). A previously opened default image
+    is closed first. It must not be called while other threads are
+    accessing the default image.
+
+    @param *config: Backing store configuration, or NULL for defaults
+
+    @return: 0 for success. -1 for failure to open the image
+*/
+int ll_open(const struct ll_config *config) {
+    struct ll_dev *ll = ll_dev_open(config);
+    if (ll == NULL) {
+        return -1;
+    }
+    ll_close();
+    ll_default = ll;
+    return 0;
+}
+
+/*
+    This function flushes and closes the default image.
+
+    @return: 0 for success. -1 if nothing was open
+*/
+int ll_close() {
+    if (ll_default == NULL) {
+        return -1;
+    }
+    ll_dev_close(ll_default);
+    ll_default = NULL;
     return 0;
 }
 
+/*
+    This function pushes every written page of the default image to
+    stable storage.
+
+    @return: 0 for success. -1 for failure
+*/
+int ll_sync() {
+    struct ll_dev *ll = ll_default_dev();
+    return ll != NULL ? ll_dev_sync(ll) : -1;
+}
+
+/*
+    This function is supposed to mimic the behavior of a low level
+    read function. The function reads one page from the default
+    image with the beginning index equaling to offset.
+    The parameter offset must be a multiple of the page size.
+
+    @param offset: Amount of offset from the beginning of the image
+    @param *buf: The buffer to store the read bytes
+
+    @return: 0 for success. -1 for failure to open the file
+    @return: -2 for offset out of bound
+*/
+int ll_read(uint32_t offset, char *buf) {
+    return ll_read_pages(offset, 1, buf);
+}
+
+/*
+    This function is supposed to mimic the behavior of a low level
+    write function. The function writes one page into the default
+    image with the beginning index equaling to offset.
+    The parameter offset must be a multiple of the page size.
+
+    @param offset: Amount of offset from the beginning of the image
+    @param *buf: The buffer to write bytes into the image
+
+    @return: 0 for success. -1 for failure to open or write the file
+    @return: -2 for offset out of bound
+*/
+int ll_write(uint32_t offset, const char *buf) {
+    return ll_write_pages(offset, 1, buf);
+}
+
+/*
+    This function reads num_page consecutive pages of the default image,
+    see ll_dev_read_pages.
+*/
+int ll_read_pages(uint32_t offset, int num_page, char *buf) {
+    struct ll_dev *ll = ll_default_dev();
+    return ll != NULL ? ll_dev_read_pages(ll, offset, num_page, buf) : -1;
+}
+
+/*
+    This function writes num_page consecutive pages of the default
+    image, see ll_dev_write_pages.
+*/
+int ll_write_pages(uint32_t offset, int num_page, const char *buf) {
+    struct ll_dev *ll = ll_default_dev();
+    return ll != NULL ? ll_dev_write_pages(ll, offset, num_page, buf) : -1;
+}
+
 /*
     This function is supposed to mimic the behavior of a low level
     eeprom reset function. EEPROM resets by providing the memory
     with a slightly higher voltage than VCC, which wipes the entire
-    memory. I did not write the code for this as it would be outside
-    the scope of this prompt.
+    memory. Here the whole default image is erased with a single
+    ll_dev_erase, see there.
 */
 void ll_eeprom_reset() {
-    // This is where the code to raise the voltage woule be
-    // raise_voltage_all();
-    return;
+    struct ll_dev *ll = ll_default_dev();
+    if (ll != NULL) {
+        ll_dev_erase(ll, 0, ll->config.size / ll->config.page_size);
+    }
 }
-